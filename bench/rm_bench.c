@@ -0,0 +1,384 @@
+// * Benchmark suite behind `make bench`. Generates rasm workloads, then
+// * times assembling them, loading the bytecode and executing it on every
+// * available engine. Results are appended as CSV and JSON lines so runs
+// * of different commits can be compared.
+#define SV_IMPLEMENTATION
+#define RM_IMPLEMENTATION
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "../sv.h"
+#include "../rasm.h"
+
+#define BENCH_ROUNDS 5
+
+typedef struct {
+    const char *name;
+    void (*generate)(FILE *f, uint64_t size);
+    uint64_t size;
+} Workload;
+
+typedef struct {
+    FILE *csv;
+    FILE *json;
+    const char *commit;
+} Results;
+
+static double now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// * Counter loop, size is the number of iterations
+static void generate_counter(FILE *f, uint64_t size) {
+    fprintf(f, "main:\n");
+    fprintf(f, "    push 0\n");
+    fprintf(f, "loop:\n");
+    fprintf(f, "    push 1\n");
+    fprintf(f, "    plusi\n");
+    fprintf(f, "    dup 0\n");
+    fprintf(f, "    push %"PRIu64"\n", size);
+    fprintf(f, "    lt\n");
+    fprintf(f, "    jmp_if loop\n");
+    fprintf(f, "    halt\n");
+}
+
+// * A chain of comparisons on i % 16 per iteration, every jump goes a
+// * different way depending on the iteration
+#define BRANCHES_CHAIN 8
+
+static void generate_branches(FILE *f, uint64_t size) {
+    fprintf(f, "main:\n");
+    fprintf(f, "    push 0\n");
+    fprintf(f, "loop:\n");
+    fprintf(f, "    dup 0\n");
+    fprintf(f, "    push %d\n", BRANCHES_CHAIN * 2);
+    fprintf(f, "    modi\n");
+    for(int k = 1; k <= BRANCHES_CHAIN; ++k) {
+	fprintf(f, "    dup 0\n");
+	fprintf(f, "    push %d\n", k * 2);
+	fprintf(f, "    lt\n");
+	fprintf(f, "    jmp_if below_%d\n", k);
+    }
+    fprintf(f, "    push 0\n");
+    fprintf(f, "    jmp join\n");
+    for(int k = 1; k <= BRANCHES_CHAIN; ++k) {
+	fprintf(f, "below_%d:\n", k);
+	fprintf(f, "    push %d\n", k);
+	fprintf(f, "    jmp join\n");
+    }
+    // * Fold the remainder and the branch value away, there is no drop
+    fprintf(f, "join:\n");
+    fprintf(f, "    plusi\n");
+    fprintf(f, "    push 0\n");
+    fprintf(f, "    muli\n");
+    fprintf(f, "    plusi\n");
+    fprintf(f, "    push 1\n");
+    fprintf(f, "    plusi\n");
+    fprintf(f, "    dup 0\n");
+    fprintf(f, "    push %"PRIu64"\n", size);
+    fprintf(f, "    lt\n");
+    fprintf(f, "    jmp_if loop\n");
+    fprintf(f, "    halt\n");
+}
+
+// * Every iteration copies values from deep down a big stack and folds
+// * them back, size is the number of iterations
+#define STACK_DEPTH 512
+#define STACK_WIDTH 16
+
+static void generate_stack(FILE *f, uint64_t size) {
+    fprintf(f, "main:\n");
+    for(int i = 0; i < STACK_DEPTH; ++i) {
+	fprintf(f, "    push %d\n", i);
+    }
+    fprintf(f, "    push 0\n");
+    fprintf(f, "loop:\n");
+    for(int i = 0; i < STACK_WIDTH; ++i) {
+	fprintf(f, "    dup %d\n", STACK_DEPTH);
+    }
+    for(int i = 1; i < STACK_WIDTH; ++i) {
+	fprintf(f, "    plusi\n");
+    }
+    fprintf(f, "    push 0\n");
+    fprintf(f, "    muli\n");
+    fprintf(f, "    plusi\n");
+    fprintf(f, "    push 1\n");
+    fprintf(f, "    plusi\n");
+    fprintf(f, "    dup 0\n");
+    fprintf(f, "    push %"PRIu64"\n", size);
+    fprintf(f, "    lt\n");
+    fprintf(f, "    jmp_if loop\n");
+    fprintf(f, "    halt\n");
+}
+
+// * A huge straight line program, size is the number of labels. Every
+// * block refers forward to the next label and back to its own, and
+// * takes its value from one of a set of constants.
+#define LABELS_CONSTS 64
+
+static void generate_labels(FILE *f, uint64_t size) {
+    for(int i = 0; i < LABELS_CONSTS; ++i) {
+	fprintf(f, "%%const K%d %d\n", i, i);
+    }
+    fprintf(f, "main:\n");
+    fprintf(f, "    push 0\n");
+    for(uint64_t i = 0; i < size; ++i) {
+	fprintf(f, "block_%"PRIu64":\n", i);
+	fprintf(f, "    push K%"PRIu64"    ; block %"PRIu64"\n", i % LABELS_CONSTS, i);
+	fprintf(f, "    plusi\n");
+	fprintf(f, "    dup 0\n");
+	fprintf(f, "    push 0\n");
+	fprintf(f, "    gte\n");
+	fprintf(f, "    jmp_if block_%"PRIu64"\n", i + 1);
+	fprintf(f, "    jmp block_%"PRIu64"\n", i);
+    }
+    fprintf(f, "block_%"PRIu64":\n", size);
+    fprintf(f, "    halt\n");
+}
+
+static char *path_join(const char *dir, const char *name, const char *ext) {
+    size_t n = strlen(dir) + strlen(name) + strlen(ext) + 2;
+    char *path = malloc(n);
+    if(path == NULL) {
+	fprintf(stderr, "ERROR: could not allocate a path\n");
+	exit(1);
+    }
+    snprintf(path, n, "%s/%s%s", dir, name, ext);
+    return path;
+}
+
+static uint64_t count_lines(const char *path) {
+    FILE *f = fopen(path, "r");
+    if(f == NULL) {
+	fprintf(stderr, "ERROR: could not open file `%s`: %s\n", path, strerror(errno));
+	exit(1);
+    }
+    uint64_t lines = 0;
+    int c;
+    while((c = fgetc(f)) != EOF) {
+	if(c == '\n') lines += 1;
+    }
+    fclose(f);
+    return lines;
+}
+
+static void record(Results *results, const char *workload, const char *metric,
+		   const char *variant, double value, const char *unit) {
+    printf("%-10s %-10s %-22s %16.1f %s\n", workload, metric, variant, value, unit);
+    if(results->csv != NULL) {
+	fprintf(results->csv, "%s,%s,%s,%s,%.1f,%s\n",
+		results->commit, workload, metric, variant, value, unit);
+    }
+    if(results->json != NULL) {
+	fprintf(results->json,
+		"{\"commit\":\"%s\",\"workload\":\"%s\",\"metric\":\"%s\","
+		"\"variant\":\"%s\",\"value\":%.1f,\"unit\":\"%s\"}\n",
+		results->commit, workload, metric, variant, value, unit);
+    }
+}
+
+// * Assembles source into the plain and the fused program, returns the
+// * best translation time
+static double assemble(const char *source, const char *plain, const char *fused) {
+    Rasm *rasm = calloc(1, sizeof(*rasm));
+    if(rasm == NULL) {
+	fprintf(stderr, "ERROR: could not allocate the assembler\n");
+	exit(1);
+    }
+
+    double best = 0.0;
+    for(int round = 0; round < BENCH_ROUNDS; ++round) {
+	double start = now_secs();
+	rasm_translate_source(rasm, SV(source));
+	double elapsed = now_secs() - start;
+	if(round == 0 || elapsed < best) best = elapsed;
+
+	if(round + 1 == BENCH_ROUNDS) {
+	    rasm_save_to_file(rasm, SV(plain), RM_ENCODING_COMPACT);
+	    size_t counts[FUSE_COUNT];
+	    rasm_fuse_program(rasm, counts);
+	    rasm_save_to_file(rasm, SV(fused), RM_ENCODING_RAW);
+	}
+	rasm_free(rasm);
+    }
+    free(rasm);
+    return best;
+}
+
+static double load(Rm_Program *program, const char *path) {
+    double best = 0.0;
+    for(int round = 0; round < BENCH_ROUNDS; ++round) {
+	double start = now_secs();
+	rm_load_program_from_file(program, path);
+	double elapsed = now_secs() - start;
+	if(round == 0 || elapsed < best) best = elapsed;
+    }
+    return best;
+}
+
+// * Instructions a run of the program executes, stepped one at a time
+static uint64_t count_executed(const Rm_Program *program, Rm *rm) {
+    uint64_t executed = 0;
+    rm_init(rm, program);
+    while(!rm->halt) {
+	Err err = rm_execute_inst(rm);
+	if(err != ERR_OK) {
+	    fprintf(stderr, "ERROR: benchmark program failed: %s\n", err_as_cstr(err));
+	    exit(1);
+	}
+	executed += 1;
+    }
+    return executed;
+}
+
+static void execute(Results *results, const char *workload, const char *suffix, Rm_Program *program, Rm *rm) {
+    const uint64_t executed = count_executed(program, rm);
+    for(int i = 0; i < RM_ENGINE_COUNT; ++i) {
+	Rm_Engine engine = (Rm_Engine)i;
+	if(engine == RM_ENGINE_JIT && !rm_prepare_jit(program)) {
+	    continue;
+	}
+
+	// * Unlimited, then with a budget of exactly what the program needs
+	for(int budgeted = 0; budgeted < 2; ++budgeted) {
+	    if(budgeted && executed > INT_MAX) {
+		continue;
+	    }
+	    const int limit = budgeted ? (int)executed : -1;
+
+	    double best = 0.0;
+	    for(int round = 0; round < BENCH_ROUNDS; ++round) {
+		rm_init(rm, program);
+		double start = now_secs();
+		Err err = rm_execute_program_with(rm, engine, limit);
+		double elapsed = now_secs() - start;
+		if(err != ERR_OK || !rm->halt) {
+		    fprintf(stderr, "ERROR: %s failed on the %s engine: %s\n",
+			    workload, engine_as_cstr(engine), err_as_cstr(err));
+		    exit(1);
+		}
+		if(round == 0 || elapsed < best) best = elapsed;
+	    }
+
+	    char variant[64];
+	    snprintf(variant, sizeof(variant), "%s%s%s", engine_as_cstr(engine), suffix,
+		     budgeted ? "-budget" : "");
+	    record(results, workload, "execute", variant, (double)executed / best, "insts/s");
+	}
+    }
+}
+
+static Rm_Program program = {0};
+static Rm rm = {0};
+
+static void run_workload(Results *results, const char *dir, const Workload *workload) {
+    char *source = path_join(dir, workload->name, ".rasm");
+    char *plain = path_join(dir, workload->name, ".rm");
+    char *fused = path_join(dir, workload->name, "-fused.rm");
+
+    FILE *f = fopen(source, "w");
+    if(f == NULL) {
+	fprintf(stderr, "ERROR: could not open file `%s`: %s\n", source, strerror(errno));
+	exit(1);
+    }
+    workload->generate(f, workload->size);
+    fclose(f);
+
+    const uint64_t lines = count_lines(source);
+    double assembled = assemble(source, plain, fused);
+    record(results, workload->name, "assemble", "rasm", (double)lines / assembled, "lines/s");
+
+    record(results, workload->name, "load", "compact", load(&program, plain) * 1e6, "us");
+    execute(results, workload->name, "", &program, &rm);
+
+    record(results, workload->name, "load", "raw-fused", load(&program, fused) * 1e6, "us");
+    execute(results, workload->name, "-fused", &program, &rm);
+
+    rm_unload_program(&program);
+    free(source);
+    free(plain);
+    free(fused);
+}
+
+static FILE *open_results(const char *path, const char *header) {
+    FILE *f = fopen(path, "a");
+    if(f == NULL) {
+	fprintf(stderr, "ERROR: could not open file `%s`: %s\n", path, strerror(errno));
+	exit(1);
+    }
+    if(header != NULL && ftell(f) == 0) {
+	fprintf(f, "%s\n", header);
+    }
+    return f;
+}
+
+static void usage(void) {
+    fprintf(stdout, "Usage: ./rm_bench [-d dir] [-o results.csv] [-json results.jsonl] [-commit id] [-scale factor]\n");
+    fprintf(stdout, "    -d         directory for the generated workloads (default: .)\n");
+    fprintf(stdout, "    -o         append the results to a CSV file\n");
+    fprintf(stdout, "    -json      append the results to a file, one JSON object per line\n");
+    fprintf(stdout, "    -commit    tag the results, usually with the commit hash\n");
+    fprintf(stdout, "    -scale     multiply the workload sizes, < 1 for a quick run\n");
+}
+
+int main(int argc, char **argv) {
+    const char *dir = ".";
+    const char *csv_path = NULL;
+    const char *json_path = NULL;
+    double scale = 1.0;
+    Results results = { .commit = "unknown" };
+
+    for(int i = 1; i < argc; ++i) {
+	const char *arg = argv[i];
+	const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+	if(value == NULL) {
+	    fprintf(stderr, "ERROR: unexpected argument `%s`\n", arg);
+	    usage();
+	    exit(1);
+	}
+	if(strcmp(arg, "-d") == 0) dir = value;
+	else if(strcmp(arg, "-o") == 0) csv_path = value;
+	else if(strcmp(arg, "-json") == 0) json_path = value;
+	else if(strcmp(arg, "-commit") == 0) results.commit = value;
+	else if(strcmp(arg, "-scale") == 0) scale = atof(value);
+	else {
+	    fprintf(stderr, "ERROR: unexpected argument `%s`\n", arg);
+	    usage();
+	    exit(1);
+	}
+	i += 1;
+    }
+    if(scale <= 0.0) {
+	fprintf(stderr, "ERROR: `-scale` expects a positive factor\n");
+	exit(1);
+    }
+
+    if(mkdir(dir, 0755) < 0 && errno != EEXIST) {
+	fprintf(stderr, "ERROR: could not create directory `%s`: %s\n", dir, strerror(errno));
+	exit(1);
+    }
+    if(csv_path != NULL) {
+	results.csv = open_results(csv_path, "commit,workload,metric,variant,value,unit");
+    }
+    if(json_path != NULL) {
+	results.json = open_results(json_path, NULL);
+    }
+
+    Workload workloads[] = {
+	{ .name = "counter",  .generate = generate_counter,  .size = 10000000 },
+	{ .name = "branches", .generate = generate_branches, .size = 1000000 },
+	{ .name = "stack",    .generate = generate_stack,    .size = 500000 },
+	{ .name = "labels",   .generate = generate_labels,   .size = 30000 },
+    };
+    for(size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); ++i) {
+	workloads[i].size = (uint64_t)((double)workloads[i].size * scale);
+	if(workloads[i].size == 0) workloads[i].size = 1;
+	run_workload(&results, dir, &workloads[i]);
+    }
+
+    if(results.csv != NULL) fclose(results.csv);
+    if(results.json != NULL) fclose(results.json);
+    return 0;
+}
@@ -0,0 +1,139 @@
+// * Micro-benchmark of the assembler front end: lexing a generated rasm
+// * source with the byte-at-a-time String_View functions the assembler used
+// * to call, against Sv_Scanner.
+#define SV_IMPLEMENTATION
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <time.h>
+#include "../sv.h"
+
+#define BENCH_LINES 1000000
+#define BENCH_ROUNDS 5
+
+static double now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// * The original sv.h loops, kept here as the baseline
+static String_View old_chop_by_delim(String_View *sv, char delim) {
+    size_t i = 0;
+    while(i < sv->count && sv->data[i] != delim) {
+	i += 1;
+    }
+    String_View res = { .count = i, .data = sv->data };
+    if(i < sv->count) {
+	sv->data += i + 1;
+	sv->count -= i + 1;
+    } else {
+	sv->data += i;
+	sv->count -= i;
+    }
+    return res;
+}
+
+static String_View old_trim(String_View sv) {
+    size_t i = 0;
+    while(i < sv.count && isspace(sv.data[i])) i++;
+    sv.data += i;
+    sv.count -= i;
+    i = 0;
+    while(i < sv.count && isspace(sv.data[sv.count - i - 1])) i++;
+    sv.count -= i;
+    return sv;
+}
+
+// * Splits every line the way the assembler did: line, token, operand
+static uint64_t lex_old(String_View source) {
+    uint64_t checksum = 0;
+    while(source.count > 0) {
+	String_View line = old_trim(old_chop_by_delim(&source, '\n'));
+	if(line.count == 0 || *line.data == ';') {
+	    continue;
+	}
+	String_View token = old_trim(old_chop_by_delim(&line, ' '));
+	String_View operand = old_trim(old_chop_by_delim(&line, ';'));
+	checksum += token.count * 31 + operand.count;
+    }
+    return checksum;
+}
+
+static uint64_t lex_scanner(String_View source) {
+    uint64_t checksum = 0;
+    Sv_Scanner scanner;
+    sv_scanner_init(&scanner, source, ';');
+    while(sv_scanner_next_line(&scanner)) {
+	String_View token = sv_scanner_token(&scanner);
+	if(token.count == 0) {
+	    continue;
+	}
+	String_View operand = sv_scanner_rest(&scanner);
+	checksum += token.count * 31 + operand.count;
+    }
+    return checksum;
+}
+
+static String_View generate_source(void) {
+    static const char *const lines[] = {
+	"loop:",
+	"    push 1234567",
+	"    dup 0",
+	"    push some_constant_name   ; with a comment",
+	"    plusi",
+	"    jmp_if loop",
+	"; a comment line that is a bit longer than the instructions around it",
+	"",
+	"    halt",
+    };
+    const size_t lines_count = sizeof(lines) / sizeof(lines[0]);
+
+    size_t capacity = 0;
+    for(size_t i = 0; i < BENCH_LINES; ++i) {
+	capacity += strlen(lines[i % lines_count]) + 1;
+    }
+    char *data = malloc(capacity);
+    if(data == NULL) {
+	fprintf(stderr, "ERROR: could not allocate %zu bytes\n", capacity);
+	exit(1);
+    }
+    size_t size = 0;
+    for(size_t i = 0; i < BENCH_LINES; ++i) {
+	const char *line = lines[i % lines_count];
+	size_t n = strlen(line);
+	memcpy(data + size, line, n);
+	size += n;
+	data[size++] = '\n';
+    }
+    return (String_View) { .count = size, .data = data };
+}
+
+static void report(const char *name, uint64_t (*lex)(String_View), String_View source) {
+    double best = 0.0;
+    uint64_t checksum = 0;
+    for(int round = 0; round < BENCH_ROUNDS; ++round) {
+	double start = now_secs();
+	checksum = lex(source);
+	double elapsed = now_secs() - start;
+	if(round == 0 || elapsed < best) best = elapsed;
+    }
+    printf("%-10s %8.2f ms %8.1f MB/s  checksum %"PRIu64"\n",
+	   name, best * 1e3, (double)source.count / best / 1e6, checksum);
+}
+
+int main(void) {
+    String_View source = generate_source();
+#if defined(__AVX2__)
+    const char *simd = "AVX2";
+#elif defined(__SSE2__)
+    const char *simd = "SSE2";
+#else
+    const char *simd = "scalar";
+#endif
+    printf("%zu bytes, %d lines, scanner: %s\n", source.count, BENCH_LINES, simd);
+    report("old", lex_old, source);
+    report("scanner", lex_scanner, source);
+    free((void *)source.data);
+    return 0;
+}
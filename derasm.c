@@ -1,8 +1,10 @@
 #define SV_IMPLEMENTATION
 #define RM_IMPLEMENTATION
+#define RM_CFG_IMPLEMENTATION
 
 #include "./sv.h"
 #include "./rasm.h"
+#include "./rm_cfg.h"
 
 static const char* shift(int *argc, char ***argv) {
     if(*argc < 0) return NULL;
@@ -13,33 +15,47 @@ static const char* shift(int *argc, char ***argv) {
 }
 
 static void usage(void) {
-    fprintf(stdout, "Usage: ./derasm [file.rm]\n");
+    fprintf(stdout, "Usage: ./derasm [-dot] [file.rm]\n");
+    fprintf(stdout, "    -dot    print the control-flow graph in Graphviz DOT instead of the listing\n");
 }
 
-static Rm rm = {0};
+static Rm_Program program = {0};
 
 int main(int argc, char *argv[]) {
     shift(&argc, &argv);
 
     const char *filepath = shift(&argc, &argv);
+    bool dot = false;
+    if(filepath != NULL && strcmp(filepath, "-dot") == 0) {
+	dot = true;
+	filepath = shift(&argc, &argv);
+    }
     if(filepath == NULL) {
 	fprintf(stderr, "ERROR: please provide a rasm bytecode file\n");
 	usage();
 	exit(1);
     }
 
-    // Load the program into rm->program
-    rm_load_program_from_file(&rm, filepath);
+    // Load the program
+    rm_load_program_from_file(&program, filepath);
         
-    // printf("Size: %ld\n", rm.rm_program_size);
-    if(rm.rm_program_size <= 0) return 0;
+    if(dot) {
+	Rm_Cfg cfg;
+	rm_cfg_build(&cfg, program.insts, program.insts_size);
+	rm_cfg_dump_dot(stdout, &cfg, program.insts);
+	rm_cfg_free(&cfg);
+	return 0;
+    }
+
+    // printf("Size: %ld\n", program.insts_size);
+    if(program.insts_size <= 0) return 0;
 
     printf("main: \n");
     
-    for(size_t i = 0; i < rm.rm_program_size; ++i) {
-	printf("    %s", inst_as_cstr(rm.program[i].inst_type));
-	if(inst_has_operand(rm.program[i].inst_type)) {
-	    printf(" %"PRIu64"", rm.program[i].inst_operand.as_u64);
+    for(size_t i = 0; i < program.insts_size; ++i) {
+	printf("    %s", inst_as_cstr(program.insts[i].inst_type));
+	if(inst_has_operand(program.insts[i].inst_type)) {
+	    printf(" %"PRIu64"", program.insts[i].inst_operand.as_u64);
 	}
 	printf("\n");
     }
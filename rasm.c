@@ -1,7 +1,14 @@
 #define SV_IMPLEMENTATION
 #define RM_IMPLEMENTATION
+#define RM_LINK_IMPLEMENTATION
+#define RM_CFG_IMPLEMENTATION
+
+#include <unistd.h>
+
 #include "./sv.h"
 #include "./rasm.h"
+#include "./rm_link.h"
+#include "./rm_cfg.h"
 
 // static void load_program_from_memory(Rm *rm, Inst *program, size_t program_size) {
 //     assert(program_size < RM_PROGRAM_CAPACITY);
@@ -19,46 +26,185 @@ static char *shift(int *argc, char ***argv) {
 }
 
 static void usage(void) {
-    fprintf(stdout, "Usage: ./rasm [file.rasm] [file.rm]\n");
+    fprintf(stdout, "Usage: ./rasm [-O] [-f] [-r] [-s] [file.rasm] [file.rm]\n");
+    fprintf(stdout, "       ./rasm -c [-j threads] [file.rasm]...\n");
+    fprintf(stdout, "    -O    fold constants, thread jumps, drop dead code and lay out blocks before saving\n");
+    fprintf(stdout, "    -f    fuse common instruction sequences into superinstructions\n");
+    fprintf(stdout, "    -r    write raw instructions that rme executes straight from the mapped file\n");
+    fprintf(stdout, "    -s    stream raw instructions to the output while translating, for huge sources\n");
+    fprintf(stdout, "    -c    assemble every file.rasm into a relocatable file.rmo for rlink, in parallel\n");
+}
+
+// * file.rasm -> file.rmo
+static const char *object_filepath(const char *input) {
+    size_t n = strlen(input);
+    const char *ext = ".rasm";
+    if(n >= strlen(ext) && strcmp(input + n - strlen(ext), ext) == 0) {
+	n -= strlen(ext);
+    }
+    char *output = malloc(n + sizeof(".rmo"));
+    if(output == NULL) {
+	fprintf(stderr, "ERROR: could not allocate the object path for %s\n", input);
+	exit(1);
+    }
+    memcpy(output, input, n);
+    memcpy(output + n, ".rmo", sizeof(".rmo"));
+    return output;
+}
+
+static void assemble_objects(const char **inputs, size_t inputs_size, long threads_count) {
+    const char **outputs = malloc(sizeof(outputs[0]) * (inputs_size + 1));
+    if(outputs == NULL) {
+	fprintf(stderr, "ERROR: could not allocate %zu object paths\n", inputs_size);
+	exit(1);
+    }
+    for(size_t i = 0; i < inputs_size; ++i) {
+	outputs[i] = object_filepath(inputs[i]);
+    }
+
+    rm_assemble_objects(inputs, outputs, inputs_size, (size_t)threads_count);
+
+    for(size_t i = 0; i < inputs_size; ++i) {
+	free((void *)outputs[i]);
+    }
+    free(outputs);
 }
 
 int main(int argc, char *argv[]) {
 
-    static Rm rm = {0};
+    static Rasm rasm = {0};
 
     shift(&argc, &argv);
-    // * Get the input .rasm file
     String_View input_filepath = {0};
-    if(argc > 0) {
-	const char *input_file_str = shift(&argc, &argv);
-	input_filepath = SV(input_file_str);
+    String_View output_filepath = {0};
+    bool optimize = false;
+    bool fuse = false;
+    bool stream = false;
+    bool objects = false;
+    long threads_count = sysconf(_SC_NPROCESSORS_ONLN);
+    const char **inputs = malloc(sizeof(inputs[0]) * ((size_t)argc + 1));
+    size_t inputs_size = 0;
+    if(inputs == NULL) {
+	fprintf(stderr, "ERROR: could not allocate the arguments\n");
+	exit(1);
+    }
+    Rm_Encoding encoding = RM_ENCODING_COMPACT;
+
+    while(argc > 0) {
+	const char *arg = shift(&argc, &argv);
+	if(strcmp(arg, "-O") == 0) {
+	    optimize = true;
+	}
+	else if(strcmp(arg, "-f") == 0) {
+	    fuse = true;
+	}
+	else if(strcmp(arg, "-r") == 0) {
+	    encoding = RM_ENCODING_RAW;
+	}
+	else if(strcmp(arg, "-s") == 0) {
+	    stream = true;
+	}
+	else if(strcmp(arg, "-c") == 0) {
+	    objects = true;
+	}
+	else if(strcmp(arg, "-j") == 0) {
+	    const char *count = shift(&argc, &argv);
+	    threads_count = count ? atol(count) : 0;
+	    if(threads_count <= 0) {
+		fprintf(stderr, "ERROR: `-j` expects a positive number of threads\n");
+		usage();
+		exit(1);
+	    }
+	}
+	else {
+	    inputs[inputs_size++] = arg;
+	}
     }
 
+    if(objects) {
+	if(optimize || fuse || stream || encoding != RM_ENCODING_COMPACT) {
+	    fprintf(stderr, "`-c` can't be combined with `-O`, `-f`, `-r` or `-s`\n");
+	    usage();
+	    exit(1);
+	}
+	if(inputs_size == 0) {
+	    fprintf(stderr, "Please provide a input rasm file\n");
+	    usage();
+	    exit(1);
+	}
+	assemble_objects(inputs, inputs_size, threads_count);
+	free(inputs);
+	return 0;
+    }
+
+    // * Get the input .rasm file and the output .rm file
+    if(inputs_size > 2) {
+	fprintf(stderr, "Unexpected argument `%s`\n", inputs[2]);
+	usage();
+	exit(1);
+    }
+    if(inputs_size > 0) input_filepath = SV(inputs[0]);
+    if(inputs_size > 1) output_filepath = SV(inputs[1]);
+    free(inputs);
+
     if(input_filepath.count == 0) {		
 	fprintf(stderr, "Please provide a input rasm file\n");
 	usage();
 	exit(1);
     }
 
-    // Get the output .rm file
-    String_View output_filepath = {0};
-    if(argc > 0) {
-	const char *output_file_str = shift(&argc, &argv);
-	output_filepath = SV(output_file_str);
-    }
     if(output_filepath.count == 0) {		
 	fprintf(stderr, "Please provide a output file\n");
 	usage();
 	exit(1);
     }
     
+    if(stream && (fuse || optimize)) {
+	fprintf(stderr, "`-O` and `-f` need the whole program and can't be combined with `-s`\n");
+	usage();
+	exit(1);
+    }
+
+    if(stream) {
+	// * Converts rasm -> rm bytecode straight into the output file
+	rasm_begin_stream(&rasm, output_filepath);
+	rasm_translate_source(&rasm, input_filepath);
+	rasm_end_stream(&rasm);
+
+	printf("Bytes of memory used: %ld\n", rasm.arena_size);
+	return 0;
+    }
+
     // * Converts rasm -> rm bytecode
-    rasm_translate_source(&rm, input_filepath);
+    rasm_translate_source(&rasm, input_filepath);
+
+    if(optimize) {
+	const uint64_t before = rasm.program_size;
+	size_t counts[OPT_COUNT];
+	rasm_optimize_program(&rasm, counts);
+	for(size_t i = 0; i < OPT_COUNT; ++i) {
+	    printf("Optimized %zu: %s\n", counts[i], optimization_as_cstr((Optimization)i));
+	}
+	size_t cfg_counts[CFG_OPT_COUNT];
+	rasm_optimize_cfg(&rasm, cfg_counts);
+	for(size_t i = 0; i < CFG_OPT_COUNT; ++i) {
+	    printf("Optimized %zu: %s\n", cfg_counts[i], cfg_optimization_as_cstr((Cfg_Optimization)i));
+	}
+	printf("Eliminated %"PRIu64" of %"PRIu64" instructions\n", before - rasm.program_size, before);
+    }
+
+    if(fuse) {
+	size_t counts[FUSE_COUNT];
+	rasm_fuse_program(&rasm, counts);
+	for(size_t i = 0; i < FUSE_COUNT; ++i) {
+	    printf("Fused %zu: %s\n", counts[i], fuse_pattern_as_cstr((Fuse_Pattern)i));
+	}
+    }
 
     // * saves rm bytecode to .rm file
-    rasm_save_to_file(&rm, output_filepath);
+    rasm_save_to_file(&rasm, output_filepath, encoding);
 
-    printf("Bytes of memory used: %ld\n", rm.arena_size);
+    printf("Bytes of memory used: %ld\n", rasm.arena_size);
     
     return 0;
 }
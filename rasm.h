@@ -9,6 +9,32 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <stddef.h>
+
+// * The JIT emits x86-64 code into mmap'd memory
+#if defined(__x86_64__) && defined(__linux__)
+#define RM_JIT_SUPPORTED
+#include <sys/mman.h>
+#endif
+
+// * .rm files are mapped instead of read where mmap is available
+#if defined(__unix__) || defined(__APPLE__)
+#define RM_MMAP_SUPPORTED
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// * VM stacks are mapped with a PROT_NONE guard page right after them, a
+// * push into the guard page is turned into ERR_STACK_OVERFLOW by a
+// * SIGSEGV handler instead of comparing against the capacity every time
+#if defined(__unix__) || defined(__APPLE__)
+#define RM_STACK_GUARD
+#include <setjmp.h>
+#include <signal.h>
+#include <pthread.h>
+#endif
 
 #if defined(__GNUC__) || defined(__clang__)
 #define PACK( __Declaration__ ) __Declaration__ __attribute__((__packed__))
@@ -18,11 +44,16 @@
 #  error "Packed attributes for struct is not implemented for this compiler. This may result in a program working incorrectly. Feel free to fix that and submit a Pull Request to https://github.com/tsoding/bng"
 #endif
 
+// * Default stack size of an Rm in values. Stacks can be sized up to
+// * RM_STACK_MAX_CAPACITY so every stack offset fits in 32 bits for the JIT.
 #define RM_STACK_CAPACITY 1024
-#define RM_PROGRAM_CAPACITY 1024
-#define RM_BINDING_CAPACITY 1024
-#define RM_DEFERRED_OPERAND_CAPACITY 1024
+#define RM_STACK_MAX_CAPACITY (1 << 28)
+#define RM_BINDINGS_INITIAL_CAPACITY 256
+#define RASM_PROGRAM_INITIAL_CAPACITY 1024
+#define RASM_STREAM_WINDOW 4096
+#define RASM_READ_CHUNK (64 * 1024)
 #define RM_ARENA_CAPACITY  (10 * 1000 * 1000)
+#define RM_DEPTH_UNKNOWN UINT64_MAX
 
 #define ARRAY_SIZE(arr) sizeof(arr)/sizeof(arr[0])
 
@@ -32,27 +63,52 @@
 #define RASM_COMMENT_SYMBOL ';'
 #define RASM_PP_SYMBOL '%'
 
+// * Every opcode as X(NAME, mnemonic, operand kind), in encoding order. The
+// * Inst_Type enum, the name and mnemonic tables and the assembler's mnemonic
+// * lookup are all generated from this list. The *_JMPIF/PUSH_PLUSI/DUP_INC
+// * superinstructions are produced by rasm_fuse_program but can be written
+// * by hand too.
+#define RM_INST_LIST(X)							\
+    X(NOP,		"nop",		INST_OPERAND_NONE)		\
+    X(HALT,		"halt",		INST_OPERAND_NONE)		\
+    X(PUSH,		"push",		INST_OPERAND_VALUE)		\
+    X(DUP,		"dup",		INST_OPERAND_VALUE)		\
+    X(JMP,		"jmp",		INST_OPERAND_LABEL)		\
+    X(JMPIF,		"jmp_if",	INST_OPERAND_LABEL)		\
+    X(PLUSI,		"plusi",	INST_OPERAND_NONE)		\
+    X(MINUSI,		"minusi",	INST_OPERAND_NONE)		\
+    X(MULI,		"muli",		INST_OPERAND_NONE)		\
+    X(DIVI,		"divi",		INST_OPERAND_NONE)		\
+    X(MODI,		"modi",		INST_OPERAND_NONE)		\
+    X(GT,		"gt",		INST_OPERAND_NONE)		\
+    X(GTE,		"gte",		INST_OPERAND_NONE)		\
+    X(LT,		"lt",		INST_OPERAND_NONE)		\
+    X(LTE,		"lte",		INST_OPERAND_NONE)		\
+    X(PUSH_PLUSI,	"push_plusi",	INST_OPERAND_VALUE)		\
+    X(DUP_INC,		"dup_inc",	INST_OPERAND_VALUE)		\
+    X(GT_JMPIF,		"gt_jmp_if",	INST_OPERAND_LABEL)		\
+    X(GTE_JMPIF,	"gte_jmp_if",	INST_OPERAND_LABEL)		\
+    X(LT_JMPIF,		"lt_jmp_if",	INST_OPERAND_LABEL)		\
+    X(LTE_JMPIF,	"lte_jmp_if",	INST_OPERAND_LABEL)
+
 typedef enum {
-    INST_NOP,
-    INST_HALT,
-
-    INST_PUSH,
-    INST_DUP,
-    INST_JMP,
-    INST_JMPIF,
-
-    INST_PLUSI,
-    INST_MINUSI,
-    INST_MULI,
-    INST_DIVI,
-    INST_MODI,
-
-    INST_GT,
-    INST_GTE,
-    INST_LT,
-    INST_LTE,
+#define RM_INST_ENUM(name, mnemonic, operand) INST_##name,
+    RM_INST_LIST(RM_INST_ENUM)
+#undef RM_INST_ENUM
 } Inst_Type;
 
+// * What the assembler expects after the mnemonic: nothing, a literal or
+// * binding, or a label or absolute address
+typedef enum {
+    INST_OPERAND_NONE = 0,
+    INST_OPERAND_VALUE,
+    INST_OPERAND_LABEL,
+} Inst_Operand_Kind;
+
+// * Number of opcodes
+#define RM_INST_COUNT_ONE(name, mnemonic, operand) + 1
+#define INST_TYPES_COUNT (0 RM_INST_LIST(RM_INST_COUNT_ONE))
+
 typedef uint64_t Inst_Addr;
 
 typedef union {
@@ -78,6 +134,9 @@ typedef struct {
 const char* inst_as_cstr(Inst_Type type);
 const char* inst_to_cstr(Inst_Type type);
 bool inst_has_operand(Inst_Type type);
+Inst_Operand_Kind inst_operand_kind(Inst_Type type);
+bool inst_from_sv(String_View mnemonic, Inst_Type *type);
+void inst_init_mnemonics(void);
 
 // * vm error's
 typedef enum {
@@ -88,57 +147,290 @@ typedef enum {
 } Err;
 const char* err_as_cstr(Err err);
 
+// * execution engines
+typedef enum {
+    RM_ENGINE_SWITCH = 0,
+    RM_ENGINE_THREADED,
+    RM_ENGINE_JIT,
+    RM_ENGINE_TOS,
+    RM_ENGINE_COUNT,
+} Rm_Engine;
+const char* engine_as_cstr(Rm_Engine engine);
+bool engine_from_cstr(const char *name, Rm_Engine *engine);
+
+// * Computed goto is a GNU extension, without it the threaded engine
+// * falls back to the switch engine
+#if defined(__GNUC__) || defined(__clang__)
+#define RM_THREADED_DISPATCH
+#endif
+
+typedef enum {
+    BINDING_CONST = 0,
+    BINDING_LABEL,
+} Binding_Kind;
+
 typedef struct {
     String_View name;
     Word value;
+    Binding_Kind kind;
 } Binding;
 
+// * Sequences rewritten by rasm_fuse_program
+typedef enum {
+    FUSE_PUSH_PLUSI = 0,
+    FUSE_DUP_INC,
+    FUSE_GT_JMPIF,
+    FUSE_GTE_JMPIF,
+    FUSE_LT_JMPIF,
+    FUSE_LTE_JMPIF,
+    FUSE_COUNT,
+} Fuse_Pattern;
+const char* fuse_pattern_as_cstr(Fuse_Pattern pattern);
+
+// * Rewrites done by rasm_optimize_program
+typedef enum {
+    OPT_FOLD_ARITHMETIC = 0,
+    OPT_FOLD_COMPARISON,
+    OPT_CONST_JMPIF,
+    OPT_JMP_NEXT,
+    OPT_NOP,
+    OPT_COUNT,
+} Optimization;
+const char* optimization_as_cstr(Optimization optimization);
+
+// * A loaded program. Read-only once rm_load_program_from_file (and
+// * optionally rm_prepare_jit) returned, so any number of Rm's, also on
+// * different threads, can execute it through a pointer.
+// * Has to be zero initialized before the first load.
 typedef struct {
-    int64_t stack[RM_STACK_CAPACITY];    
+    const Inst *insts;
+    uint64_t insts_size;
+
+    // * Storage behind insts: the mapped .rm file when it holds raw
+    // * instructions, otherwise a heap copy
+    void *mapping;
+    size_t mapping_size;
+    Inst *owned_insts;
+
+    // * Handler address of every instruction for the threaded engine,
+    // * plus one trailing slot for falling off the end of the program
+    void **threaded_code;
+    bool threaded_ready;
+    bool threaded_unchecked;
+
+    // * Native code produced by rm_prepare_jit and the offset of every
+    // * instruction inside of it
+    void *jit_code;
+    size_t jit_code_size;
+    uint32_t *jit_offsets;
+    bool jit_unchecked;
+
+    // * Set by rm_verify_program when no instruction reachable from ip 0
+    // * with an empty stack can underflow, overflow or leave the program.
+    // * verified_depth is the stack size on entry of every instruction,
+    // * verified_stack_need the smallest stack capacity it never overflows.
+    bool verified;
+    uint64_t *verified_depth;
+    uint64_t verified_stack_need;
+
+    // * Instructions from every ip up to and including the next jump or
+    // * halt, or up to the end of the program plus the illegal slot right
+    // * after it. The engines charge their budget once per block with it.
+    uint64_t *block_cost;
+} Rm_Program;
+
+// * Execution context of a single VM instance. Has to be zero initialized,
+// * the stack comes from rm_alloc_stack or from the first rm_init.
+typedef struct {
+    int64_t *stack;
+    uint64_t stack_capacity;
     uint64_t rm_stack_size;
-    
-    Inst program[RM_PROGRAM_CAPACITY];
-    uint64_t rm_program_size;
     uint64_t ip;
+    bool halt;
+
+    const Rm_Program *program;
+
+    // * Pages behind stack, the last one is the guard page
+    void *stack_mapping;
+    size_t stack_mapping_size;
+} Rm;
 
-    Binding bindings[RM_BINDING_CAPACITY];
+// * Assembler state, only needed while translating a .rasm file
+typedef struct {
+    // * Translated instructions, growing on the heap. In streaming mode
+    // * it is a window of RASM_STREAM_WINDOW instructions starting at
+    // * program_base, everything before it is already in `stream`.
+    Inst *program;
+    uint64_t program_size;
+    size_t program_capacity;
+    uint64_t program_base;
+    FILE *stream;
+
+    // * Open addressing hash table over the binding names, allocated in
+    // * the arena. A slot with an empty name is free.
+    Binding *bindings;
     size_t bindings_size;
+    size_t bindings_capacity;
     
-    Deferred_Operand deferred_operands[RM_DEFERRED_OPERAND_CAPACITY];
+    Deferred_Operand *deferred_operands;
     size_t deferred_operands_size;
-
-    char arena[RM_ARENA_CAPACITY];
+    size_t deferred_operands_capacity;
+
+    // * Set before rasm_translate_source to assemble a relocatable object
+    // * for rasm_save_object: bindings that are not defined in the source
+    // * are kept as imports instead of being an error. `globals` are the
+    // * names exported with %global.
+    bool relocatable;
+    String_View *globals;
+    size_t globals_size;
+    size_t globals_capacity;
+
+    _Alignas(Word) char arena[RM_ARENA_CAPACITY];
     size_t arena_size;
+} Rasm;
 
-    bool halt;
-} Rm;
+// * Encoding of the instructions in a v2 .rm file. Raw is the in-memory
+// * Inst array of the writing machine, it can be executed straight from
+// * the mapped file.
+typedef enum {
+    RM_ENCODING_COMPACT = 0,
+    RM_ENCODING_RAW,
+} Rm_Encoding;
+
+void *arena_alloc(Rasm *rasm, size_t n);
+
+bool resolve_bind_value(Rasm *rasm, String_View name, Word *addr);
+bool rasm_bind_value(Rasm *rasm, String_View name, Word value, Binding_Kind kind);
+bool rasm_translate_literal(Rasm *rasm, String_View operand, Word *output);
+void rasm_push_deferred_operand(Rasm *rasm, String_View operand, Inst_Addr addr);
+
+void rasm_translate_source(Rasm *rasm, String_View input_filepath);
+void rasm_save_to_file(Rasm *rasm, String_View filepath, Rm_Encoding encoding);
+void rasm_save_object(Rasm *rasm, String_View filepath);
+void rasm_free(Rasm *rasm);
+void rm_save_program_to_file(const Inst *insts, uint64_t insts_size, String_View filepath, Rm_Encoding encoding);
+void rasm_begin_stream(Rasm *rasm, String_View filepath);
+void rasm_end_stream(Rasm *rasm);
+void rasm_compact_program(Rasm *rasm, const bool *keep);
+void rasm_reorder_program(Rasm *rasm, const Inst_Addr *new_addr, const bool *keep, uint64_t new_size);
+void rasm_fuse_program(Rasm *rasm, size_t counts[FUSE_COUNT]);
+void rasm_optimize_program(Rasm *rasm, size_t counts[OPT_COUNT]);
+
+void rm_load_program_from_file(Rm_Program *program, const char* filepath);
+void rm_load_program_from_memory(Rm_Program *program, const Inst *insts, uint64_t insts_size);
+void rm_unload_program(Rm_Program *program);
+bool rm_verify_program(Rm_Program *program);
+void rm_prepare_threaded(Rm_Program *program);
+bool rm_prepare_jit(Rm_Program *program);
+void rm_release_jit(Rm_Program *program);
+
+void rm_init(Rm *rm, const Rm_Program *program);
+void rm_alloc_stack(Rm *rm, uint64_t capacity);
+void rm_free_stack(Rm *rm);
+void rm_dump_stack(FILE *stream, const Rm *rm);
+void rm_dump_result(FILE *stream, const Rm *rm, Err err);
+Err rm_execute_program(Rm *rm, int limit);
+Err rm_execute_inst(Rm *rm);
+Err rm_execute_program_threaded(Rm *rm, int limit);
+Err rm_execute_program_jit(Rm *rm, int limit);
+Err rm_execute_program_tos(Rm *rm, int limit);
+Err rm_execute_program_with(Rm *rm, Rm_Engine engine, int limit);
 
-void *arena_sv_to_cstr(Rm *rm, String_View sv);
-void *arena_alloc(Rm *rm, size_t n);
-String_View arena_slurp_file(Rm *rm, String_View filepath);
+// * Compact encoding of an instruction: 1 byte opcode followed, only when
+// * inst_has_operand, by the operand as a zigzag LEB128 varint
+#define RM_ENCODED_INST_CAPACITY 11
 
-bool resolve_bind_value(Rm *rm, String_View name, Word *addr);
-bool rasm_bind_value(Rm *rm, String_View name, Word value);
-bool rasm_translate_literal(Rm *rm, String_View operand, Word *output);
-void rasm_push_deferred_operand(Rm *rm, String_View operand, Inst_Addr addr);
+size_t rm_encode_inst(Inst inst, uint8_t *buffer);
+bool rm_decode_inst(const uint8_t *data, size_t size, size_t *offset, Inst *inst);
 
-void rasm_translate_source(Rm *rm, String_View original_source);
-void rasm_save_to_file(Rm *rm, String_View filepath);
+#define RM_FILE_MAGIC_V1 0x4D42
+#define RM_FILE_MAGIC 0x4D52
+#define RM_FILE_VERSION 2
 
-void rm_dump_stack(FILE *stream, Rm *rm);
-void rm_load_program_from_file(Rm *rm, const char* filepath);
-Err rm_execute_program(Rm *rm, int limit);
-Err rm_execute_inst(Rm *rm);
+// * v1 files: the header followed by program_size raw Inst's
+PACK(struct Rm_File_Meta_V1 {
+    uint16_t magic;
+    uint64_t program_size;
+});
 
-#define RM_FILE_MAGIC 0x4D42
+typedef struct Rm_File_Meta_V1 Rm_File_Meta_V1;
 
+// * v2 files: the header followed by program_size instructions in the
+// * given encoding
 PACK(struct Rm_File_Meta {
     uint16_t magic;
+    uint16_t version;
+    uint32_t encoding;
     uint64_t program_size;
 });
 
 typedef struct Rm_File_Meta Rm_File_Meta;
 
+_Static_assert(sizeof(Rm_File_Meta) % sizeof(Word) == 0,
+	       "raw instructions after the header have to stay aligned");
+
+#define RM_OBJECT_MAGIC 0x4F52
+#define RM_OBJECT_VERSION 1
+
+// * Relocatable object written by `rasm -c` and linked by rlink: the header,
+// * program_size raw Inst's addressed from 0, the exported symbols, the
+// * relocations and finally the names they point into
+PACK(struct Rm_Object_Meta {
+    uint16_t magic;
+    uint16_t version;
+    uint32_t reserved;
+    uint64_t program_size;
+    uint64_t symbols_count;
+    uint64_t relocations_count;
+    uint64_t names_size;
+});
+
+typedef struct Rm_Object_Meta Rm_Object_Meta;
+
+_Static_assert(sizeof(Rm_Object_Meta) % sizeof(Word) == 0,
+	       "raw instructions after the header have to stay aligned");
+
+typedef enum {
+    // * The operand is an address inside of the object, add its base
+    RM_RELOC_BASE = 0,
+    // * The operand is the value of a symbol exported by another object
+    RM_RELOC_SYMBOL,
+} Rm_Reloc_Kind;
+
+typedef struct {
+    uint64_t name_offset;
+    uint64_t name_size;
+    Word value;			// * address for labels
+    uint64_t kind;		// * Binding_Kind
+} Rm_Object_Symbol;
+
+typedef struct {
+    Inst_Addr addr;
+    uint64_t kind;		// * Rm_Reloc_Kind
+    uint64_t name_offset;	// * RM_RELOC_SYMBOL only
+    uint64_t name_size;
+} Rm_Object_Relocation;
+
+// * A loaded object, every pointer points into the file view
+typedef struct {
+    void *data;
+    size_t data_size;
+    bool mapped;
+
+    const Inst *insts;
+    uint64_t insts_size;
+    const Rm_Object_Symbol *symbols;
+    uint64_t symbols_count;
+    const Rm_Object_Relocation *relocations;
+    uint64_t relocations_count;
+    const char *names;
+    uint64_t names_size;
+} Rm_Object;
+
+void rm_load_object(Rm_Object *object, const char *filepath);
+void rm_unload_object(Rm_Object *object);
+String_View rm_object_name(const Rm_Object *object, uint64_t offset, uint64_t size);
+
 #endif // RM_H_
 
 #ifdef RM_IMPLEMENTATION
@@ -162,187 +454,426 @@ const char* err_as_cstr(Err err) {
     }
 }
 
+const char* engine_as_cstr(Rm_Engine engine) {
+    switch(engine) {
+    case RM_ENGINE_SWITCH:	return "switch";
+    case RM_ENGINE_THREADED:	return "threaded";
+    case RM_ENGINE_JIT:		return "jit";
+    case RM_ENGINE_TOS:		return "tos";
+    case RM_ENGINE_COUNT:
+    default:
+	return "Unknown engine";
+    }
+}
+
+bool engine_from_cstr(const char *name, Rm_Engine *engine) {
+    if(strcmp(name, "switch") == 0) {
+	*engine = RM_ENGINE_SWITCH;
+    } else if(strcmp(name, "threaded") == 0) {
+	*engine = RM_ENGINE_THREADED;
+    } else if(strcmp(name, "jit") == 0) {
+	*engine = RM_ENGINE_JIT;
+    } else if(strcmp(name, "tos") == 0) {
+	*engine = RM_ENGINE_TOS;
+    } else {
+	return false;
+    }
+    return true;
+}
+
+const char* fuse_pattern_as_cstr(Fuse_Pattern pattern) {
+    switch(pattern) {
+    case FUSE_PUSH_PLUSI:	return "push K; plusi -> push_plusi";
+    case FUSE_DUP_INC:		return "dup 0; push K; plusi -> dup_inc";
+    case FUSE_GT_JMPIF:		return "gt; jmp_if L -> gt_jmp_if";
+    case FUSE_GTE_JMPIF:	return "gte; jmp_if L -> gte_jmp_if";
+    case FUSE_LT_JMPIF:		return "lt; jmp_if L -> lt_jmp_if";
+    case FUSE_LTE_JMPIF:	return "lte; jmp_if L -> lte_jmp_if";
+    case FUSE_COUNT:
+    default:
+	return "Unknown pattern";
+    }
+}
+
+const char* optimization_as_cstr(Optimization optimization) {
+    switch(optimization) {
+    case OPT_FOLD_ARITHMETIC:	return "push A; push B; plusi/minusi/muli/divi/modi -> push C";
+    case OPT_FOLD_COMPARISON:	return "push A; push B; gt/gte/lt/lte -> push C";
+    case OPT_CONST_JMPIF:	return "push K; jmp_if L -> jmp L or nothing";
+    case OPT_JMP_NEXT:		return "jmp to the next instruction";
+    case OPT_NOP:		return "nop";
+    case OPT_COUNT:
+    default:
+	return "Unknown optimization";
+    }
+}
+
+static const char *const inst_names[INST_TYPES_COUNT] = {
+#define RM_INST_NAME(name, mnemonic, operand) "INST_" #name,
+    RM_INST_LIST(RM_INST_NAME)
+#undef RM_INST_NAME
+};
+
+static const char *const inst_mnemonics[INST_TYPES_COUNT] = {
+#define RM_INST_MNEMONIC(name, mnemonic, operand) mnemonic,
+    RM_INST_LIST(RM_INST_MNEMONIC)
+#undef RM_INST_MNEMONIC
+};
+
+static const uint8_t inst_mnemonic_lengths[INST_TYPES_COUNT] = {
+#define RM_INST_MNEMONIC_LENGTH(name, mnemonic, operand) sizeof(mnemonic) - 1,
+    RM_INST_LIST(RM_INST_MNEMONIC_LENGTH)
+#undef RM_INST_MNEMONIC_LENGTH
+};
+
+static const Inst_Operand_Kind inst_operand_kinds[INST_TYPES_COUNT] = {
+#define RM_INST_OPERAND(name, mnemonic, operand) operand,
+    RM_INST_LIST(RM_INST_OPERAND)
+#undef RM_INST_OPERAND
+};
+
 const char* inst_to_cstr(Inst_Type type) {
-    switch(type) {
-    case INST_NOP:	return "INST_NOP";
-    case INST_HALT:	return "INST_HALT";
-    case INST_PUSH:	return "INST_PUSH";
-    case INST_DUP:	return "INST_DUP";
-    case INST_JMP:	return "INST_JMP";
-    case INST_JMPIF:	return "INST_JMPIF";
-    
-    case INST_PLUSI:	return "INST_PLUSI";
-    case INST_MINUSI:	return "INST_MINUSI";
-    case INST_MULI:	return "INST_MULI";
-    case INST_DIVI:	return "INST_DIVI";
-    case INST_MODI:	return "INST_MODI";
-    
-    case INST_GT:	return "INST_GT";
-    case INST_GTE:	return "INST_GTE";
-    case INST_LT:	return "INST_LT";
-    case INST_LTE:	return "INST_LTE";
-default:
-    return "Unknown type";
+    if((size_t)type >= INST_TYPES_COUNT) {
+	return "Unknown type";
     }
+    return inst_names[type];
 }
 
 const char* inst_as_cstr(Inst_Type type) {
-    switch(type) {
-    case INST_NOP:	return "nop";
-    case INST_HALT:	return "halt";
-    case INST_PUSH:	return "push";
-    case INST_DUP:	return "dup";
-    case INST_JMP:	return "jmp";
-    case INST_JMPIF:	return "jmp_if";
-    
-    case INST_PLUSI:	return "plusi";
-    case INST_MINUSI:	return "minusi";
-    case INST_MULI:	return "muli";
-    case INST_DIVI:	return "divi";
-    case INST_MODI:	return "modi";
-    
-    case INST_GT:	return "gt";
-    case INST_GTE:	return "gte";
-    case INST_LT:	return "lt";
-    case INST_LTE:	return "lte";
-default:
-    return "Unknown type";
+    if((size_t)type >= INST_TYPES_COUNT) {
+	return "Unknown type";
+    }
+    return inst_mnemonics[type];
+}
+
+Inst_Operand_Kind inst_operand_kind(Inst_Type type) {
+    if((size_t)type >= INST_TYPES_COUNT) {
+	fprintf(stderr, "ERROR: unknown Inst_Type\n");
+	exit(1);
     }
+    return inst_operand_kinds[type];
 }
 
 bool inst_has_operand(Inst_Type type) {
-    switch(type) {
-    case INST_NOP:	return false;
-    case INST_HALT:	return false;
-    case INST_PUSH:	return true;
-    case INST_DUP:	return true;
-    case INST_JMP:	return true;
-    case INST_JMPIF:	return true;
-    
-    case INST_PLUSI:	return false;
-    case INST_MINUSI:	return false;
-    case INST_MULI:	return false;
-    case INST_DIVI:	return false;
-    case INST_MODI:	return false;
-    
-    case INST_GT:	return false;
-    case INST_GTE:	return false;
-    case INST_LT:	return false;
-    case INST_LTE:	return false;
-    
-default:
-    fprintf(stderr, "ERROR: unknown Inst_Type\n");
-    exit(1);
+    return inst_operand_kind(type) != INST_OPERAND_NONE;
+}
+
+// * Mnemonic -> Inst_Type is a perfect hash in the style of gperf: the first
+// * two bytes, the last byte and the length pick one of RM_MNEMONIC_SLOTS
+// * slots, and a single comparison confirms the hit. C can't hash string
+// * literals in a constant expression, so the table is filled from
+// * RM_INST_LIST on first use, which also proves the hash is still perfect
+// * after opcodes are added.
+#define RM_MNEMONIC_SLOTS 64
+#define RM_MNEMONIC_MIN_LENGTH 2
+
+static uint8_t inst_mnemonic_slots[RM_MNEMONIC_SLOTS]; // * Inst_Type + 1, 0 is free
+
+static size_t inst_mnemonic_hash(String_View mnemonic) {
+    const unsigned char *data = (const unsigned char *)mnemonic.data;
+    size_t hash = (size_t)data[0] + data[1] + 5 * (size_t)data[mnemonic.count - 1] + mnemonic.count;
+    return hash % RM_MNEMONIC_SLOTS;
+}
+
+static bool inst_mnemonics_ready = false;
+
+// * Called by the first inst_from_sv, call it up front before assembling
+// * on several threads
+void inst_init_mnemonics(void) {
+    if(inst_mnemonics_ready) {
+	return;
+    }
+    for(size_t type = 0; type < INST_TYPES_COUNT; ++type) {
+	String_View mnemonic = {
+	    .count = inst_mnemonic_lengths[type],
+	    .data = inst_mnemonics[type],
+	};
+	assert(mnemonic.count >= RM_MNEMONIC_MIN_LENGTH);
+	size_t slot = inst_mnemonic_hash(mnemonic);
+	if(inst_mnemonic_slots[slot] != 0) {
+	    fprintf(stderr, "ERROR: mnemonics `%s` and `%s` hash to the same slot, adjust inst_mnemonic_hash\n",
+		    inst_mnemonics[inst_mnemonic_slots[slot] - 1], inst_mnemonics[type]);
+	    exit(1);
+	}
+	inst_mnemonic_slots[slot] = (uint8_t)(type + 1);
     }
+    inst_mnemonics_ready = true;
 }
 
-void *arena_sv_to_cstr(Rm *rm, String_View sv) {
-    assert(rm->arena_size + (sv.count + 1) < RM_ARENA_CAPACITY);
-    void *result = rm->arena + rm->arena_size; 
-    memcpy(result, sv.data, sv.count);
-    rm->arena_size += (sv.count + 1);
-    //result[sv.count] = '\0';
-    return result;
+bool inst_from_sv(String_View mnemonic, Inst_Type *type) {
+    inst_init_mnemonics();
+
+    if(mnemonic.count < RM_MNEMONIC_MIN_LENGTH) {
+	return false;
+    }
+    uint8_t slot = inst_mnemonic_slots[inst_mnemonic_hash(mnemonic)];
+    if(slot == 0) {
+	return false;
+    }
+    size_t candidate = (size_t)slot - 1;
+    if(inst_mnemonic_lengths[candidate] != mnemonic.count
+       || memcmp(inst_mnemonics[candidate], mnemonic.data, mnemonic.count) != 0) {
+	return false;
+    }
+
+    *type = (Inst_Type)candidate;
+    return true;
 }
 
-void *arena_alloc(Rm *rm, size_t n) {
-    assert(rm->arena_size + n < RM_ARENA_CAPACITY);
-    void *result = rm->arena + rm->arena_size;
-    rm->arena_size += n;
+// * Every allocation is aligned to a Word
+void *arena_alloc(Rasm *rasm, size_t n) {
+    rasm->arena_size = (rasm->arena_size + sizeof(Word) - 1) & ~(sizeof(Word) - 1);
+    assert(rasm->arena_size + n < RM_ARENA_CAPACITY);
+    void *result = rasm->arena + rasm->arena_size;
+    rasm->arena_size += n;
     return result;
 }
 
-// static void show_bindings(Rm *rm) {
+// static void show_bindings(Rasm *rasm) {
 //     printf("\n ------ Bindings ----- \n");
-//     for(size_t i = 0; i < rm->bindings_size; ++i) {
+//     for(size_t i = 0; i < rasm->bindings_capacity; ++i) {
+// 	if(rasm->bindings[i].name.count == 0) continue;
 // 	printf("Name: "SV_Fmt", val: %"PRIu64"\n",
-// 	        SV_Arg(rm->bindings[i].name), rm->bindings[i].value.as_u64);
+// 	        SV_Arg(rasm->bindings[i].name), rasm->bindings[i].value.as_u64);
 //     }
 // }
 
-// static void show_deferred_operands(Rm *rm) {
+// static void show_deferred_operands(Rasm *rasm) {
 //     printf("\n ------ Deferred_Operands ----- \n");
-//     for(size_t i = 0; i < rm->deferred_operands_size; ++i) {
+//     for(size_t i = 0; i < rasm->deferred_operands_size; ++i) {
 // 	printf("Name: "SV_Fmt", addr: %"PRIu64"\n",
-// 	        SV_Arg(rm->deferred_operands[i].name), rm->deferred_operands[i].addr);
+// 	        SV_Arg(rasm->deferred_operands[i].name), rasm->deferred_operands[i].addr);
 //     }
 // }
 
-// * Add new deferred_operand to deferred_operands array
-void rasm_push_deferred_operand(Rm *rm, String_View operand, Inst_Addr addr) {
-    assert(rm->deferred_operands_size < RM_DEFERRED_OPERAND_CAPACITY);
-    rm->deferred_operands[rm->deferred_operands_size++] = (Deferred_Operand) {
+// * Add new deferred_operand to deferred_operands array. The name is
+// * copied into the arena, the line it came from is gone by the time the
+// * operands get resolved.
+void rasm_push_deferred_operand(Rasm *rasm, String_View operand, Inst_Addr addr) {
+    if(rasm->deferred_operands_size >= rasm->deferred_operands_capacity) {
+	rasm->deferred_operands_capacity = rasm->deferred_operands_capacity == 0
+	    ? RASM_PROGRAM_INITIAL_CAPACITY
+	    : rasm->deferred_operands_capacity * 2;
+	rasm->deferred_operands = realloc(rasm->deferred_operands,
+					  sizeof(rasm->deferred_operands[0]) * rasm->deferred_operands_capacity);
+	if(rasm->deferred_operands == NULL) {
+	    fprintf(stderr, "ERROR: could not allocate deferred operands\n");
+	    exit(1);
+	}
+    }
+
+    char *name = arena_alloc(rasm, operand.count);
+    memcpy(name, operand.data, operand.count);
+    rasm->deferred_operands[rasm->deferred_operands_size++] = (Deferred_Operand) {
 	.addr = addr,
-	.name = operand
+	.name = { .count = operand.count, .data = name },
     };
 }
 
+// * Slot holding `name` or the free slot where it belongs
+static Binding *rasm_binding_slot(Binding *slots, size_t capacity, String_View name) {
+    size_t i = (size_t)sv_hash(name) & (capacity - 1);
+    while(slots[i].name.count > 0 && !sv_eq(slots[i].name, name)) {
+	i = (i + 1) & (capacity - 1);
+    }
+    return &slots[i];
+}
+
+static Binding *rasm_find_binding(Rasm *rasm, String_View name) {
+    if(rasm->bindings_capacity == 0) {
+	return NULL;
+    }
+    Binding *slot = rasm_binding_slot(rasm->bindings, rasm->bindings_capacity, name);
+    return slot->name.count > 0 ? slot : NULL;
+}
+
+// * Double the table, the old slots are left behind in the arena
+static void rasm_grow_bindings(Rasm *rasm) {
+    size_t capacity = rasm->bindings_capacity == 0
+	? RM_BINDINGS_INITIAL_CAPACITY
+	: rasm->bindings_capacity * 2;
+    Binding *slots = arena_alloc(rasm, sizeof(slots[0]) * capacity);
+    memset(slots, 0, sizeof(slots[0]) * capacity);
+
+    for(size_t i = 0; i < rasm->bindings_capacity; ++i) {
+	if(rasm->bindings[i].name.count > 0) {
+	    *rasm_binding_slot(slots, capacity, rasm->bindings[i].name) = rasm->bindings[i];
+	}
+    }
+    rasm->bindings = slots;
+    rasm->bindings_capacity = capacity;
+}
+
 // * Gets the value of bind value to a label
 // * Function => address
 // * Other    => Literal
 // TODO change addr parameter to WORD type
-bool resolve_bind_value(Rm *rm, String_View name, Word *addr) {
-    for(size_t i = 0; i < rm->bindings_size; ++i) {
-	if(sv_eq(name, rm->bindings[i].name)) {
-	    *addr = rm->bindings[i].value;
-	    return true;
-	}
+bool resolve_bind_value(Rasm *rasm, String_View name, Word *addr) {
+    Binding *binding = rasm_find_binding(rasm, name);
+    if(binding == NULL) {
+	return false;
     }
-    return false;
+    *addr = binding->value;
+    return true;
 }
 
 // * Binds the label name with it's address
-bool rasm_bind_value(Rm *rm, String_View name, Word value) {
-    // * Check if label already bind
+bool rasm_bind_value(Rasm *rasm, String_View name, Word value, Binding_Kind kind) {
+    // * Keep the table at most half full
+    if((rasm->bindings_size + 1) * 2 > rasm->bindings_capacity) {
+	rasm_grow_bindings(rasm);
+    }
 
-    // TODO change this to WORD
-    Word ignore = {0};
-    if(resolve_bind_value(rm, name, &ignore)) {
+    // * Check if label already bind
+    Binding *slot = rasm_binding_slot(rasm->bindings, rasm->bindings_capacity, name);
+    if(slot->name.count > 0) {
 	return false;
     }
-    
-    rm->bindings[rm->bindings_size++] = (Binding) {
+
+    // * Intern the name so the table doesn't depend on the source buffer
+    char *interned = arena_alloc(rasm, name.count);
+    memcpy(interned, name.data, name.count);
+
+    *slot = (Binding) {
 	.value = value,
-	.name = name
+	.name = { .count = name.count, .data = interned },
+	.kind = kind,
     };
+    rasm->bindings_size += 1;
     
     return true;
 }
 
-bool rasm_translate_literal(Rm *rm, String_View operand, Word *output) {
+bool rasm_translate_literal(Rasm *rasm, String_View operand, Word *output) {
+    (void) rasm;
 
-    // * Check if number
-    char *str = arena_sv_to_cstr(rm, operand);
-    char *endptr;
+    // * Anything that is not a number is a binding
     Word result = {0};
-    result.as_u64 = strtoull(str, &endptr, 10);
-    if(endptr == str) {
+    switch(sv_parse_int(operand, &result.as_u64)) {
+    case SV_INT_OK:
+	*output = result;
+	return true;
+
+    case SV_INT_INVALID:
 	return false;
+
+    case SV_INT_OVERFLOW:
+	fprintf(stderr, "ERROR: literal `"SV_Fmt"` does not fit in 64 bits\n", SV_Arg(operand));
+	exit(1);
     }
 
-    *output = result;
-    return true;
+    return false;
 }
 
-// * Translate RM program from Text To Binary (create .rm bytecode executables)
-void rasm_translate_source(Rm *rm, String_View input_filepath) {
-    // * Load the program from file
-    String_View original_source = arena_slurp_file(rm, input_filepath);
+static FILE *rasm_open_file(String_View filepath, const char *mode) {
+    char filepath_cstr[FILENAME_MAX];
+    if(filepath.count >= sizeof(filepath_cstr)) {
+	fprintf(stderr, "ERROR: file path `"SV_Fmt"` is too long\n", SV_Arg(filepath));
+	exit(1);
+    }
+    memcpy(filepath_cstr, filepath.data, filepath.count);
+    filepath_cstr[filepath.count] = '\0';
 
-    int line_number = 0;
+    FILE *file = fopen(filepath_cstr, mode);
+    if(file == NULL) {
+	fprintf(stderr, "ERROR: could not open file `%s`: %s\n", filepath_cstr, strerror(errno));
+	exit(1);
+    }
+    return file;
+}
 
-    while(original_source.count > 0) {
-	String_View line = sv_trim(sv_chop_by_delim(&original_source, '\n'));
-	
-	line_number += 1;
-	// Check if comment
-	if(*line.data == RASM_COMMENT_SYMBOL) {
-	    continue;
+// * Write the streaming window after the instructions already in the file
+static void rasm_flush_stream(Rasm *rasm) {
+    long offset = (long)(sizeof(Rm_File_Meta) + sizeof(Inst) * rasm->program_base);
+    size_t count = rasm->program_size - rasm->program_base;
+    if(fseek(rasm->stream, offset, SEEK_SET) < 0
+       || fwrite(rasm->program, sizeof(rasm->program[0]), count, rasm->stream) != count) {
+	fprintf(stderr, "ERROR: Could Not write to File %s\n", strerror(errno));
+	exit(1);
+    }
+    rasm->program_base = rasm->program_size;
+}
+
+static void rasm_emit_inst(Rasm *rasm, Inst inst) {
+    uint64_t index = rasm->program_size - rasm->program_base;
+    if(index >= rasm->program_capacity) {
+	if(rasm->stream != NULL) {
+	    rasm_flush_stream(rasm);
+	    index = 0;
+	} else {
+	    rasm->program_capacity = rasm->program_capacity == 0
+		? RASM_PROGRAM_INITIAL_CAPACITY
+		: rasm->program_capacity * 2;
+	    rasm->program = realloc(rasm->program, sizeof(rasm->program[0]) * rasm->program_capacity);
+	    if(rasm->program == NULL) {
+		fprintf(stderr, "ERROR: could not allocate %zu instructions\n", rasm->program_capacity);
+		exit(1);
+	    }
+	}
+    }
+    rasm->program[index] = inst;
+    rasm->program_size += 1;
+}
+
+// * Set the operand of an instruction, in the window or in the stream
+static void rasm_patch_operand(Rasm *rasm, Inst_Addr addr, Word value) {
+    if(addr >= rasm->program_base) {
+	rasm->program[addr - rasm->program_base].inst_operand = value;
+	return;
+    }
+
+    long offset = (long)(sizeof(Rm_File_Meta) + sizeof(Inst) * addr + offsetof(Inst, inst_operand));
+    if(fseek(rasm->stream, offset, SEEK_SET) < 0
+       || fwrite(&value, sizeof(value), 1, rasm->stream) != 1) {
+	fprintf(stderr, "ERROR: Could Not write to File %s\n", strerror(errno));
+	exit(1);
+    }
+}
+
+// * Operand naming a binding. While streaming, bindings that are already
+// * known are resolved right away so only forward references are kept.
+static void rasm_defer_operand(Rasm *rasm, Inst *inst, String_View operand) {
+    if(rasm->stream != NULL && resolve_bind_value(rasm, operand, &inst->inst_operand)) {
+	return;
+    }
+    rasm_push_deferred_operand(rasm, operand, rasm->program_size);
+}
+
+// * Export `name` from a relocatable object, it may be defined later on
+static void rasm_push_global(Rasm *rasm, String_View name) {
+    for(size_t i = 0; i < rasm->globals_size; ++i) {
+	if(sv_eq(rasm->globals[i], name)) {
+	    return;
+	}
+    }
+
+    if(rasm->globals_size >= rasm->globals_capacity) {
+	rasm->globals_capacity = rasm->globals_capacity == 0 ? 16 : rasm->globals_capacity * 2;
+	rasm->globals = realloc(rasm->globals, sizeof(rasm->globals[0]) * rasm->globals_capacity);
+	if(rasm->globals == NULL) {
+	    fprintf(stderr, "ERROR: could not allocate globals\n");
+	    exit(1);
 	}
+    }
+
+    char *interned = arena_alloc(rasm, name.count);
+    memcpy(interned, name.data, name.count);
+    rasm->globals[rasm->globals_size++] = (String_View) { .count = name.count, .data = interned };
+}
 
-	// printf("Line: "SV_Fmt"\n", SV_Arg(line));
-		
-	String_View token = sv_trim(sv_chop_by_delim(&line, ' '));
+// * Translate the lines of the scanner
+static void rasm_translate_lines(Rasm *rasm, Sv_Scanner *scanner,
+				 String_View input_filepath, int *line_count) {
+    while(sv_scanner_next_line(scanner)) {
+	Inst inst = {0};
+	*line_count += 1;
+	const int line_number = *line_count;
+
+	// * Blank or comment
+	String_View token = sv_scanner_token(scanner);
+	if(token.count == 0) {
+	    continue;
+	}
 	// printf("Token: "SV_Fmt"\n", SV_Arg(token));
 
 	// * Pre-processor directive
@@ -351,17 +882,16 @@ void rasm_translate_source(Rm *rm, String_View input_filepath) {
 	    token.data += 1;
 	    
 	    if(sv_eq(token, SV("const"))) {
-		String_View name = sv_trim(sv_chop_by_delim(&line, ' '));
+		String_View name = sv_scanner_token(scanner);
+		String_View value = sv_scanner_rest(scanner);
 		if(name.count <= 0) {
 		    fprintf(stderr,
 		            ""SV_Fmt":%d: ERROR: label name expected.\n",
 		            SV_Arg(input_filepath), line_number);
 		    exit(1);
 		}
-		printf("value: "SV_Fmt"\n", SV_Arg(line));
-		
 		Word word = {0};
-		if(!rasm_translate_literal(rm, line, &word)) {
+		if(!rasm_translate_literal(rasm, value, &word)) {
 		    fprintf(stderr,
 		            ""SV_Fmt":%d: ERROR: invalid literal.\n",
 		            SV_Arg(input_filepath), line_number);
@@ -369,197 +899,1557 @@ void rasm_translate_source(Rm *rm, String_View input_filepath) {
 		}
 
 		// * Bind the label
-		if(!rasm_bind_value(rm, name, word)) {
+		if(!rasm_bind_value(rasm, name, word, BINDING_CONST)) {
 		    fprintf(stderr, ""SV_Fmt":%d: ERROR: binding `"SV_Fmt"` is already bound \n",
 		    SV_Arg(input_filepath), line_number, SV_Arg(token));
 		    exit(1);		    
 		}
 
 	    }
+	    else if(sv_eq(token, SV("global"))) {
+		String_View name = sv_scanner_token(scanner);
+		if(name.count <= 0) {
+		    fprintf(stderr,
+			    ""SV_Fmt":%d: ERROR: label name expected.\n",
+			    SV_Arg(input_filepath), line_number);
+		    exit(1);
+		}
+		rasm_push_global(rasm, name);
+	    }
 	}
 	else {
-	    // * Get the operand
-	    String_View operand = sv_trim(sv_chop_by_delim(&line, RASM_COMMENT_SYMBOL));
-	    // printf("operand: "SV_Fmt"\n", SV_Arg(operand));	
-
 	    // * Check for labels	    
 	    if(token.data[token.count - 1] == ':') {
 		String_View name = {
 		    .count = token.count - 1,
 		    .data = token.data
 		};
-		if(!rasm_bind_value(rm, name, word_as_u64(rm->rm_program_size))) {
+		if(!rasm_bind_value(rasm, name, word_as_u64(rasm->program_size), BINDING_LABEL)) {
 		    fprintf(stderr, ""SV_Fmt":%d: ERROR: binding `"SV_Fmt"` is already bound\n",
 		    SV_Arg(input_filepath), line_number, SV_Arg(token));
 		    exit(1);
 		}
 
 		// * Check if inst after ':'
-		token = sv_trim(sv_chop_by_delim(&line, ' '));
+		token = sv_scanner_token(scanner);
 	    }
+
+	    // * Get the operand
+	    String_View operand = sv_scanner_rest(scanner);
+	    // printf("operand: "SV_Fmt"\n", SV_Arg(operand));	
 	    
 
 	    // Instructions
 	    if(token.count > 0) {
-		if(sv_eq(token, SV(inst_as_cstr(INST_PUSH)))) {		   		  
-		    Inst_Type inst_type = INST_PUSH;
-		    rm->program[rm->rm_program_size].inst_type = inst_type;
-		    if(!rasm_translate_literal(rm,
-		                              operand,
-		                              &rm->program[rm->rm_program_size].inst_operand)) {
-			
-			rasm_push_deferred_operand(rm, operand, rm->rm_program_size);
-		    }
-		}   
-		else if(sv_eq(token, SV(inst_as_cstr(INST_DUP)))) {
-		    Inst_Type inst_type = INST_DUP;
-		    rm->program[rm->rm_program_size].inst_type = inst_type;
-
-		    char *str = arena_sv_to_cstr(rm, operand);
-		    char *endptr;
-		    Word result = {0};
-		    result.as_u64 = strtoull(str, &endptr, 10);
-		    if(endptr == str) {
-			fprintf(stderr, "No digits were found\n");
-			exit(1);
-		    }
-		    rm->program[rm->rm_program_size].inst_operand = result;
+		Inst_Type inst_type;
+		if(!inst_from_sv(token, &inst_type)) {
+		    fprintf(stderr, ""SV_Fmt":%d: ERROR unknown instruction `"SV_Fmt"`\n",
+		    SV_Arg(input_filepath), line_number, SV_Arg(token));
+		    exit(1);
 		}
-		else if(sv_eq(token, SV(inst_as_cstr(INST_JMP)))) {
-		    Inst_Type inst_type = INST_JMP;
-		    rm->program[rm->rm_program_size].inst_type = inst_type;
+		inst.inst_type = inst_type;
+
+		switch(inst_operand_kind(inst_type)) {
+		case INST_OPERAND_NONE:
+		    break;
+
+		case INST_OPERAND_VALUE:
 		    if(operand.count == 0) {
 			fprintf(stderr,
-			        ""SV_Fmt":%d: ERROR: Expected label.\n",
+				""SV_Fmt":%d: ERROR: Expected operand.\n",
 			        SV_Arg(input_filepath), line_number);
-			exit(1);		    
+			exit(1);
 		    }
-		    rasm_push_deferred_operand(rm, operand, rm->rm_program_size);		
-		}
-		else if(sv_eq(token, SV(inst_as_cstr(INST_JMPIF)))) {
-		    Inst_Type inst_type = INST_JMPIF;
-		    rm->program[rm->rm_program_size].inst_type = inst_type;
+		    if(!rasm_translate_literal(rasm, operand, &inst.inst_operand)) {
+			rasm_defer_operand(rasm, &inst, operand);
+		    }
+		    break;
+
+		case INST_OPERAND_LABEL:
 		    if(operand.count == 0) {
 			fprintf(stderr,
-			       ""SV_Fmt":%d: ERROR: Expected label.\n",
-			       SV_Arg(input_filepath), line_number);
-			exit(1);		    
+				""SV_Fmt":%d: ERROR: Expected label.\n",
+				SV_Arg(input_filepath), line_number);
+			exit(1);
 		    }
-		    rasm_push_deferred_operand(rm, operand, rm->rm_program_size);		
-		}	    
-		else if(sv_eq(token, SV(inst_as_cstr(INST_PLUSI)))) {
-		    rm->program[rm->rm_program_size].inst_type = INST_PLUSI;
-		}
-		else if(sv_eq(token, SV(inst_as_cstr(INST_MINUSI)))) {
-		    rm->program[rm->rm_program_size].inst_type = INST_MINUSI;
-		}
-		else if(sv_eq(token, SV(inst_as_cstr(INST_MULI)))) {
-		    rm->program[rm->rm_program_size].inst_type = INST_MULI;
-		}	    	       	    
-		else if(sv_eq(token, SV(inst_as_cstr(INST_DIVI)))) {
-		    rm->program[rm->rm_program_size].inst_type = INST_DIVI;
+		    // * A number is an absolute address, like derasm prints them
+		    if(!rasm_translate_literal(rasm, operand, &inst.inst_operand)) {
+			rasm_defer_operand(rasm, &inst, operand);
+		    }
+		    break;
 		}
-    	    else if(sv_eq(token, SV(inst_as_cstr(INST_GTE)))) {
-		rm->program[rm->rm_program_size].inst_type = INST_GTE;
-	    }	    	       	    
-	    else if(sv_eq(token, SV(inst_as_cstr(INST_HALT)))) {
-		rm->program[rm->rm_program_size].inst_type = INST_HALT;
+		rasm_emit_inst(rasm, inst);
 	    }
-	    else {
-		fprintf(stderr, ""SV_Fmt":%d: ERROR unknown instruction `"SV_Fmt"`\n",
-		SV_Arg(input_filepath), line_number, SV_Arg(token));
-		exit(1);
-	    }
-	    rm->rm_program_size += 1;
-	}
 	    
 	}
 	
 
 	// printf("------------\n");
     }
+}
+
+// * Translate RM program from Text To Binary (create .rm bytecode executables).
+// * The source is read in chunks, only the bindings and the program are kept
+// * in memory. Each chunk is lexed up to its last complete line, the partial
+// * line is carried over to the next chunk.
+void rasm_translate_source(Rasm *rasm, String_View input_filepath) {
+    FILE *source = rasm_open_file(input_filepath, "r");
+    size_t buffer_capacity = RASM_READ_CHUNK;
+    size_t buffer_size = 0;
+    char *buffer = malloc(buffer_capacity);
+    if(buffer == NULL) {
+	fprintf(stderr, "ERROR: could not allocate the read buffer\n");
+	exit(1);
+    }
+    int line_count = 0;
+
+    bool eof = false;
+    while(!eof) {
+	if(buffer_size == buffer_capacity) {
+	    // * A single line longer than the buffer
+	    buffer_capacity *= 2;
+	    buffer = realloc(buffer, buffer_capacity);
+	    if(buffer == NULL) {
+		fprintf(stderr, "ERROR: could not allocate the read buffer\n");
+		exit(1);
+	    }
+	}
+
+	size_t n = fread(buffer + buffer_size, 1, buffer_capacity - buffer_size, source);
+	buffer_size += n;
+	if(n == 0) {
+	    if(ferror(source)) {
+		fprintf(stderr, "ERROR: Could Not read File %s\n", strerror(errno));
+		exit(1);
+	    }
+	    eof = true;
+	}
+
+	size_t complete = buffer_size;
+	if(!eof) {
+	    while(complete > 0 && buffer[complete - 1] != '\n') {
+		complete -= 1;
+	    }
+	    if(complete == 0) {
+		continue;
+	    }
+	}
+
+	Sv_Scanner scanner;
+	sv_scanner_init(&scanner, (String_View) { .count = complete, .data = buffer }, RASM_COMMENT_SYMBOL);
+	rasm_translate_lines(rasm, &scanner, input_filepath, &line_count);
+
+	memmove(buffer, buffer + complete, buffer_size - complete);
+	buffer_size -= complete;
+    }
+    free(buffer);
+    fclose(source);
 
     // * Bind the value of
-    for(size_t i = 0; i < rm->deferred_operands_size; ++i) {
-	String_View binding = rm->deferred_operands[i].name;
-	Inst_Addr addr = rm->deferred_operands[i].addr;
-	if(!resolve_bind_value(rm, binding, &rm->program[addr].inst_operand)) {
+    for(size_t i = 0; i < rasm->deferred_operands_size; ++i) {
+	String_View binding = rasm->deferred_operands[i].name;
+	Inst_Addr addr = rasm->deferred_operands[i].addr;
+	Word value = {0};
+	if(resolve_bind_value(rasm, binding, &value)) {
+	    rasm_patch_operand(rasm, addr, value);
+	} else if(!rasm->relocatable) {
 	    fprintf(stderr, ""SV_Fmt" ERROR: unknown binding `"SV_Fmt"`\n",
 	    SV_Arg(input_filepath), SV_Arg(binding));	    
 	    exit(1);	    
 	}
     }
     
-    // show_bindings(rm);
-    // show_deferred_operands(rm);
+    // show_bindings(rasm);
+    // show_deferred_operands(rasm);
 }
 
-void rm_dump_stack(FILE *stream, Rm *rm) {
-    fprintf(stream, "Stack:\n");
-    if(rm->rm_stack_size > 0) {
-	for(size_t i = 0; i < rm->rm_stack_size; ++i) {
-	   fprintf(stream, "    %"PRIu64"\n", rm->stack[i]);
+// * Move every instruction with keep[i] == true to new_addr[i] in a program
+// * of new_size instructions. Labels, jump targets and operands that were
+// * resolved to a label follow through new_addr, which also has to say
+// * where the dropped instructions and the end of the program (new_addr[size])
+// * went. Deferred operands of dropped instructions are forgotten.
+void rasm_reorder_program(Rasm *rasm, const Inst_Addr *new_addr, const bool *keep, uint64_t new_size) {
+    assert(rasm->stream == NULL && "can't rewrite a streamed program");
+    const uint64_t size = rasm->program_size;
+    Inst *program = malloc(sizeof(program[0]) * (new_size + 1));
+    if(program == NULL) {
+	fprintf(stderr, "ERROR: could not allocate %"PRIu64" instructions\n", new_size + 1);
+	exit(1);
+    }
+
+    size_t deferred_size = 0;
+    for(size_t i = 0; i < rasm->deferred_operands_size; ++i) {
+	Deferred_Operand deferred = rasm->deferred_operands[i];
+	if(!keep[deferred.addr]) {
+	    continue;
 	}
-    } else {	
-	fprintf(stream, "[empty]\n");
-    }   
-}
 
-// * Load the program from rm bytecode into rm->program
-void rm_load_program_from_file(Rm *rm, const char* filepath) {
-    FILE *f = fopen(filepath, "rb");
-    if(f == NULL) {
-	fprintf(stderr, "ERROR: could not open file `%s`: %s\n", filepath, strerror(errno));
-	exit(1);
+	// * Jump targets are moved below
+	Binding *binding = rasm_find_binding(rasm, deferred.name);
+	Inst *inst = &rasm->program[deferred.addr];
+	if(binding != NULL && binding->kind == BINDING_LABEL
+	   && inst_operand_kind(inst->inst_type) != INST_OPERAND_LABEL
+	   && inst->inst_operand.as_u64 <= size) {
+	    inst->inst_operand.as_u64 = new_addr[inst->inst_operand.as_u64];
+	}
+
+	deferred.addr = new_addr[deferred.addr];
+	rasm->deferred_operands[deferred_size++] = deferred;
     }
+    rasm->deferred_operands_size = deferred_size;
 
-    // * Read the meta Information about file
-    Rm_File_Meta meta = {0};
-    size_t n = fread(&meta, sizeof(meta), 1, f);
-    if(n < 1) {
-	fprintf(stderr, "ERROR: could not read file meta `%s`: %s\n", filepath, strerror(errno));
-	exit(1);	
+    for(size_t i = 0; i < rasm->bindings_capacity; ++i) {
+	if(rasm->bindings[i].name.count > 0 && rasm->bindings[i].kind == BINDING_LABEL) {
+	    rasm->bindings[i].value.as_u64 = new_addr[rasm->bindings[i].value.as_u64];
+	}
     }
 
-    if(meta.magic != RM_FILE_MAGIC) {
-	fprintf(stderr,
-	"ERROR: %s does not appear to be valid BM file"
-	"Unexpected magic %04X. Expected %04X\n",
-	filepath, meta.magic, RM_FILE_MAGIC);
-	exit(1);	
+    for(size_t i = 0; i < size; ++i) {
+	if(keep[i]) {
+	    // * Jump targets are addresses whether they came from a label or a literal
+	    Inst inst = rasm->program[i];
+	    if(inst_operand_kind(inst.inst_type) == INST_OPERAND_LABEL && inst.inst_operand.as_u64 <= size) {
+		inst.inst_operand.as_u64 = new_addr[inst.inst_operand.as_u64];
+	    }
+	    program[new_addr[i]] = inst;
+	}
+    }
+    if(new_size > 0) {
+	memcpy(rasm->program, program, sizeof(program[0]) * new_size);
     }
+    rasm->program_size = new_size;
+    free(program);
+}
 
-    // printf("program size: %ld\n", meta.program_size);
-    rm->rm_program_size = fread(rm->program, sizeof(rm->program[0]), meta.program_size, f);
-    if(meta.program_size != rm->rm_program_size) {
-	fprintf(stderr,
-	        "ERROR: %s read %"PRIu64" instructions, Expected %"PRIu64" instructions",
-	        filepath, rm->rm_program_size, meta.program_size);
+// * Drop every instruction with keep[i] == false from a translated program.
+// * A label on a dropped instruction slides to the next survivor.
+void rasm_compact_program(Rasm *rasm, const bool *keep) {
+    const uint64_t size = rasm->program_size;
+    Inst_Addr *new_addr = malloc(sizeof(new_addr[0]) * (size + 1));
+    if(new_addr == NULL) {
+	fprintf(stderr, "ERROR: could not allocate %"PRIu64" addresses\n", size + 1);
 	exit(1);
     }
-    
+
+    Inst_Addr next = 0;
+    for(size_t i = 0; i < size; ++i) {
+	new_addr[i] = next;
+	if(keep[i]) next += 1;
+    }
+    new_addr[size] = next;
+
+    rasm_reorder_program(rasm, new_addr, keep, next);
+    free(new_addr);
 }
 
-Err rm_execute_program(Rm *rm, int limit) {
-    while(limit != 0 && !rm->halt) {
-	Err err = rm_execute_inst(rm);
-	if(err != ERR_OK) {
-	    printf("ERROR: %s\n", err_as_cstr(err));
-	    return err;
+// * leader[addr] for every instruction something can jump to: labels and
+// * jump targets, whether they came from a label or a literal
+static void rasm_mark_leaders(const Rasm *rasm, bool *leader) {
+    const uint64_t size = rasm->program_size;
+    for(size_t i = 0; i < rasm->bindings_capacity; ++i) {
+	if(rasm->bindings[i].name.count > 0
+	   && rasm->bindings[i].kind == BINDING_LABEL
+	   && rasm->bindings[i].value.as_u64 <= size) {
+	    leader[rasm->bindings[i].value.as_u64] = true;
 	}
-	if(limit > 0) {
-	    --limit;
+    }
+    for(size_t i = 0; i < size; ++i) {
+	const Inst inst = rasm->program[i];
+	if(inst_operand_kind(inst.inst_type) == INST_OPERAND_LABEL && inst.inst_operand.as_u64 <= size) {
+	    leader[inst.inst_operand.as_u64] = true;
 	}
     }
-    return ERR_OK;
 }
 
-Err rm_execute_inst(Rm *rm) {
-    if(rm->ip > rm->rm_program_size) {
+// * Rewrite common sequences into superinstructions. Runs on a translated
+// * program, never fuses across a label and counts the fused sites per
+// * pattern into `counts`.
+void rasm_fuse_program(Rasm *rasm, size_t counts[FUSE_COUNT]) {
+    const uint64_t size = rasm->program_size;
+    bool *leader = calloc(size + 1, sizeof(leader[0]));
+    bool *keep = calloc(size + 1, sizeof(keep[0]));
+    Deferred_Operand **deferred_of = calloc(size + 1, sizeof(deferred_of[0]));
+    if(leader == NULL || keep == NULL || deferred_of == NULL) {
+	fprintf(stderr, "ERROR: could not allocate fusion state\n");
+	exit(1);
+    }
+
+    memset(counts, 0, sizeof(counts[0]) * FUSE_COUNT);
+
+    rasm_mark_leaders(rasm, leader);
+    for(size_t i = 0; i < rasm->deferred_operands_size; ++i) {
+	deferred_of[rasm->deferred_operands[i].addr] = &rasm->deferred_operands[i];
+    }
+    for(size_t i = 0; i < size; ++i) {
+	keep[i] = true;
+    }
+
+    size_t i = 0;
+    while(i < size) {
+	Inst *inst = &rasm->program[i];
+
+	// * dup 0; push K; plusi
+	if(i + 2 < size && !leader[i + 1] && !leader[i + 2]
+	   && inst[0].inst_type == INST_DUP && inst[0].inst_operand.as_u64 == 0
+	   && inst[1].inst_type == INST_PUSH
+	   && inst[2].inst_type == INST_PLUSI) {
+	    inst[0] = (Inst) { .inst_type = INST_DUP_INC, .inst_operand = inst[1].inst_operand };
+	    if(deferred_of[i + 1] != NULL) {
+		deferred_of[i + 1]->addr = i;
+	    }
+	    keep[i + 1] = false;
+	    keep[i + 2] = false;
+	    counts[FUSE_DUP_INC] += 1;
+	    i += 3;
+	    continue;
+	}
+
+	// * push K; plusi
+	if(i + 1 < size && !leader[i + 1]
+	   && inst[0].inst_type == INST_PUSH
+	   && inst[1].inst_type == INST_PLUSI) {
+	    inst[0].inst_type = INST_PUSH_PLUSI;
+	    keep[i + 1] = false;
+	    counts[FUSE_PUSH_PLUSI] += 1;
+	    i += 2;
+	    continue;
+	}
+
+	// * gt/gte/lt/lte; jmp_if L
+	if(i + 1 < size && !leader[i + 1] && inst[1].inst_type == INST_JMPIF) {
+	    Fuse_Pattern pattern = FUSE_COUNT;
+	    Inst_Type fused = INST_NOP;
+	    if(inst[0].inst_type == INST_GT) {
+		pattern = FUSE_GT_JMPIF;
+		fused = INST_GT_JMPIF;
+	    } else if(inst[0].inst_type == INST_GTE) {
+		pattern = FUSE_GTE_JMPIF;
+		fused = INST_GTE_JMPIF;
+	    } else if(inst[0].inst_type == INST_LT) {
+		pattern = FUSE_LT_JMPIF;
+		fused = INST_LT_JMPIF;
+	    } else if(inst[0].inst_type == INST_LTE) {
+		pattern = FUSE_LTE_JMPIF;
+		fused = INST_LTE_JMPIF;
+	    }
+
+	    if(pattern != FUSE_COUNT) {
+		inst[0] = (Inst) { .inst_type = fused, .inst_operand = inst[1].inst_operand };
+		if(deferred_of[i + 1] != NULL) {
+		    deferred_of[i + 1]->addr = i;
+		}
+		keep[i + 1] = false;
+		counts[pattern] += 1;
+		i += 2;
+		continue;
+	    }
+	}
+
+	i += 1;
+    }
+
+    rasm_compact_program(rasm, keep);
+    free(deferred_of);
+    free(keep);
+    free(leader);
+}
+
+// * Evaluate `a op b` the way the VM would. Fails for anything that isn't
+// * a binary operator and for the divisions that trap at runtime, those
+// * are left for the program to hit.
+static bool rasm_fold_binop(Inst_Type type, int64_t a, int64_t b, int64_t *result) {
+    if(type == INST_PLUSI) {
+	*result = (int64_t)((uint64_t)a + (uint64_t)b);
+    } else if(type == INST_MINUSI) {
+	*result = (int64_t)((uint64_t)a - (uint64_t)b);
+    } else if(type == INST_MULI) {
+	*result = (int64_t)((uint64_t)a * (uint64_t)b);
+    } else if(type == INST_DIVI || type == INST_MODI) {
+	if(b == 0 || (a == INT64_MIN && b == -1)) {
+	    return false;
+	}
+	*result = type == INST_DIVI ? a / b : a % b;
+    } else if(type == INST_GT) {
+	*result = a > b;
+    } else if(type == INST_GTE) {
+	*result = a >= b;
+    } else if(type == INST_LT) {
+	*result = a < b;
+    } else if(type == INST_LTE) {
+	*result = a <= b;
+    } else {
+	return false;
+    }
+    return true;
+}
+
+// * A push of a value known at assembly time: a literal or a %const, not
+// * a label address that moves when the program gets compacted
+static bool rasm_is_constant_push(Rasm *rasm, Deferred_Operand **deferred_of, size_t addr) {
+    if(rasm->program[addr].inst_type != INST_PUSH) {
+	return false;
+    }
+    if(deferred_of[addr] == NULL) {
+	return true;
+    }
+    Binding *binding = rasm_find_binding(rasm, deferred_of[addr]->name);
+    return binding != NULL && binding->kind == BINDING_CONST;
+}
+
+// * Peephole pass over a translated program: folds arithmetic and
+// * comparisons on constants, resolves jmp_if on a constant, drops nops
+// * and jumps to the next instruction, then compacts the program. Never
+// * looks across a label and counts the rewrites per kind into `counts`.
+void rasm_optimize_program(Rasm *rasm, size_t counts[OPT_COUNT]) {
+    const uint64_t size = rasm->program_size;
+    bool *leader = calloc(size + 1, sizeof(leader[0]));
+    bool *keep = calloc(size + 1, sizeof(keep[0]));
+    Deferred_Operand **deferred_of = calloc(size + 1, sizeof(deferred_of[0]));
+    // * Kept instructions of the current block, in order
+    size_t *window = malloc(sizeof(window[0]) * (size + 1));
+    if(leader == NULL || keep == NULL || deferred_of == NULL || window == NULL) {
+	fprintf(stderr, "ERROR: could not allocate optimizer state\n");
+	exit(1);
+    }
+
+    memset(counts, 0, sizeof(counts[0]) * OPT_COUNT);
+
+    rasm_mark_leaders(rasm, leader);
+    for(size_t i = 0; i < rasm->deferred_operands_size; ++i) {
+	deferred_of[rasm->deferred_operands[i].addr] = &rasm->deferred_operands[i];
+    }
+
+    size_t window_size = 0;
+    for(size_t i = 0; i < size; ++i) {
+	Inst *inst = &rasm->program[i];
+	if(leader[i]) {
+	    window_size = 0;
+	}
+
+	if(inst->inst_type == INST_NOP) {
+	    counts[OPT_NOP] += 1;
+	    continue;
+	}
+
+	if(inst->inst_type == INST_JMP && inst->inst_operand.as_u64 == i + 1) {
+	    counts[OPT_JMP_NEXT] += 1;
+	    continue;
+	}
+
+	// * push A; push B; op -> push C, where A may itself be folded
+	int64_t result = 0;
+	if(window_size >= 2
+	   && rasm_is_constant_push(rasm, deferred_of, window[window_size - 2])
+	   && rasm_is_constant_push(rasm, deferred_of, window[window_size - 1])
+	   && rasm_fold_binop(inst->inst_type,
+			      rasm->program[window[window_size - 2]].inst_operand.as_i64,
+			      rasm->program[window[window_size - 1]].inst_operand.as_i64,
+			      &result)) {
+	    const size_t a = window[window_size - 2];
+	    const size_t b = window[window_size - 1];
+	    counts[inst->inst_type == INST_GT || inst->inst_type == INST_GTE
+		   || inst->inst_type == INST_LT || inst->inst_type == INST_LTE
+		   ? OPT_FOLD_COMPARISON : OPT_FOLD_ARITHMETIC] += 1;
+	    rasm->program[a].inst_operand.as_i64 = result;
+	    deferred_of[a] = NULL;
+	    keep[b] = false;
+	    window_size -= 1;
+	    continue;
+	}
+
+	// * push 0; jmp_if L never jumps, push K; jmp_if L always does
+	if(inst->inst_type == INST_JMPIF && window_size >= 1
+	   && rasm_is_constant_push(rasm, deferred_of, window[window_size - 1])) {
+	    const size_t push = window[window_size - 1];
+	    counts[OPT_CONST_JMPIF] += 1;
+	    keep[push] = false;
+	    window_size -= 1;
+	    if(rasm->program[push].inst_operand.as_i64 == 0) {
+		continue;
+	    }
+	    inst->inst_type = INST_JMP;
+	}
+
+	keep[i] = true;
+	window[window_size++] = i;
+    }
+
+    rasm_compact_program(rasm, keep);
+    free(window);
+    free(deferred_of);
+    free(keep);
+    free(leader);
+}
+
+void rm_dump_stack(FILE *stream, const Rm *rm) {
+    fprintf(stream, "Stack:\n");
+    if(rm->rm_stack_size > 0) {
+	for(size_t i = 0; i < rm->rm_stack_size; ++i) {
+	   fprintf(stream, "    %"PRIu64"\n", rm->stack[i]);
+	}
+    } else {	
+	fprintf(stream, "[empty]\n");
+    }   
+}
+
+// * What rme prints after a run: the error, if any, and the stack
+void rm_dump_result(FILE *stream, const Rm *rm, Err err) {
+    if(err != ERR_OK) {
+	fprintf(stream, "ERROR: %s\n", err_as_cstr(err));
+    }
+    rm_dump_stack(stream, rm);
+}
+
+size_t rm_encode_inst(Inst inst, uint8_t *buffer) {
+    size_t size = 0;
+    buffer[size++] = (uint8_t)inst.inst_type;
+    if(inst_has_operand(inst.inst_type)) {
+	uint64_t u = inst.inst_operand.as_u64;
+	uint64_t zigzag = (u << 1) ^ (0 - (u >> 63));
+	while(zigzag >= 0x80) {
+	    buffer[size++] = (uint8_t)(zigzag | 0x80);
+	    zigzag >>= 7;
+	}
+	buffer[size++] = (uint8_t)zigzag;
+    }
+    return size;
+}
+
+// * Decode the instruction at data[*offset] and advance *offset past it.
+// * Fails on an unknown opcode or a truncated operand.
+bool rm_decode_inst(const uint8_t *data, size_t size, size_t *offset, Inst *inst) {
+    size_t i = *offset;
+    if(i >= size || data[i] >= INST_TYPES_COUNT) return false;
+    inst->inst_type = (Inst_Type)data[i++];
+    inst->inst_operand.as_u64 = 0;
+
+    if(inst_has_operand(inst->inst_type)) {
+	uint64_t zigzag = 0;
+	for(unsigned shift = 0;; shift += 7) {
+	    if(i >= size || shift >= 64) return false;
+	    uint8_t byte = data[i++];
+	    zigzag |= (uint64_t)(byte & 0x7F) << shift;
+	    if((byte & 0x80) == 0) break;
+	}
+	inst->inst_operand.as_u64 = (zigzag >> 1) ^ (0 - (zigzag & 1));
+    }
+
+    *offset = i;
+    return true;
+}
+
+// * Raw bytes of a .rm file, mapped read-only where possible
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    bool mapped;
+} Rm_File_View;
+
+static Rm_File_View rm_open_file_view(const char *filepath) {
+    Rm_File_View view = {0};
+#ifdef RM_MMAP_SUPPORTED
+    int fd = open(filepath, O_RDONLY);
+    struct stat statbuf;
+    if(fd < 0 || fstat(fd, &statbuf) < 0) {
+	fprintf(stderr, "ERROR: could not open file `%s`: %s\n", filepath, strerror(errno));
+	exit(1);
+    }
+    view.size = (size_t)statbuf.st_size;
+    if(view.size > 0) {
+	void *data = mmap(NULL, view.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(data == MAP_FAILED) {
+	    fprintf(stderr, "ERROR: could not map file `%s`: %s\n", filepath, strerror(errno));
+	    exit(1);
+	}
+	view.data = data;
+	view.mapped = true;
+    }
+    close(fd);
+#else
+    FILE *f = fopen(filepath, "rb");
+    if(f == NULL) {
+	fprintf(stderr, "ERROR: could not open file `%s`: %s\n", filepath, strerror(errno));
+	exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    view.size = size > 0 ? (size_t)size : 0;
+    view.data = malloc(view.size + 1);
+    if(view.data == NULL || fread(view.data, 1, view.size, f) != view.size) {
+	fprintf(stderr, "ERROR: could not read file `%s`: %s\n", filepath, strerror(errno));
+	exit(1);
+    }
+    fclose(f);
+#endif
+    return view;
+}
+
+static void rm_close_file_view(Rm_File_View *view) {
+#ifdef RM_MMAP_SUPPORTED
+    if(view->mapped) {
+	munmap(view->data, view->size);
+    }
+#else
+    free(view->data);
+#endif
+    view->data = NULL;
+    view->size = 0;
+}
+
+static Inst *rm_alloc_insts(const char *filepath, uint64_t insts_size) {
+    Inst *insts = malloc(sizeof(Inst) * (insts_size + 1));
+    if(insts == NULL) {
+	fprintf(stderr, "ERROR: could not allocate %"PRIu64" instructions for %s\n",
+		insts_size, filepath);
+	exit(1);
+    }
+    return insts;
+}
+
+static void rm_load_program_v1(Rm_Program *program, Rm_File_View *view, const char *filepath) {
+    Rm_File_Meta_V1 meta = {0};
+    if(view->size < sizeof(meta)) {
+	fprintf(stderr, "ERROR: could not read file meta `%s`\n", filepath);
+	exit(1);
+    }
+    memcpy(&meta, view->data, sizeof(meta));
+
+    // * The instructions after the 10 byte header are not aligned, copy them
+    uint64_t available = (view->size - sizeof(meta)) / sizeof(Inst);
+    if(meta.program_size > available) {
+	fprintf(stderr,
+		"ERROR: %s read %"PRIu64" instructions, Expected %"PRIu64" instructions\n",
+		filepath, available, meta.program_size);
+	exit(1);
+    }
+    program->owned_insts = rm_alloc_insts(filepath, meta.program_size);
+    memcpy(program->owned_insts, view->data + sizeof(meta), sizeof(Inst) * meta.program_size);
+    program->insts = program->owned_insts;
+    program->insts_size = meta.program_size;
+}
+
+static void rm_load_program_v2(Rm_Program *program, Rm_File_View *view, const char *filepath) {
+    Rm_File_Meta meta = {0};
+    if(view->size < sizeof(meta)) {
+	fprintf(stderr, "ERROR: could not read file meta `%s`\n", filepath);
+	exit(1);
+    }
+    memcpy(&meta, view->data, sizeof(meta));
+
+    if(meta.version != RM_FILE_VERSION
+       || (meta.encoding != RM_ENCODING_COMPACT && meta.encoding != RM_ENCODING_RAW)) {
+	fprintf(stderr,
+		"ERROR: %s has unsupported version %u, encoding %u\n",
+		filepath, meta.version, meta.encoding);
+	exit(1);
+    }
+
+    const uint8_t *code = view->data + sizeof(meta);
+    size_t code_size = view->size - sizeof(meta);
+
+    if(meta.encoding == RM_ENCODING_RAW) {
+	if(meta.program_size != code_size / sizeof(Inst) || code_size % sizeof(Inst) != 0) {
+	    fprintf(stderr,
+		    "ERROR: %s has %zu bytes of raw instructions, Expected %"PRIu64" instructions\n",
+		    filepath, code_size, meta.program_size);
+	    exit(1);
+	}
+
+	// * Execute straight from the page cache, the mapping is page
+	// * aligned and the header keeps the instructions aligned
+	if(view->mapped) {
+	    program->mapping = view->data;
+	    program->mapping_size = view->size;
+	    program->insts = (const Inst *)code;
+	    program->insts_size = meta.program_size;
+	    view->data = NULL;
+	    view->size = 0;
+	    view->mapped = false;
+	    return;
+	}
+
+	program->owned_insts = rm_alloc_insts(filepath, meta.program_size);
+	memcpy(program->owned_insts, code, code_size);
+	program->insts = program->owned_insts;
+	program->insts_size = meta.program_size;
+	return;
+    }
+
+    // * Every compact instruction takes at least one byte
+    if(meta.program_size > code_size) {
+	fprintf(stderr, "ERROR: %s is too short for %"PRIu64" instructions\n",
+		filepath, meta.program_size);
+	exit(1);
+    }
+
+    program->owned_insts = rm_alloc_insts(filepath, meta.program_size);
+    program->insts = program->owned_insts;
+    size_t offset = 0;
+    for(program->insts_size = 0; program->insts_size < meta.program_size; ++program->insts_size) {
+	if(!rm_decode_inst(code, code_size, &offset, &program->owned_insts[program->insts_size])) {
+	    fprintf(stderr,
+		    "ERROR: %s has a malformed instruction %"PRIu64" at byte %zu\n",
+		    filepath, program->insts_size, sizeof(meta) + offset);
+	    exit(1);
+	}
+    }
+    if(offset != code_size) {
+	fprintf(stderr, "ERROR: %s has trailing bytes after %"PRIu64" instructions\n",
+		filepath, meta.program_size);
+	exit(1);
+    }
+}
+
+// * Allocate the per instruction tables, verify and prepare the threaded
+// * engine once program->insts is set
+static void rm_setup_program(Rm_Program *program) {
+    program->threaded_code = malloc(sizeof(program->threaded_code[0]) * (program->insts_size + 1));
+    program->verified_depth = malloc(sizeof(program->verified_depth[0]) * (program->insts_size + 1));
+    program->block_cost = malloc(sizeof(program->block_cost[0]) * (program->insts_size + 1));
+    if(program->threaded_code == NULL || program->verified_depth == NULL || program->block_cost == NULL) {
+	fprintf(stderr, "ERROR: could not allocate a program of %"PRIu64" instructions\n",
+		program->insts_size);
+	exit(1);
+    }
+
+    // * Every instruction but a jump or halt continues at ip + 1, so a
+    // * run entered at ip executes exactly block_cost[ip] instructions
+    // * unless it fails on the way
+    program->block_cost[program->insts_size] = 1;
+    for(uint64_t i = program->insts_size; i-- > 0;) {
+	const Inst_Type type = program->insts[i].inst_type;
+	const bool ends_block = (size_t)type < INST_TYPES_COUNT
+	    && (type == INST_HALT || inst_operand_kind(type) == INST_OPERAND_LABEL);
+	program->block_cost[i] = ends_block ? 1 : program->block_cost[i + 1] + 1;
+    }
+    rm_verify_program(program);
+    rm_prepare_threaded(program);
+}
+
+// * Load the program from rm bytecode into program. Both the v1 and the
+// * v2 format are accepted, raw v2 files are executed from the mapping.
+void rm_load_program_from_file(Rm_Program *program, const char* filepath) {
+    rm_unload_program(program);
+
+    Rm_File_View view = rm_open_file_view(filepath);
+
+    // * Peek at the magic to know which header follows
+    uint16_t magic = 0;
+    if(view.size < sizeof(magic)) {
+	fprintf(stderr, "ERROR: could not read file meta `%s`\n", filepath);
+	exit(1);
+    }
+    memcpy(&magic, view.data, sizeof(magic));
+
+    if(magic == RM_FILE_MAGIC) {
+	rm_load_program_v2(program, &view, filepath);
+    } else if(magic == RM_FILE_MAGIC_V1) {
+	rm_load_program_v1(program, &view, filepath);
+    } else {
+	fprintf(stderr,
+		"ERROR: %s does not appear to be valid RM file. "
+		"Unexpected magic %04X. Expected %04X\n",
+		filepath, magic, RM_FILE_MAGIC);
+	exit(1);
+    }
+    rm_close_file_view(&view);
+
+    rm_setup_program(program);
+}
+
+void rm_load_program_from_memory(Rm_Program *program, const Inst *insts, uint64_t insts_size) {
+    rm_unload_program(program);
+    program->owned_insts = rm_alloc_insts("memory", insts_size);
+    memcpy(program->owned_insts, insts, sizeof(insts[0]) * insts_size);
+    program->insts = program->owned_insts;
+    program->insts_size = insts_size;
+    rm_setup_program(program);
+}
+
+// * Load a relocatable object. Anything that doesn't fit the file or points
+// * outside of it is rejected, so the linker can trust the tables.
+void rm_load_object(Rm_Object *object, const char *filepath) {
+    memset(object, 0, sizeof(*object));
+    Rm_File_View view = rm_open_file_view(filepath);
+    object->data = view.data;
+    object->data_size = view.size;
+    object->mapped = view.mapped;
+
+    Rm_Object_Meta meta = {0};
+    if(view.size < sizeof(meta)) {
+	fprintf(stderr, "ERROR: could not read object meta `%s`\n", filepath);
+	exit(1);
+    }
+    memcpy(&meta, view.data, sizeof(meta));
+    if(meta.magic != RM_OBJECT_MAGIC || meta.version != RM_OBJECT_VERSION) {
+	fprintf(stderr,
+		"ERROR: %s does not appear to be a valid RM object. "
+		"Unexpected magic %04X version %u. Expected %04X version %u\n",
+		filepath, meta.magic, meta.version, RM_OBJECT_MAGIC, RM_OBJECT_VERSION);
+	exit(1);
+    }
+
+    size_t available = view.size - sizeof(meta);
+    size_t offset = sizeof(meta);
+    bool fits = meta.program_size <= available / sizeof(Inst);
+    if(fits) {
+	object->insts = (const Inst *)(view.data + offset);
+	object->insts_size = meta.program_size;
+	offset += sizeof(Inst) * meta.program_size;
+	available -= sizeof(Inst) * meta.program_size;
+	fits = meta.symbols_count <= available / sizeof(Rm_Object_Symbol);
+    }
+    if(fits) {
+	object->symbols = (const Rm_Object_Symbol *)(view.data + offset);
+	object->symbols_count = meta.symbols_count;
+	offset += sizeof(Rm_Object_Symbol) * meta.symbols_count;
+	available -= sizeof(Rm_Object_Symbol) * meta.symbols_count;
+	fits = meta.relocations_count <= available / sizeof(Rm_Object_Relocation);
+    }
+    if(fits) {
+	object->relocations = (const Rm_Object_Relocation *)(view.data + offset);
+	object->relocations_count = meta.relocations_count;
+	offset += sizeof(Rm_Object_Relocation) * meta.relocations_count;
+	available -= sizeof(Rm_Object_Relocation) * meta.relocations_count;
+	fits = meta.names_size <= available;
+    }
+    if(!fits) {
+	fprintf(stderr, "ERROR: object `%s` is truncated\n", filepath);
+	exit(1);
+    }
+    object->names = (const char *)(view.data + offset);
+    object->names_size = meta.names_size;
+
+    for(uint64_t i = 0; i < object->symbols_count; ++i) {
+	const Rm_Object_Symbol *symbol = &object->symbols[i];
+	if(symbol->name_size == 0
+	   || symbol->name_offset > object->names_size
+	   || symbol->name_size > object->names_size - symbol->name_offset
+	   || (symbol->kind != BINDING_CONST && symbol->kind != BINDING_LABEL)
+	   || (symbol->kind == BINDING_LABEL && symbol->value.as_u64 > object->insts_size)) {
+	    fprintf(stderr, "ERROR: object `%s` has an invalid symbol #%"PRIu64"\n", filepath, i);
+	    exit(1);
+	}
+    }
+    for(uint64_t i = 0; i < object->relocations_count; ++i) {
+	const Rm_Object_Relocation *relocation = &object->relocations[i];
+	bool valid = relocation->addr < object->insts_size;
+	if(relocation->kind == RM_RELOC_SYMBOL) {
+	    valid = valid
+		&& relocation->name_size > 0
+		&& relocation->name_offset <= object->names_size
+		&& relocation->name_size <= object->names_size - relocation->name_offset;
+	} else if(relocation->kind != RM_RELOC_BASE) {
+	    valid = false;
+	}
+	if(!valid) {
+	    fprintf(stderr, "ERROR: object `%s` has an invalid relocation #%"PRIu64"\n", filepath, i);
+	    exit(1);
+	}
+    }
+}
+
+void rm_unload_object(Rm_Object *object) {
+    Rm_File_View view = {
+	.data = object->data,
+	.size = object->data_size,
+	.mapped = object->mapped,
+    };
+    rm_close_file_view(&view);
+    memset(object, 0, sizeof(*object));
+}
+
+String_View rm_object_name(const Rm_Object *object, uint64_t offset, uint64_t size) {
+    return (String_View) {
+	.count = size,
+	.data = object->names + offset,
+    };
+}
+
+void rm_unload_program(Rm_Program *program) {
+    rm_release_jit(program);
+#ifdef RM_MMAP_SUPPORTED
+    if(program->mapping != NULL) {
+	munmap(program->mapping, program->mapping_size);
+    }
+#endif
+    free(program->owned_insts);
+    free(program->threaded_code);
+    free(program->verified_depth);
+    free(program->block_cost);
+    memset(program, 0, sizeof(*program));
+}
+
+// * Reset an execution context to the start of a loaded program. Keeps
+// * the stack it already has, or allocates one of RM_STACK_CAPACITY values.
+void rm_init(Rm *rm, const Rm_Program *program) {
+    if(rm->stack == NULL) {
+	rm_alloc_stack(rm, RM_STACK_CAPACITY);
+    }
+    rm->rm_stack_size = 0;
+    rm->ip = 0;
+    rm->halt = false;
+    rm->program = program;
+}
+
+#ifdef RM_STACK_GUARD
+
+// * The VM running on this thread inside of rm_run_guarded and where to
+// * go back to when its stack hits the guard page
+static _Thread_local const Rm *rm_guard_rm = NULL;
+static _Thread_local sigjmp_buf rm_guard_jmp;
+
+static size_t rm_guard_page_size = 0;
+static struct sigaction rm_guard_previous_segv;
+static struct sigaction rm_guard_previous_bus;
+static pthread_once_t rm_guard_once = PTHREAD_ONCE_INIT;
+
+static void rm_guard_handler(int signum, siginfo_t *info, void *context) {
+    const Rm *rm = rm_guard_rm;
+    const char *addr = info->si_addr;
+    if(rm != NULL) {
+	const char *guard = (const char *)(rm->stack + rm->stack_capacity);
+	if(addr >= guard && addr < guard + rm_guard_page_size) {
+	    siglongjmp(rm_guard_jmp, 1);
+	}
+    }
+
+    // * Not ours, hand it over to whoever was there before. Restoring a
+    // * default action lets the faulting instruction trap again with it.
+    const struct sigaction *previous = signum == SIGBUS ? &rm_guard_previous_bus : &rm_guard_previous_segv;
+    if(previous->sa_flags & SA_SIGINFO) {
+	previous->sa_sigaction(signum, info, context);
+    } else if(previous->sa_handler == SIG_DFL || previous->sa_handler == SIG_IGN) {
+	sigaction(signum, previous, NULL);
+    } else {
+	previous->sa_handler(signum);
+    }
+}
+
+// * Runs once per process through rm_guard_install. SA_NODEFER keeps the
+// * signal unblocked after siglongjmp, so sigsetjmp doesn't have to save
+// * the mask.
+static void rm_guard_install_once(void) {
+    rm_guard_page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = rm_guard_handler;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &rm_guard_previous_segv);
+    sigaction(SIGBUS, &action, &rm_guard_previous_bus);
+}
+
+static void rm_guard_install(void) {
+    pthread_once(&rm_guard_once, rm_guard_install_once);
+}
+
+#endif // RM_STACK_GUARD
+
+// * Give rm a stack of `capacity` values, replacing the one it had. With
+// * RM_STACK_GUARD the stack ends exactly where its guard page starts.
+void rm_alloc_stack(Rm *rm, uint64_t capacity) {
+    if(capacity == 0 || capacity > RM_STACK_MAX_CAPACITY) {
+	fprintf(stderr, "ERROR: stack capacity must be between 1 and %d values\n", RM_STACK_MAX_CAPACITY);
+	exit(1);
+    }
+    rm_free_stack(rm);
+
+#ifdef RM_STACK_GUARD
+    rm_guard_install();
+    const size_t page = rm_guard_page_size;
+    const size_t bytes = (sizeof(rm->stack[0]) * capacity + page - 1) / page * page;
+    char *mapping = mmap(NULL, bytes + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mapping == MAP_FAILED) {
+	fprintf(stderr, "ERROR: could not allocate a stack of %"PRIu64" values: %s\n", capacity, strerror(errno));
+	exit(1);
+    }
+    if(mprotect(mapping + bytes, page, PROT_NONE) < 0) {
+	fprintf(stderr, "ERROR: could not protect the stack guard page: %s\n", strerror(errno));
+	exit(1);
+    }
+    rm->stack_mapping = mapping;
+    rm->stack_mapping_size = bytes + page;
+    rm->stack = (int64_t *)(void *)(mapping + bytes) - capacity;
+#else
+    rm->stack = malloc(sizeof(rm->stack[0]) * capacity);
+    if(rm->stack == NULL) {
+	fprintf(stderr, "ERROR: could not allocate a stack of %"PRIu64" values\n", capacity);
+	exit(1);
+    }
+#endif
+    rm->stack_capacity = capacity;
+}
+
+void rm_free_stack(Rm *rm) {
+#ifdef RM_STACK_GUARD
+    if(rm->stack_mapping != NULL) {
+	munmap(rm->stack_mapping, rm->stack_mapping_size);
+    }
+#else
+    free(rm->stack);
+#endif
+    rm->stack = NULL;
+    rm->stack_capacity = 0;
+    rm->stack_mapping = NULL;
+    rm->stack_mapping_size = 0;
+}
+
+#ifdef RM_STACK_GUARD
+#define RM_STACK_GUARDED true
+#else
+#define RM_STACK_GUARDED false
+#endif
+
+// * Run an engine that leaves the overflow checks of push and dup to the
+// * guard page. A push into it comes back here as ERR_STACK_OVERFLOW,
+// * with the VM right before the instruction like any other error.
+static Err rm_run_guarded(Rm *rm, int limit, Err (*run)(Rm *rm, int limit)) {
+#ifdef RM_STACK_GUARD
+    if(sigsetjmp(rm_guard_jmp, 0) != 0) {
+	rm_guard_rm = NULL;
+	return ERR_STACK_OVERFLOW;
+    }
+    rm_guard_rm = rm;
+    Err err = run(rm, limit);
+    rm_guard_rm = NULL;
+    return err;
+#else
+    return run(rm, limit);
+#endif
+}
+
+// * Propagate the stack depth into the basic block starting at `addr`.
+// * A block reached with two different depths can't be verified.
+static bool rm_verify_enter_block(Rm_Program *program, Inst_Addr addr, uint64_t depth,
+				  Inst_Addr *worklist, size_t *worklist_size) {
+    if(addr >= program->insts_size) {
+	return false;
+    }
+    if(program->verified_depth[addr] == RM_DEPTH_UNKNOWN) {
+	program->verified_depth[addr] = depth;
+	worklist[(*worklist_size)++] = addr;
+	return true;
+    }
+    return program->verified_depth[addr] == depth;
+}
+
+// * Abstract interpretation of the stack depth over basic blocks.
+// * Checks every reachable opcode and jump target, proves that the stack
+// * can't underflow and finds the capacity it needs to never overflow.
+static bool rm_verify_blocks(Rm_Program *program, bool *leader, Inst_Addr *worklist) {
+    size_t worklist_size = 0;
+    uint64_t need = 0;
+
+    // * Find the leaders of basic blocks
+    leader[0] = true;
+    for(size_t i = 0; i < program->insts_size; ++i) {
+	Inst inst = program->insts[i];
+	switch(inst.inst_type) {
+	case INST_JMP:
+	case INST_JMPIF:
+	case INST_GT_JMPIF:
+	case INST_GTE_JMPIF:
+	case INST_LT_JMPIF:
+	case INST_LTE_JMPIF:
+	    if(inst.inst_operand.as_u64 >= program->insts_size) {
+		return false;
+	    }
+	    leader[inst.inst_operand.as_u64] = true;
+	    if(i + 1 < program->insts_size) leader[i + 1] = true;
+	    break;
+	case INST_HALT:
+	    if(i + 1 < program->insts_size) leader[i + 1] = true;
+	    break;
+	case INST_NOP:
+	case INST_PUSH:
+	case INST_DUP:
+	case INST_PLUSI:
+	case INST_MINUSI:
+	case INST_MULI:
+	case INST_DIVI:
+	case INST_MODI:
+	case INST_GT:
+	case INST_GTE:
+	case INST_LT:
+	case INST_LTE:
+	case INST_PUSH_PLUSI:
+	case INST_DUP_INC:
+	    break;
+	default:
+	    return false;
+	}
+    }
+
+    for(size_t i = 0; i < program->insts_size; ++i) {
+	program->verified_depth[i] = RM_DEPTH_UNKNOWN;
+    }
+    rm_verify_enter_block(program, 0, 0, worklist, &worklist_size);
+
+    while(worklist_size > 0) {
+	Inst_Addr addr = worklist[--worklist_size];
+	uint64_t depth = program->verified_depth[addr];
+
+	for(;;) {
+	    program->verified_depth[addr] = depth;
+	    Inst inst = program->insts[addr];
+	    switch(inst.inst_type) {
+	    case INST_HALT:
+		goto next_block;
+
+	    case INST_PUSH:
+		if(depth + 1 > need) need = depth + 1;
+		depth += 1;
+		break;
+
+	    case INST_DUP:
+		if(inst.inst_operand.as_u64 >= depth) return false;
+		if(depth + 1 > need) need = depth + 1;
+		depth += 1;
+		break;
+
+	    case INST_JMP:
+		if(!rm_verify_enter_block(program, inst.inst_operand.as_u64, depth,
+					  worklist, &worklist_size)) {
+		    return false;
+		}
+		goto next_block;
+
+	    case INST_JMPIF:
+		if(depth < 1) return false;
+		depth -= 1;
+		if(!rm_verify_enter_block(program, inst.inst_operand.as_u64, depth,
+					  worklist, &worklist_size)) {
+		    return false;
+		}
+		break;
+
+	    case INST_PLUSI:
+	    case INST_MINUSI:
+	    case INST_MULI:
+	    case INST_DIVI:
+	    case INST_MODI:
+	    case INST_GT:
+	    case INST_GTE:
+	    case INST_LT:
+	    case INST_LTE:
+		if(depth < 2) return false;
+		depth -= 1;
+		break;
+
+	    case INST_GT_JMPIF:
+	    case INST_GTE_JMPIF:
+	    case INST_LT_JMPIF:
+	    case INST_LTE_JMPIF:
+		if(depth < 2) return false;
+		depth -= 2;
+		if(!rm_verify_enter_block(program, inst.inst_operand.as_u64, depth,
+					  worklist, &worklist_size)) {
+		    return false;
+		}
+		break;
+
+	    // * Fused instructions keep the overflow checks of the sequence
+	    // * they replace, so the verifier demands the same headroom
+	    case INST_PUSH_PLUSI:
+		if(depth < 1) return false;
+		if(depth + 1 > need) need = depth + 1;
+		break;
+
+	    case INST_DUP_INC:
+		if(depth < 1) return false;
+		if(depth + 2 > need) need = depth + 2;
+		depth += 1;
+		break;
+
+	    case INST_NOP:
+		break;
+
+	    default:
+		return false;
+	    }
+
+	    // * Fall through into the next instruction
+	    addr += 1;
+	    if(addr >= program->insts_size) {
+		return false;
+	    }
+	    if(leader[addr]) {
+		if(!rm_verify_enter_block(program, addr, depth, worklist, &worklist_size)) {
+		    return false;
+		}
+		goto next_block;
+	    }
+	}
+    next_block: ;
+    }
+
+    program->verified_stack_need = need;
+    return true;
+}
+
+bool rm_verify_program(Rm_Program *program) {
+    program->verified = false;
+    program->verified_stack_need = 0;
+    if(program->insts_size == 0) {
+	return false;
+    }
+
+    bool *leader = calloc(program->insts_size, sizeof(leader[0]));
+    Inst_Addr *worklist = malloc(sizeof(worklist[0]) * program->insts_size);
+    if(leader == NULL || worklist == NULL) {
+	fprintf(stderr, "ERROR: could not allocate verifier state\n");
+	exit(1);
+    }
+    program->verified = rm_verify_blocks(program, leader, worklist);
+    free(worklist);
+    free(leader);
+    return program->verified;
+}
+
+// * The unchecked engines may only be entered in a state the verifier
+// * has proven, e.g. at ip 0 with an empty stack or after a time slice,
+// * on a stack big enough for the program
+static bool rm_can_run_unchecked(const Rm *rm) {
+    return rm->program->verified
+	&& rm->program->verified_stack_need <= rm->stack_capacity
+	&& rm->ip < rm->program->insts_size
+	&& rm->program->verified_depth[rm->ip] == rm->rm_stack_size;
+}
+
+// * Every engine keeps the exact meaning of `limit`: run at most that
+// * many instructions, or until halt when it is negative. Rather than
+// * counting each instruction they charge a whole block when ip enters
+// * it. Returns the cost charged, or 0 when the rest of the budget can't
+// * cover the block and has to go to rm_execute_program_stepped.
+static inline uint64_t rm_charge_block(const Rm_Program *program, uint64_t ip, int *limit) {
+    const uint64_t cost = program->block_cost[ip < program->insts_size ? ip : program->insts_size];
+    if(*limit >= 0) {
+	if((uint64_t)*limit < cost) {
+	    return 0;
+	}
+	*limit -= (int)cost;
+    }
+    return cost;
+}
+
+// * One instruction at a time, for the tail of a budget that ends inside
+// * of a block
+static Err rm_execute_program_stepped(Rm *rm, int limit) {
+    while(limit != 0 && !rm->halt) {
+	Err err = rm_execute_inst(rm);
+	if(err != ERR_OK) {
+	    return err;
+	}
+	if(limit > 0) {
+	    --limit;
+	}
+    }
+    return ERR_OK;
+}
+
+// * Same as rm_execute_inst minus every stack and ip check, only valid for
+// * programs accepted by rm_verify_program
+static void rm_execute_inst_unchecked(Rm *rm) {
+    Inst inst = rm->program->insts[rm->ip];
+    int64_t *top = &rm->stack[rm->rm_stack_size];
+    bool cond;
+
+    switch(inst.inst_type) {
+    case INST_NOP:
+	rm->ip += 1;
+	break;
+
+    case INST_HALT:
+	rm->halt = true;
+	rm->ip += 1;
+	break;
+
+    case INST_PUSH:
+	rm->stack[rm->rm_stack_size++] = inst.inst_operand.as_i64;
+	rm->ip += 1;
+	break;
+
+    case INST_DUP:
+	rm->stack[rm->rm_stack_size] = top[-1 - (int64_t)inst.inst_operand.as_u64];
+	rm->rm_stack_size += 1;
+	rm->ip += 1;
+	break;
+
+    case INST_JMP:
+	rm->ip = inst.inst_operand.as_u64;
+	break;
+
+    case INST_JMPIF:
+	rm->rm_stack_size -= 1;
+	rm->ip = top[-1] ? inst.inst_operand.as_u64 : rm->ip + 1;
+	break;
+
+    case INST_PLUSI:	top[-2] = top[-2] + top[-1];	goto binop;
+    case INST_MINUSI:	top[-2] = top[-2] - top[-1];	goto binop;
+    case INST_MULI:	top[-2] = top[-2] * top[-1];	goto binop;
+    case INST_DIVI:	top[-2] = top[-2] / top[-1];	goto binop;
+    case INST_MODI:	top[-2] = top[-2] % top[-1];	goto binop;
+    case INST_GT:	top[-2] = top[-2] > top[-1];	goto binop;
+    case INST_GTE:	top[-2] = top[-2] >= top[-1];	goto binop;
+    case INST_LT:	top[-2] = top[-2] < top[-1];	goto binop;
+    case INST_LTE:	top[-2] = top[-2] <= top[-1];	goto binop;
+    binop:
+	rm->rm_stack_size -= 1;
+	rm->ip += 1;
+	break;
+
+    case INST_PUSH_PLUSI:
+	top[-1] += inst.inst_operand.as_i64;
+	rm->ip += 1;
+	break;
+
+    case INST_DUP_INC:
+	top[0] = top[-1] + inst.inst_operand.as_i64;
+	rm->rm_stack_size += 1;
+	rm->ip += 1;
+	break;
+
+    case INST_GT_JMPIF:		cond = top[-2] > top[-1];	goto cmp_jmpif;
+    case INST_GTE_JMPIF:	cond = top[-2] >= top[-1];	goto cmp_jmpif;
+    case INST_LT_JMPIF:		cond = top[-2] < top[-1];	goto cmp_jmpif;
+    case INST_LTE_JMPIF:	cond = top[-2] <= top[-1];	goto cmp_jmpif;
+    cmp_jmpif:
+	rm->rm_stack_size -= 2;
+	rm->ip = cond ? inst.inst_operand.as_u64 : rm->ip + 1;
+	break;
+
+    default:
+	assert(0 && "unreachable: rejected by rm_verify_program");
+    }
+}
+
+static inline Err rm_execute_inst_in(Rm *rm, const bool guarded);
+
+static Err rm_run_checked(Rm *rm, int limit) {
+    while(!rm->halt) {
+	uint64_t n = rm_charge_block(rm->program, rm->ip, &limit);
+	if(n == 0) {
+	    break;
+	}
+	for(; n > 0; --n) {
+	    Err err = rm_execute_inst_in(rm, RM_STACK_GUARDED);
+	    if(err != ERR_OK) {
+		return err;
+	    }
+	}
+    }
+    return rm_execute_program_stepped(rm, limit);
+}
+
+Err rm_execute_program(Rm *rm, int limit) {
+    if(rm_can_run_unchecked(rm)) {
+	while(!rm->halt) {
+	    uint64_t n = rm_charge_block(rm->program, rm->ip, &limit);
+	    if(n == 0) {
+		break;
+	    }
+	    for(; n > 0; --n) {
+		rm_execute_inst_unchecked(rm);
+	    }
+	}
+	return rm_execute_program_stepped(rm, limit);
+    }
+
+    return rm_run_guarded(rm, limit, rm_run_checked);
+}
+
+// * Error out of rm_run_tos with the registers spilled. Unchecked runs
+// * never get here, the verifier proved the condition false.
+#define RM_TOS_CHECK(cond, error)					\
+    if(checked && (cond)) {						\
+	err = (error);							\
+	goto spill;							\
+    }
+
+// * Pay for the block at ip, see rm_charge_block. Out of budget the rest
+// * goes to rm_execute_program_stepped once the registers are spilled.
+#define RM_TOS_CHARGE()							\
+    if(limit >= 0) {							\
+	const uint64_t cost = block_cost[checked && ip > insts_size ? insts_size : ip]; \
+	if((uint64_t)limit < cost) {					\
+	    stepped = true;						\
+	    goto spill;							\
+	}								\
+	limit -= (int)cost;						\
+    }
+
+#define RM_TOS_BINOP(op)						\
+    RM_TOS_CHECK(sp < 2, ERR_STACK_UNDERFLOW);				\
+    tos = stack[sp - 2] op tos;						\
+    sp -= 1;								\
+    ip += 1;								\
+    break
+
+#define RM_TOS_CMP_JMPIF(op)						\
+    RM_TOS_CHECK(sp < 2, ERR_STACK_UNDERFLOW);				\
+    cond = stack[sp - 2] op tos;					\
+    sp -= 2;								\
+    if(sp > 0) tos = stack[sp - 1];					\
+    ip = cond ? inst.inst_operand.as_u64 : ip + 1;			\
+    RM_TOS_CHARGE();							\
+    break
+
+// * Switch interpreter that keeps ip, the stack size and the top of the
+// * stack in locals for the whole run instead of going through the Rm on
+// * every instruction. While sp > 0 the top lives in `tos` and only
+// * stack[0..sp - 2] is in memory, everything goes back into the Rm on
+// * halt, on error and when the budget runs short of the next block. With `checked` false it
+// * drops the checks like rm_execute_inst_unchecked, both callers pass a
+// * constant so each gets its own copy without the dead checks.
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((always_inline))
+#endif
+static inline Err rm_run_tos(Rm *rm, int limit, const bool checked) {
+    const Inst *insts = rm->program->insts;
+    const uint64_t insts_size = rm->program->insts_size;
+    const uint64_t *block_cost = rm->program->block_cost;
+    int64_t *stack = rm->stack;
+    const uint64_t capacity = rm->stack_capacity;
+    uint64_t ip = rm->ip;
+    uint64_t sp = rm->rm_stack_size;
+    int64_t tos = sp > 0 ? stack[sp - 1] : 0;
+    bool cond;
+    bool stepped = false;
+    Err err = ERR_OK;
+
+    if(rm->halt) {
+	return ERR_OK;
+    }
+    RM_TOS_CHARGE();
+    for(;;) {
+	RM_TOS_CHECK(ip >= insts_size, ERR_ILLEGAL_INST);
+	const Inst inst = insts[ip];
+
+	switch(inst.inst_type) {
+	case INST_NOP:
+	    ip += 1;
+	    break;
+
+	case INST_HALT:
+	    rm->halt = true;
+	    ip += 1;
+	    goto spill;
+
+	case INST_PUSH:
+	    RM_TOS_CHECK(sp >= capacity, ERR_STACK_OVERFLOW);
+	    if(sp > 0) stack[sp - 1] = tos;
+	    tos = inst.inst_operand.as_i64;
+	    sp += 1;
+	    ip += 1;
+	    break;
+
+	case INST_DUP: {
+	    RM_TOS_CHECK(sp >= capacity, ERR_STACK_OVERFLOW);
+	    RM_TOS_CHECK(inst.inst_operand.as_u64 >= sp, ERR_STACK_UNDERFLOW);
+	    int64_t value = inst.inst_operand.as_u64 == 0 ? tos : stack[sp - 1 - inst.inst_operand.as_u64];
+	    stack[sp - 1] = tos;
+	    tos = value;
+	    sp += 1;
+	    ip += 1;
+	} break;
+
+	case INST_JMP:
+	    ip = inst.inst_operand.as_u64;
+	    RM_TOS_CHARGE();
+	    break;
+
+	case INST_JMPIF:
+	    RM_TOS_CHECK(sp < 1, ERR_STACK_UNDERFLOW);
+	    cond = tos != 0;
+	    sp -= 1;
+	    if(sp > 0) tos = stack[sp - 1];
+	    ip = cond ? inst.inst_operand.as_u64 : ip + 1;
+	    RM_TOS_CHARGE();
+	    break;
+
+	case INST_PLUSI:	RM_TOS_BINOP(+);
+	case INST_MINUSI:	RM_TOS_BINOP(-);
+	case INST_MULI:		RM_TOS_BINOP(*);
+	case INST_DIVI:		RM_TOS_BINOP(/);
+	case INST_MODI:		RM_TOS_BINOP(%);
+	case INST_GT:		RM_TOS_BINOP(>);
+	case INST_GTE:		RM_TOS_BINOP(>=);
+	case INST_LT:		RM_TOS_BINOP(<);
+	case INST_LTE:		RM_TOS_BINOP(<=);
+
+	case INST_PUSH_PLUSI:
+	    RM_TOS_CHECK(sp >= capacity, ERR_STACK_OVERFLOW);
+	    RM_TOS_CHECK(sp < 1, ERR_STACK_UNDERFLOW);
+	    tos += inst.inst_operand.as_i64;
+	    ip += 1;
+	    break;
+
+	case INST_DUP_INC:
+	    RM_TOS_CHECK(sp >= capacity, ERR_STACK_OVERFLOW);
+	    RM_TOS_CHECK(sp < 1, ERR_STACK_UNDERFLOW);
+	    RM_TOS_CHECK(sp + 1 >= capacity, ERR_STACK_OVERFLOW);
+	    stack[sp - 1] = tos;
+	    tos += inst.inst_operand.as_i64;
+	    sp += 1;
+	    ip += 1;
+	    break;
+
+	case INST_GT_JMPIF:	RM_TOS_CMP_JMPIF(>);
+	case INST_GTE_JMPIF:	RM_TOS_CMP_JMPIF(>=);
+	case INST_LT_JMPIF:	RM_TOS_CMP_JMPIF(<);
+	case INST_LTE_JMPIF:	RM_TOS_CMP_JMPIF(<=);
+
+	default:
+	    err = ERR_ILLEGAL_INST;
+	    goto spill;
+	}
+    }
+
+spill:
+    if(sp > 0) stack[sp - 1] = tos;
+    rm->ip = ip;
+    rm->rm_stack_size = sp;
+    if(stepped) {
+	return rm_execute_program_stepped(rm, limit);
+    }
+    return err;
+}
+
+#undef RM_TOS_CMP_JMPIF
+#undef RM_TOS_BINOP
+#undef RM_TOS_CHARGE
+#undef RM_TOS_CHECK
+
+static Err rm_run_tos_checked(Rm *rm, int limit) {
+    return rm_run_tos(rm, limit, true);
+}
+
+static Err rm_run_tos_unchecked(Rm *rm, int limit) {
+    return rm_run_tos(rm, limit, false);
+}
+
+Err rm_execute_program_tos(Rm *rm, int limit) {
+    if(rm_can_run_unchecked(rm)) {
+	return rm_run_tos_unchecked(rm, limit);
+    }
+    return rm_run_tos_checked(rm, limit);
+}
+
+// * With `guarded` the overflow checks of push and dup are left to the
+// * guard page after the stack, only valid inside of rm_run_guarded. Their
+// * store goes first so a fault on it leaves the VM untouched.
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((always_inline))
+#endif
+static inline Err rm_execute_inst_in(Rm *rm, const bool guarded) {
+    if(rm->ip >= rm->program->insts_size) {
 	return ERR_ILLEGAL_INST;
     }
     
-    Inst inst = rm->program[rm->ip];
+    Inst inst = rm->program->insts[rm->ip];
 
     // * Only for debugging
     // printf("    %s", inst_as_cstr(inst.inst_type));
@@ -579,24 +2469,26 @@ Err rm_execute_inst(Rm *rm) {
     } break;	
 
     case INST_PUSH: {
-	if(rm->rm_stack_size >= RM_STACK_CAPACITY) {
+	if(!guarded && rm->rm_stack_size >= rm->stack_capacity) {
 	    return ERR_STACK_OVERFLOW;
 	}
-	rm->stack[rm->rm_stack_size++] = inst.inst_operand.as_i64;
+	rm->stack[rm->rm_stack_size] = inst.inst_operand.as_i64;
+	rm->rm_stack_size += 1;
 	rm->ip += 1;
     } break;
 
     case INST_DUP: {
-	if(rm->rm_stack_size >= RM_STACK_CAPACITY) {
+	if(!guarded && rm->rm_stack_size >= rm->stack_capacity) {
 	    return ERR_STACK_OVERFLOW;
 	}
 
 	uint64_t pos = inst.inst_operand.as_u64;
 	if(pos >= rm->rm_stack_size) {
-	    return ERR_STACK_UNDERFLOW;
+	    return rm->rm_stack_size >= rm->stack_capacity ? ERR_STACK_OVERFLOW : ERR_STACK_UNDERFLOW;
 	}
 	const uint64_t idx = rm->rm_stack_size - 1 - inst.inst_operand.as_u64;
-	rm->stack[rm->rm_stack_size++] = rm->stack[idx];
+	rm->stack[rm->rm_stack_size] = rm->stack[idx];
+	rm->rm_stack_size += 1;
 	rm->ip += 1;
     } break;
 
@@ -719,28 +2611,906 @@ Err rm_execute_inst(Rm *rm) {
 	rm->ip += 1;
 	rm->rm_stack_size -= 1;	
     } break;
+
+    // * Superinstructions report the first error the original sequence would
+    case INST_PUSH_PLUSI: {
+	if(rm->rm_stack_size >= rm->stack_capacity) {
+	    return ERR_STACK_OVERFLOW;
+	}
+	if(rm->rm_stack_size < 1) {
+	    return ERR_STACK_UNDERFLOW;
+	}
+	rm->stack[rm->rm_stack_size - 1] += inst.inst_operand.as_i64;
+	rm->ip += 1;
+    } break;
+
+    case INST_DUP_INC: {
+	if(rm->rm_stack_size >= rm->stack_capacity) {
+	    return ERR_STACK_OVERFLOW;
+	}
+	if(rm->rm_stack_size < 1) {
+	    return ERR_STACK_UNDERFLOW;
+	}
+	if(rm->rm_stack_size + 1 >= rm->stack_capacity) {
+	    return ERR_STACK_OVERFLOW;
+	}
+	rm->stack[rm->rm_stack_size] = rm->stack[rm->rm_stack_size - 1] + inst.inst_operand.as_i64;
+	rm->rm_stack_size += 1;
+	rm->ip += 1;
+    } break;
+
+    case INST_GT_JMPIF:
+    case INST_GTE_JMPIF:
+    case INST_LT_JMPIF:
+    case INST_LTE_JMPIF: {
+	if(rm->rm_stack_size < 2) {
+	    return ERR_STACK_UNDERFLOW;
+	}
+	int64_t first_op = rm->stack[rm->rm_stack_size - 2];
+	int64_t second_op = rm->stack[rm->rm_stack_size - 1];
+	bool cond = inst.inst_type == INST_GT_JMPIF  ? first_op > second_op
+		  : inst.inst_type == INST_GTE_JMPIF ? first_op >= second_op
+		  : inst.inst_type == INST_LT_JMPIF  ? first_op < second_op
+		  : first_op <= second_op;
+	rm->rm_stack_size -= 2;
+	rm->ip = cond ? inst.inst_operand.as_u64 : rm->ip + 1;
+    } break;
     
     default:
-    	printf("Unknown Instruction\n");
+	return ERR_ILLEGAL_INST;
+    }
+    return ERR_OK;
+}
+
+Err rm_execute_inst(Rm *rm) {
+    return rm_execute_inst_in(rm, false);
+}
+
+#ifdef RM_THREADED_DISPATCH
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+// * Direct-threaded interpreter. With `prepare` set it only fills
+// * prepare->threaded_code with the handler of every instruction, otherwise
+// * each handler of rm->program jumps straight into the handler of the
+// * next instruction.
+static Err rm_run_threaded(Rm *rm, Rm_Program *prepare, int limit) {
+    static void *const handlers[] = {
+	[INST_NOP]	= &&do_nop,
+	[INST_HALT]	= &&do_halt,
+	[INST_PUSH]	= &&do_push,
+	[INST_DUP]	= &&do_dup,
+	[INST_JMP]	= &&do_jmp,
+	[INST_JMPIF]	= &&do_jmpif,
+	[INST_PLUSI]	= &&do_plusi,
+	[INST_MINUSI]	= &&do_minusi,
+	[INST_MULI]	= &&do_muli,
+	[INST_DIVI]	= &&do_divi,
+	[INST_MODI]	= &&do_modi,
+	[INST_GT]	= &&do_gt,
+	[INST_GTE]	= &&do_gte,
+	[INST_LT]	= &&do_lt,
+	[INST_LTE]	= &&do_lte,
+	[INST_PUSH_PLUSI]	= &&do_push_plusi,
+	[INST_DUP_INC]		= &&do_dup_inc,
+	[INST_GT_JMPIF]		= &&do_gt_jmpif,
+	[INST_GTE_JMPIF]	= &&do_gte_jmpif,
+	[INST_LT_JMPIF]		= &&do_lt_jmpif,
+	[INST_LTE_JMPIF]	= &&do_lte_jmpif,
+    };
 
+    // * Handlers without stack and ip checks for verified programs
+    static void *const unchecked_handlers[] = {
+	[INST_NOP]	= &&do_nop,
+	[INST_HALT]	= &&do_halt,
+	[INST_PUSH]	= &&do_push_unchecked,
+	[INST_DUP]	= &&do_dup_unchecked,
+	[INST_JMP]	= &&do_jmp_unchecked,
+	[INST_JMPIF]	= &&do_jmpif_unchecked,
+	[INST_PLUSI]	= &&do_plusi_unchecked,
+	[INST_MINUSI]	= &&do_minusi_unchecked,
+	[INST_MULI]	= &&do_muli_unchecked,
+	[INST_DIVI]	= &&do_divi_unchecked,
+	[INST_MODI]	= &&do_modi_unchecked,
+	[INST_GT]	= &&do_gt_unchecked,
+	[INST_GTE]	= &&do_gte_unchecked,
+	[INST_LT]	= &&do_lt_unchecked,
+	[INST_LTE]	= &&do_lte_unchecked,
+	[INST_PUSH_PLUSI]	= &&do_push_plusi_unchecked,
+	[INST_DUP_INC]		= &&do_dup_inc_unchecked,
+	[INST_GT_JMPIF]		= &&do_gt_jmpif_unchecked,
+	[INST_GTE_JMPIF]	= &&do_gte_jmpif_unchecked,
+	[INST_LT_JMPIF]		= &&do_lt_jmpif_unchecked,
+	[INST_LTE_JMPIF]	= &&do_lte_jmpif_unchecked,
+    };
+    _Static_assert(ARRAY_SIZE(handlers) == ARRAY_SIZE(unchecked_handlers),
+		   "every opcode needs an unchecked handler");
+
+    if(prepare != NULL) {
+	void *const *table = prepare->verified ? unchecked_handlers : handlers;
+	for(size_t i = 0; i < prepare->insts_size; ++i) {
+	    size_t type = (size_t)prepare->insts[i].inst_type;
+	    prepare->threaded_code[i] = (type < ARRAY_SIZE(handlers) && table[type] != NULL)
+		? table[type]
+		: &&do_illegal;
+	}
+	prepare->threaded_code[prepare->insts_size] = &&do_illegal;
+	prepare->threaded_ready = true;
+	prepare->threaded_unchecked = prepare->verified;
+	return ERR_OK;
     }
+
+    Err err = ERR_OK;
+    int64_t *stack = rm->stack;
+    const Inst *program = rm->program->insts;
+    void *const *code = rm->program->threaded_code;
+    const uint64_t size = rm->program->insts_size;
+
+    // * Inside of a block the budget is already paid for, see
+    // * rm_charge_block
+#define RM_THREADED_NEXT						\
+    do {								\
+	goto *code[rm->ip];						\
+    } while(0)
+
+    // * Every jump, taken or not, enters a new block and charges it.
+    // * After a jump ip may point anywhere, clamp it onto the trailing
+    // * illegal slot.
+#define RM_THREADED_JUMP						\
+    do {								\
+	if(rm_charge_block(rm->program, rm->ip, &limit) == 0) {		\
+	    return rm_execute_program_stepped(rm, limit);		\
+	}								\
+	goto *code[rm->ip < size ? rm->ip : size];			\
+    } while(0)
+
+#define RM_THREADED_BINOP(op)						\
+    do {								\
+	if(rm->rm_stack_size < 2) {					\
+	    err = ERR_STACK_UNDERFLOW;					\
+	    goto fail;							\
+	}								\
+	int64_t first_op = stack[rm->rm_stack_size - 2];		\
+	int64_t second_op = stack[rm->rm_stack_size - 1];		\
+	stack[rm->rm_stack_size - 2] = first_op op second_op;		\
+	rm->rm_stack_size -= 1;						\
+	rm->ip += 1;							\
+	RM_THREADED_NEXT;						\
+    } while(0)
+
+#define RM_THREADED_BINOP_UNCHECKED(op)					\
+    do {								\
+	stack[rm->rm_stack_size - 2] =					\
+	    stack[rm->rm_stack_size - 2] op stack[rm->rm_stack_size - 1]; \
+	rm->rm_stack_size -= 1;						\
+	rm->ip += 1;							\
+	RM_THREADED_NEXT;						\
+    } while(0)
+
+#define RM_THREADED_CMP_JMPIF(op)					\
+    do {								\
+	if(rm->rm_stack_size < 2) {					\
+	    err = ERR_STACK_UNDERFLOW;					\
+	    goto fail;							\
+	}								\
+	rm->rm_stack_size -= 2;						\
+	if(stack[rm->rm_stack_size] op stack[rm->rm_stack_size + 1]) {	\
+	    rm->ip = program[rm->ip].inst_operand.as_u64;		\
+	    RM_THREADED_JUMP;						\
+	}								\
+	rm->ip += 1;							\
+	RM_THREADED_JUMP;						\
+    } while(0)
+
+#define RM_THREADED_CMP_JMPIF_UNCHECKED(op)				\
+    do {								\
+	rm->rm_stack_size -= 2;						\
+	rm->ip = stack[rm->rm_stack_size] op stack[rm->rm_stack_size + 1] \
+	    ? program[rm->ip].inst_operand.as_u64 : rm->ip + 1;		\
+	RM_THREADED_JUMP;						\
+    } while(0)
+
+    if(rm->halt) return ERR_OK;
+    RM_THREADED_JUMP;
+
+do_nop:
+    rm->ip += 1;
+    RM_THREADED_NEXT;
+
+do_halt:
+    rm->halt = true;
+    rm->ip += 1;
     return ERR_OK;
+
+    // * Overflow of push and dup is caught by the guard page, see
+    // * rm_execute_inst_in
+do_push:
+    if(!RM_STACK_GUARDED && rm->rm_stack_size >= rm->stack_capacity) {
+	err = ERR_STACK_OVERFLOW;
+	goto fail;
+    }
+    stack[rm->rm_stack_size] = program[rm->ip].inst_operand.as_i64;
+    rm->rm_stack_size += 1;
+    rm->ip += 1;
+    RM_THREADED_NEXT;
+
+do_dup: {
+	if(!RM_STACK_GUARDED && rm->rm_stack_size >= rm->stack_capacity) {
+	    err = ERR_STACK_OVERFLOW;
+	    goto fail;
+	}
+	uint64_t pos = program[rm->ip].inst_operand.as_u64;
+	if(pos >= rm->rm_stack_size) {
+	    err = rm->rm_stack_size >= rm->stack_capacity ? ERR_STACK_OVERFLOW : ERR_STACK_UNDERFLOW;
+	    goto fail;
+	}
+	stack[rm->rm_stack_size] = stack[rm->rm_stack_size - 1 - pos];
+	rm->rm_stack_size += 1;
+	rm->ip += 1;
+	RM_THREADED_NEXT;
+    }
+
+do_jmp:
+    rm->ip = program[rm->ip].inst_operand.as_u64;
+    RM_THREADED_JUMP;
+
+do_jmpif:
+    if(rm->rm_stack_size < 1) {
+	err = ERR_STACK_UNDERFLOW;
+	goto fail;
+    }
+    rm->rm_stack_size -= 1;
+    if(stack[rm->rm_stack_size]) {
+	rm->ip = program[rm->ip].inst_operand.as_u64;
+	RM_THREADED_JUMP;
+    }
+    rm->ip += 1;
+    RM_THREADED_JUMP;
+
+do_plusi:	RM_THREADED_BINOP(+);
+do_minusi:	RM_THREADED_BINOP(-);
+do_muli:	RM_THREADED_BINOP(*);
+do_divi:	RM_THREADED_BINOP(/);
+do_modi:	RM_THREADED_BINOP(%);
+do_gt:		RM_THREADED_BINOP(>);
+do_gte:		RM_THREADED_BINOP(>=);
+do_lt:		RM_THREADED_BINOP(<);
+do_lte:		RM_THREADED_BINOP(<=);
+
+do_push_plusi:
+    if(rm->rm_stack_size >= rm->stack_capacity) {
+	err = ERR_STACK_OVERFLOW;
+	goto fail;
+    }
+    if(rm->rm_stack_size < 1) {
+	err = ERR_STACK_UNDERFLOW;
+	goto fail;
+    }
+    stack[rm->rm_stack_size - 1] += program[rm->ip].inst_operand.as_i64;
+    rm->ip += 1;
+    RM_THREADED_NEXT;
+
+do_dup_inc:
+    if(rm->rm_stack_size >= rm->stack_capacity) {
+	err = ERR_STACK_OVERFLOW;
+	goto fail;
+    }
+    if(rm->rm_stack_size < 1) {
+	err = ERR_STACK_UNDERFLOW;
+	goto fail;
+    }
+    if(rm->rm_stack_size + 1 >= rm->stack_capacity) {
+	err = ERR_STACK_OVERFLOW;
+	goto fail;
+    }
+    stack[rm->rm_stack_size] = stack[rm->rm_stack_size - 1] + program[rm->ip].inst_operand.as_i64;
+    rm->rm_stack_size += 1;
+    rm->ip += 1;
+    RM_THREADED_NEXT;
+
+do_gt_jmpif:	RM_THREADED_CMP_JMPIF(>);
+do_gte_jmpif:	RM_THREADED_CMP_JMPIF(>=);
+do_lt_jmpif:	RM_THREADED_CMP_JMPIF(<);
+do_lte_jmpif:	RM_THREADED_CMP_JMPIF(<=);
+
+do_push_unchecked:
+    stack[rm->rm_stack_size++] = program[rm->ip].inst_operand.as_i64;
+    rm->ip += 1;
+    RM_THREADED_NEXT;
+
+do_dup_unchecked:
+    stack[rm->rm_stack_size] =
+	stack[rm->rm_stack_size - 1 - program[rm->ip].inst_operand.as_u64];
+    rm->rm_stack_size += 1;
+    rm->ip += 1;
+    RM_THREADED_NEXT;
+
+do_jmp_unchecked:
+    rm->ip = program[rm->ip].inst_operand.as_u64;
+    RM_THREADED_JUMP;
+
+do_jmpif_unchecked:
+    rm->rm_stack_size -= 1;
+    rm->ip = stack[rm->rm_stack_size] ? program[rm->ip].inst_operand.as_u64 : rm->ip + 1;
+    RM_THREADED_JUMP;
+
+do_plusi_unchecked:	RM_THREADED_BINOP_UNCHECKED(+);
+do_minusi_unchecked:	RM_THREADED_BINOP_UNCHECKED(-);
+do_muli_unchecked:	RM_THREADED_BINOP_UNCHECKED(*);
+do_divi_unchecked:	RM_THREADED_BINOP_UNCHECKED(/);
+do_modi_unchecked:	RM_THREADED_BINOP_UNCHECKED(%);
+do_gt_unchecked:	RM_THREADED_BINOP_UNCHECKED(>);
+do_gte_unchecked:	RM_THREADED_BINOP_UNCHECKED(>=);
+do_lt_unchecked:	RM_THREADED_BINOP_UNCHECKED(<);
+do_lte_unchecked:	RM_THREADED_BINOP_UNCHECKED(<=);
+
+do_push_plusi_unchecked:
+    stack[rm->rm_stack_size - 1] += program[rm->ip].inst_operand.as_i64;
+    rm->ip += 1;
+    RM_THREADED_NEXT;
+
+do_dup_inc_unchecked:
+    stack[rm->rm_stack_size] = stack[rm->rm_stack_size - 1] + program[rm->ip].inst_operand.as_i64;
+    rm->rm_stack_size += 1;
+    rm->ip += 1;
+    RM_THREADED_NEXT;
+
+do_gt_jmpif_unchecked:	RM_THREADED_CMP_JMPIF_UNCHECKED(>);
+do_gte_jmpif_unchecked:	RM_THREADED_CMP_JMPIF_UNCHECKED(>=);
+do_lt_jmpif_unchecked:	RM_THREADED_CMP_JMPIF_UNCHECKED(<);
+do_lte_jmpif_unchecked:	RM_THREADED_CMP_JMPIF_UNCHECKED(<=);
+
+do_illegal:
+    err = ERR_ILLEGAL_INST;
+
+fail:
+    return err;
+
+#undef RM_THREADED_NEXT
+#undef RM_THREADED_JUMP
+#undef RM_THREADED_BINOP
+#undef RM_THREADED_BINOP_UNCHECKED
+#undef RM_THREADED_CMP_JMPIF
+#undef RM_THREADED_CMP_JMPIF_UNCHECKED
 }
 
-// * Creates a bytecode executables
-void rasm_save_to_file(Rm *rm, String_View filepath) {
-    const char *filepath_cstr = arena_sv_to_cstr(rm, filepath);
+#pragma GCC diagnostic pop
 
-    FILE *file_fd = fopen(filepath_cstr, "wb");
-    if(file_fd == NULL) {
-	fprintf(stderr, "ERROR: Could Not write to File %s\n", strerror(errno));
+static Err rm_run_threaded_program(Rm *rm, int limit) {
+    return rm_run_threaded(rm, NULL, limit);
+}
+#endif // RM_THREADED_DISPATCH
+
+// * Build the handler table once, right after the program is loaded
+void rm_prepare_threaded(Rm_Program *program) {
+#ifdef RM_THREADED_DISPATCH
+    rm_run_threaded(NULL, program, 0);
+#else
+    program->threaded_ready = true;
+#endif
+}
+
+Err rm_execute_program_threaded(Rm *rm, int limit) {
+#ifdef RM_THREADED_DISPATCH
+    // * The program is shared, it can't be prepared lazily from here
+    if(!rm->program->threaded_ready
+       || (rm->program->threaded_unchecked && !rm_can_run_unchecked(rm))) {
+	return rm_execute_program(rm, limit);
+    }
+    return rm_run_guarded(rm, limit, rm_run_threaded_program);
+#else
+    return rm_execute_program(rm, limit);
+#endif
+}
+
+#ifdef RM_JIT_SUPPORTED
+
+// * x86-64 template JIT. Register assignment inside the generated code:
+// *     r15 = Rm*, rbx = rm->stack, r13 = rm->rm_stack_size,
+// *     r14 = rm->stack_capacity, r12 = remaining instruction budget
+// * Every exit path loads the ip to store into rsi and the Err into eax and
+// * jumps to the shared epilogue, which spills r13 and rsi back into Rm and
+// * r12 back into the budget. The budget is charged a block at a time on
+// * every jump, taken or not, see rm_charge_block.
+
+#define RM_JIT_MAX_INST_SIZE 256
+
+#define RM_JIT_CC_B	0x2
+#define RM_JIT_CC_AE	0x3
+#define RM_JIT_CC_E	0x4
+#define RM_JIT_CC_NE	0x5
+#define RM_JIT_CC_L	0xC
+#define RM_JIT_CC_GE	0xD
+#define RM_JIT_CC_LE	0xE
+#define RM_JIT_CC_G	0xF
+
+typedef Err (*Rm_Jit_Fn)(Rm *rm, uint64_t *budget, const uint8_t *entry);
+
+typedef struct {
+    uint8_t *code;
+    size_t size;
+    size_t capacity;
+    size_t epilogue;
+
+    // * rel32 fields waiting for the native address of an instruction,
+    // * at most one per instruction
+    size_t *patch_at;
+    Inst_Addr *patch_target;
+    size_t patches_size;
+    size_t patches_capacity;
+} Rm_Jit;
+
+static void rm_jit_u8(Rm_Jit *jit, uint8_t byte) {
+    assert(jit->size < jit->capacity);
+    jit->code[jit->size++] = byte;
+}
+
+static void rm_jit_bytes(Rm_Jit *jit, const uint8_t *bytes, size_t n) {
+    for(size_t i = 0; i < n; ++i) {
+	rm_jit_u8(jit, bytes[i]);
+    }
+}
+
+static void rm_jit_u32(Rm_Jit *jit, uint32_t value) {
+    for(size_t i = 0; i < 4; ++i) {
+	rm_jit_u8(jit, (uint8_t)(value >> (8 * i)));
+    }
+}
+
+static void rm_jit_u64(Rm_Jit *jit, uint64_t value) {
+    for(size_t i = 0; i < 8; ++i) {
+	rm_jit_u8(jit, (uint8_t)(value >> (8 * i)));
+    }
+}
+
+static void rm_jit_rel32_to(Rm_Jit *jit, size_t target) {
+    rm_jit_u32(jit, (uint32_t)((int64_t)target - (int64_t)(jit->size + 4)));
+}
+
+#define RM_JIT_EMIT(jit, ...)						\
+    do {								\
+	const uint8_t bytes[] = { __VA_ARGS__ };			\
+	rm_jit_bytes((jit), bytes, sizeof(bytes));			\
+    } while(0)
+
+// * mov rsi, ip; mov eax, err; jmp epilogue
+static void rm_jit_exit(Rm_Jit *jit, uint64_t ip, Err err) {
+    if(ip <= UINT32_MAX) {
+	rm_jit_u8(jit, 0xBE);
+	rm_jit_u32(jit, (uint32_t)ip);
+    } else {
+	RM_JIT_EMIT(jit, 0x48, 0xBE);
+	rm_jit_u64(jit, ip);
+    }
+    rm_jit_u8(jit, 0xB8);
+    rm_jit_u32(jit, (uint32_t)err);
+    rm_jit_u8(jit, 0xE9);
+    rm_jit_rel32_to(jit, jit->epilogue);
+}
+
+// * j<skip_cc> over an exit stub, so the VM only exits when skip_cc is false
+static void rm_jit_exit_unless(Rm_Jit *jit, uint8_t skip_cc, uint64_t ip, Err err) {
+    rm_jit_u8(jit, (uint8_t)(0x70 | skip_cc));
+    size_t at = jit->size;
+    rm_jit_u8(jit, 0);
+    rm_jit_exit(jit, ip, err);
+    jit->code[at] = (uint8_t)(jit->size - (at + 1));
+}
+
+// * cmp r13, n
+static void rm_jit_cmp_stack_size(Rm_Jit *jit, uint32_t n) {
+    RM_JIT_EMIT(jit, 0x49, 0x81, 0xFD);
+    rm_jit_u32(jit, n);
+}
+
+static void rm_jit_require_stack(Rm_Jit *jit, uint32_t n, Inst_Addr ip) {
+    rm_jit_cmp_stack_size(jit, n);
+    rm_jit_exit_unless(jit, RM_JIT_CC_AE, ip, ERR_STACK_UNDERFLOW);
+}
+
+// * lea rax, [r13 + n - 1]; cmp rax, r14
+static void rm_jit_require_free(Rm_Jit *jit, uint8_t n, Inst_Addr ip) {
+    RM_JIT_EMIT(jit, 0x49, 0x8D, 0x45, (uint8_t)(n - 1));
+    RM_JIT_EMIT(jit, 0x4C, 0x39, 0xF0);
+    rm_jit_exit_unless(jit, RM_JIT_CC_B, ip, ERR_STACK_OVERFLOW);
+}
+
+// * Charge the block at `target` to r12, or leave with ERR_OK and ip at
+// * `target` when the budget can't cover it:
+// *     cmp r12, cost; jae over the exit; sub r12, cost
+static void rm_jit_charge(Rm_Jit *jit, const Rm_Program *program, uint64_t target) {
+    uint64_t cost = program->block_cost[target < program->insts_size ? target : program->insts_size];
+    RM_JIT_EMIT(jit, 0x49, 0x81, 0xFC);
+    rm_jit_u32(jit, (uint32_t)cost);
+    rm_jit_exit_unless(jit, RM_JIT_CC_AE, target, ERR_OK);
+    RM_JIT_EMIT(jit, 0x49, 0x81, 0xEC);
+    rm_jit_u32(jit, (uint32_t)cost);
+}
+
+// * A jump outside of the program: the interpreter would spend one more
+// * unit of budget and then fail on the ip check
+static void rm_jit_jump_outside(Rm_Jit *jit, const Rm_Program *program, uint64_t target) {
+    rm_jit_charge(jit, program, target);
+    rm_jit_exit(jit, target, ERR_ILLEGAL_INST);
+}
+
+// * jmp/j<cc> rel32 to instruction `target`, patched once all are emitted
+static void rm_jit_jump_to(Rm_Jit *jit, const uint8_t *opcode, size_t opcode_size, Inst_Addr target) {
+    assert(jit->patches_size < jit->patches_capacity);
+    rm_jit_bytes(jit, opcode, opcode_size);
+    jit->patch_at[jit->patches_size] = jit->size;
+    jit->patch_target[jit->patches_size] = target;
+    jit->patches_size += 1;
+    rm_jit_u32(jit, 0);
+}
+
+// * mov rax, [rbx + r13*8 - 16]; <op> rax, [rbx + r13*8 - 8]
+static void rm_jit_load_operands(Rm_Jit *jit, uint8_t op) {
+    RM_JIT_EMIT(jit, 0x4A, 0x8B, 0x44, 0xEB, 0xF0);
+    RM_JIT_EMIT(jit, 0x4A, op, 0x44, 0xEB, 0xF8);
+}
+
+// * mov [rbx + r13*8 - 16], rax; dec r13
+static void rm_jit_store_binop(Rm_Jit *jit) {
+    RM_JIT_EMIT(jit, 0x4A, 0x89, 0x44, 0xEB, 0xF0);
+    RM_JIT_EMIT(jit, 0x49, 0xFF, 0xCD);
+}
+
+static void rm_jit_compare(Rm_Jit *jit, uint8_t setcc) {
+    rm_jit_load_operands(jit, 0x3B);
+    RM_JIT_EMIT(jit, 0x0F, setcc, 0xC0);	// setcc al
+    RM_JIT_EMIT(jit, 0x0F, 0xB6, 0xC0);	// movzx eax, al
+    rm_jit_store_binop(jit);
+}
+
+static void rm_jit_divide(Rm_Jit *jit, bool remainder) {
+    RM_JIT_EMIT(jit, 0x4A, 0x8B, 0x44, 0xEB, 0xF0);	// mov rax, [rbx + r13*8 - 16]
+    RM_JIT_EMIT(jit, 0x4A, 0x8B, 0x4C, 0xEB, 0xF8);	// mov rcx, [rbx + r13*8 - 8]
+    RM_JIT_EMIT(jit, 0x48, 0x99);			// cqo
+    RM_JIT_EMIT(jit, 0x48, 0xF7, 0xF9);		// idiv rcx
+    if(remainder) {
+	RM_JIT_EMIT(jit, 0x4A, 0x89, 0x54, 0xEB, 0xF0);	// mov [rbx + r13*8 - 16], rdx
+	RM_JIT_EMIT(jit, 0x49, 0xFF, 0xCD);
+    } else {
+	rm_jit_store_binop(jit);
+    }
+}
+
+// * Conditional jump on the flags from instruction `ip` to `target`. Both
+// * ways enter a new block, so each one charges its own.
+static void rm_jit_branch(Rm_Jit *jit, const Rm_Program *program, uint8_t inverse_cc, Inst_Addr ip, uint64_t target) {
+    rm_jit_u8(jit, (uint8_t)(0x70 | inverse_cc));
+    size_t at = jit->size;
+    rm_jit_u8(jit, 0);
+    if(target < program->insts_size) {
+	const uint8_t jmp[] = { 0xE9 };
+	rm_jit_charge(jit, program, target);
+	rm_jit_jump_to(jit, jmp, sizeof(jmp), target);
+    } else {
+	rm_jit_jump_outside(jit, program, target);
+    }
+    jit->code[at] = (uint8_t)(jit->size - (at + 1));
+    rm_jit_charge(jit, program, ip + 1);
+}
+
+static void rm_jit_inst(Rm_Jit *jit, const Rm_Program *program, Inst_Addr ip, bool checked) {
+    Inst inst = program->insts[ip];
+    uint64_t operand = inst.inst_operand.as_u64;
+
+    switch(inst.inst_type) {
+    case INST_NOP:
+	break;
+
+    case INST_HALT:
+	RM_JIT_EMIT(jit, 0x41, 0xC6, 0x87);	// mov byte [r15 + halt], 1
+	rm_jit_u32(jit, (uint32_t)offsetof(Rm, halt));
+	rm_jit_u8(jit, 1);
+	rm_jit_exit(jit, ip + 1, ERR_OK);
+	return;
+
+    case INST_PUSH:
+	if(checked) rm_jit_require_free(jit, 1, ip);
+	RM_JIT_EMIT(jit, 0x48, 0xB8);		// mov rax, imm64
+	rm_jit_u64(jit, operand);
+	RM_JIT_EMIT(jit, 0x4A, 0x89, 0x04, 0xEB);	// mov [rbx + r13*8], rax
+	RM_JIT_EMIT(jit, 0x49, 0xFF, 0xC5);	// inc r13
+	break;
+
+    case INST_DUP:
+	if(checked) {
+	    rm_jit_require_free(jit, 1, ip);
+	    if(operand >= RM_STACK_MAX_CAPACITY) {
+		rm_jit_exit(jit, ip, ERR_STACK_UNDERFLOW);
+		return;
+	    }
+	    rm_jit_require_stack(jit, (uint32_t)operand + 1, ip);
+	}
+	RM_JIT_EMIT(jit, 0x4A, 0x8B, 0x84, 0xEB);	// mov rax, [rbx + r13*8 - 8*(operand + 1)]
+	rm_jit_u32(jit, (uint32_t)(-8 * ((int64_t)operand + 1)));
+	RM_JIT_EMIT(jit, 0x4A, 0x89, 0x04, 0xEB);
+	RM_JIT_EMIT(jit, 0x49, 0xFF, 0xC5);
+	break;
+
+    case INST_JMP:
+	if(operand < program->insts_size) {
+	    const uint8_t jmp[] = { 0xE9 };
+	    rm_jit_charge(jit, program, operand);
+	    rm_jit_jump_to(jit, jmp, sizeof(jmp), operand);
+	} else {
+	    rm_jit_jump_outside(jit, program, operand);
+	}
+	return;
+
+    case INST_JMPIF:
+	if(checked) rm_jit_require_stack(jit, 1, ip);
+	RM_JIT_EMIT(jit, 0x49, 0xFF, 0xCD);	// dec r13
+	RM_JIT_EMIT(jit, 0x4A, 0x8B, 0x04, 0xEB);	// mov rax, [rbx + r13*8]
+	RM_JIT_EMIT(jit, 0x48, 0x85, 0xC0);	// test rax, rax
+	rm_jit_branch(jit, program, RM_JIT_CC_E, ip, operand);
+	break;
+
+    case INST_PLUSI:
+	if(checked) rm_jit_require_stack(jit, 2, ip);
+	rm_jit_load_operands(jit, 0x03);	// add
+	rm_jit_store_binop(jit);
+	break;
+
+    case INST_MINUSI:
+	if(checked) rm_jit_require_stack(jit, 2, ip);
+	rm_jit_load_operands(jit, 0x2B);	// sub
+	rm_jit_store_binop(jit);
+	break;
+
+    case INST_MULI:
+	if(checked) rm_jit_require_stack(jit, 2, ip);
+	RM_JIT_EMIT(jit, 0x4A, 0x8B, 0x44, 0xEB, 0xF0);
+	RM_JIT_EMIT(jit, 0x4A, 0x0F, 0xAF, 0x44, 0xEB, 0xF8);	// imul rax, [...]
+	rm_jit_store_binop(jit);
+	break;
+
+    case INST_DIVI:
+	if(checked) rm_jit_require_stack(jit, 2, ip);
+	rm_jit_divide(jit, false);
+	break;
+
+    case INST_MODI:
+	if(checked) rm_jit_require_stack(jit, 2, ip);
+	rm_jit_divide(jit, true);
+	break;
+
+    case INST_GT:
+	if(checked) rm_jit_require_stack(jit, 2, ip);
+	rm_jit_compare(jit, 0x9F);
+	break;
+
+    case INST_GTE:
+	if(checked) rm_jit_require_stack(jit, 2, ip);
+	rm_jit_compare(jit, 0x9D);
+	break;
+
+    case INST_LT:
+	if(checked) rm_jit_require_stack(jit, 2, ip);
+	rm_jit_compare(jit, 0x9C);
+	break;
+
+    case INST_LTE:
+	if(checked) rm_jit_require_stack(jit, 2, ip);
+	rm_jit_compare(jit, 0x9E);
+	break;
+
+    case INST_PUSH_PLUSI:
+	if(checked) {
+	    rm_jit_require_free(jit, 1, ip);
+	    rm_jit_require_stack(jit, 1, ip);
+	}
+	RM_JIT_EMIT(jit, 0x48, 0xB8);
+	rm_jit_u64(jit, operand);
+	RM_JIT_EMIT(jit, 0x4A, 0x01, 0x44, 0xEB, 0xF8);	// add [rbx + r13*8 - 8], rax
+	break;
+
+    case INST_DUP_INC:
+	if(checked) {
+	    rm_jit_require_free(jit, 1, ip);
+	    rm_jit_require_stack(jit, 1, ip);
+	    rm_jit_require_free(jit, 2, ip);
+	}
+	RM_JIT_EMIT(jit, 0x48, 0xB8);
+	rm_jit_u64(jit, operand);
+	RM_JIT_EMIT(jit, 0x4A, 0x03, 0x44, 0xEB, 0xF8);	// add rax, [rbx + r13*8 - 8]
+	RM_JIT_EMIT(jit, 0x4A, 0x89, 0x04, 0xEB);
+	RM_JIT_EMIT(jit, 0x49, 0xFF, 0xC5);
+	break;
+
+    case INST_GT_JMPIF:
+    case INST_GTE_JMPIF:
+    case INST_LT_JMPIF:
+    case INST_LTE_JMPIF: {
+	uint8_t inverse_cc = RM_JIT_CC_LE;
+	if(inst.inst_type == INST_GTE_JMPIF) {
+	    inverse_cc = RM_JIT_CC_L;
+	} else if(inst.inst_type == INST_LT_JMPIF) {
+	    inverse_cc = RM_JIT_CC_GE;
+	} else if(inst.inst_type == INST_LTE_JMPIF) {
+	    inverse_cc = RM_JIT_CC_G;
+	}
+	if(checked) rm_jit_require_stack(jit, 2, ip);
+	rm_jit_load_operands(jit, 0x3B);	// cmp
+	RM_JIT_EMIT(jit, 0x4D, 0x8D, 0x6D, 0xFE);	// lea r13, [r13 - 2], keeps the flags of cmp
+	rm_jit_branch(jit, program, inverse_cc, ip, operand);
+    } break;
+
+    default:
+	rm_jit_exit(jit, ip, ERR_ILLEGAL_INST);
+	return;
+    }
+}
+
+// * Translate program->insts into native code. Verified programs are compiled
+// * without stack checks, like the unchecked interpreters.
+bool rm_prepare_jit(Rm_Program *program) {
+    rm_release_jit(program);
+
+    Rm_Jit jit = {0};
+    jit.capacity = RM_JIT_MAX_INST_SIZE * (program->insts_size + 2);
+    if(jit.capacity > UINT32_MAX) {
+	fprintf(stderr, "ERROR: program is too big for the JIT\n");
+	return false;
+    }
+    void *code = mmap(NULL, jit.capacity, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(code == MAP_FAILED) {
+	fprintf(stderr, "ERROR: could not allocate JIT buffer: %s\n", strerror(errno));
+	return false;
+    }
+    jit.code = code;
+    jit.patches_capacity = program->insts_size;
+    jit.patch_at = malloc(sizeof(jit.patch_at[0]) * (jit.patches_capacity + 1));
+    jit.patch_target = malloc(sizeof(jit.patch_target[0]) * (jit.patches_capacity + 1));
+    program->jit_offsets = malloc(sizeof(program->jit_offsets[0]) * (program->insts_size + 1));
+    if(jit.patch_at == NULL || jit.patch_target == NULL || program->jit_offsets == NULL) {
+	fprintf(stderr, "ERROR: could not allocate JIT tables\n");
 	exit(1);
     }
+    const bool checked = !program->verified;
+
+    // * Prologue: save callee saved registers and the budget pointer, load
+    // * the VM state and jump to the native code of the current ip passed
+    // * in rdx
+    RM_JIT_EMIT(&jit, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);	// push rbx, r12, r13, r14, r15
+    RM_JIT_EMIT(&jit, 0x56);						// push rsi
+    RM_JIT_EMIT(&jit, 0x49, 0x89, 0xFF);				// mov r15, rdi
+    RM_JIT_EMIT(&jit, 0x48, 0x8B, 0x9F);				// mov rbx, [rdi + stack]
+    rm_jit_u32(&jit, (uint32_t)offsetof(Rm, stack));
+    RM_JIT_EMIT(&jit, 0x4C, 0x8B, 0xAF);				// mov r13, [rdi + rm_stack_size]
+    rm_jit_u32(&jit, (uint32_t)offsetof(Rm, rm_stack_size));
+    RM_JIT_EMIT(&jit, 0x4C, 0x8B, 0xB7);				// mov r14, [rdi + stack_capacity]
+    rm_jit_u32(&jit, (uint32_t)offsetof(Rm, stack_capacity));
+    RM_JIT_EMIT(&jit, 0x4C, 0x8B, 0x26);				// mov r12, [rsi]
+    RM_JIT_EMIT(&jit, 0xFF, 0xE2);					// jmp rdx
+
+    // * Epilogue: rsi = ip, eax = Err
+    jit.epilogue = jit.size;
+    RM_JIT_EMIT(&jit, 0x49, 0x89, 0xB7);				// mov [r15 + ip], rsi
+    rm_jit_u32(&jit, (uint32_t)offsetof(Rm, ip));
+    RM_JIT_EMIT(&jit, 0x4D, 0x89, 0xAF);				// mov [r15 + rm_stack_size], r13
+    rm_jit_u32(&jit, (uint32_t)offsetof(Rm, rm_stack_size));
+    RM_JIT_EMIT(&jit, 0x59);						// pop rcx
+    RM_JIT_EMIT(&jit, 0x4C, 0x89, 0x21);				// mov [rcx], r12
+    RM_JIT_EMIT(&jit, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3);	// pop r15, r14, r13, r12, rbx; ret
+
+    for(Inst_Addr ip = 0; ip < program->insts_size; ++ip) {
+	program->jit_offsets[ip] = (uint32_t)jit.size;
+	rm_jit_inst(&jit, program, ip, checked);
+    }
+    // * Falling off the end of the program, the last block already paid
+    // * for the illegal slot
+    program->jit_offsets[program->insts_size] = (uint32_t)jit.size;
+    rm_jit_exit(&jit, program->insts_size, ERR_ILLEGAL_INST);
+
+    for(size_t i = 0; i < jit.patches_size; ++i) {
+	size_t at = jit.patch_at[i];
+	int64_t rel = (int64_t)program->jit_offsets[jit.patch_target[i]] - (int64_t)(at + 4);
+	for(size_t j = 0; j < 4; ++j) {
+	    jit.code[at + j] = (uint8_t)((uint64_t)rel >> (8 * j));
+	}
+    }
+
+    free(jit.patch_at);
+    free(jit.patch_target);
+
+    if(mprotect(code, jit.capacity, PROT_READ | PROT_EXEC) < 0) {
+	fprintf(stderr, "ERROR: could not make JIT code executable: %s\n", strerror(errno));
+	munmap(code, jit.capacity);
+	rm_release_jit(program);
+	return false;
+    }
+
+    program->jit_code = code;
+    program->jit_code_size = jit.capacity;
+    program->jit_unchecked = !checked;
+    return true;
+}
+
+void rm_release_jit(Rm_Program *program) {
+    if(program->jit_code != NULL) {
+	munmap(program->jit_code, program->jit_code_size);
+	program->jit_code = NULL;
+	program->jit_code_size = 0;
+    }
+    free(program->jit_offsets);
+    program->jit_offsets = NULL;
+}
+
+Err rm_execute_program_jit(Rm *rm, int limit) {
+    if(rm->program->jit_code == NULL) {
+	return rm_execute_program(rm, limit);
+    }
+    if(rm->halt) {
+	return ERR_OK;
+    }
+    if(rm->ip >= rm->program->insts_size
+       || (rm->program->jit_unchecked && !rm_can_run_unchecked(rm))) {
+	return rm_execute_program(rm, limit);
+    }
+    if(rm_charge_block(rm->program, rm->ip, &limit) == 0) {
+	return rm_execute_program_stepped(rm, limit);
+    }
+
+    Rm_Jit_Fn fn;
+    memcpy(&fn, &rm->program->jit_code, sizeof(fn));
+    const uint8_t *entry = (const uint8_t *)rm->program->jit_code + rm->program->jit_offsets[rm->ip];
+    uint64_t budget = limit < 0 ? UINT64_MAX : (uint64_t)limit;
+    Err err = fn(rm, &budget, entry);
+
+    // * Stopped on a jump into a block the rest of the budget can't cover
+    if(err == ERR_OK && !rm->halt && limit >= 0) {
+	return rm_execute_program_stepped(rm, (int)budget);
+    }
+    return err;
+}
+
+#undef RM_JIT_EMIT
+
+#else
+
+bool rm_prepare_jit(Rm_Program *program) {
+    (void) program;
+    return false;
+}
+
+void rm_release_jit(Rm_Program *program) {
+    (void) program;
+}
+
+Err rm_execute_program_jit(Rm *rm, int limit) {
+    return rm_execute_program(rm, limit);
+}
+
+#endif // RM_JIT_SUPPORTED
+
+Err rm_execute_program_with(Rm *rm, Rm_Engine engine, int limit) {
+    switch(engine) {
+    case RM_ENGINE_SWITCH:	return rm_execute_program(rm, limit);
+    case RM_ENGINE_THREADED:	return rm_execute_program_threaded(rm, limit);
+    case RM_ENGINE_JIT:		return rm_execute_program_jit(rm, limit);
+    case RM_ENGINE_TOS:		return rm_execute_program_tos(rm, limit);
+    case RM_ENGINE_COUNT:
+    default:
+	assert(0 && "unreachable");
+	return ERR_ILLEGAL_INST;
+    }
+}
+
+// * Creates a bytecode executables
+void rm_save_program_to_file(const Inst *insts, uint64_t insts_size, String_View filepath, Rm_Encoding encoding) {
+    FILE *file_fd = rasm_open_file(filepath, "wb");
 
     // * save program metadata
     Rm_File_Meta meta = {
 	.magic = RM_FILE_MAGIC,
-	.program_size = rm->rm_program_size
+	.version = RM_FILE_VERSION,
+	.encoding = encoding,
+	.program_size = insts_size
     };
     fwrite(&meta, sizeof(meta), 1, file_fd);
     if(ferror(file_fd)) {
@@ -749,7 +3519,15 @@ void rasm_save_to_file(Rm *rm, String_View filepath) {
     }
     
     // * Write the program to file
-    fwrite(rm->program, sizeof(rm->program[0]), rm->rm_program_size, file_fd);
+    if(encoding == RM_ENCODING_RAW) {
+	fwrite(insts, sizeof(insts[0]), insts_size, file_fd);
+    } else {
+	for(size_t i = 0; i < insts_size; ++i) {
+	    uint8_t buffer[RM_ENCODED_INST_CAPACITY];
+	    size_t size = rm_encode_inst(insts[i], buffer);
+	    fwrite(buffer, 1, size, file_fd);
+	}
+    }
     if(ferror(file_fd)) {
 	fprintf(stderr, "ERROR: Could Not write to File %s\n", strerror(errno));
 	exit(1);
@@ -758,49 +3536,145 @@ void rasm_save_to_file(Rm *rm, String_View filepath) {
     fclose(file_fd);
 }
 
-String_View arena_slurp_file(Rm *rm, String_View filepath) {
-    const char *filepath_cstr = arena_sv_to_cstr(rm, filepath);
+void rasm_save_to_file(Rasm *rasm, String_View filepath, Rm_Encoding encoding) {
+    rm_save_program_to_file(rasm->program, rasm->program_size, filepath, encoding);
+}
 
-    FILE *file_fd = fopen(filepath_cstr, "r");
-    if(file_fd == NULL) {
-	fprintf(stderr, "ERROR: Could Not read File %s\n", strerror(errno));
+// * Write a program translated with `relocatable` set as an object. Every
+// * operand holding an address of this program gets a RM_RELOC_BASE
+// * relocation: jump targets, literal or not, and values bound to a label.
+// * Every operand naming an undefined binding becomes a RM_RELOC_SYMBOL.
+void rasm_save_object(Rasm *rasm, String_View filepath) {
+    assert(rasm->relocatable && rasm->stream == NULL);
+    const uint64_t size = rasm->program_size;
+
+    Deferred_Operand **deferred_of = calloc(size + 1, sizeof(deferred_of[0]));
+    Rm_Object_Relocation *relocations = malloc(sizeof(relocations[0]) * (size + 1));
+    Rm_Object_Symbol *symbols = malloc(sizeof(symbols[0]) * (rasm->globals_size + 1));
+    if(deferred_of == NULL || relocations == NULL || symbols == NULL) {
+	fprintf(stderr, "ERROR: could not allocate the object tables\n");
 	exit(1);
     }
+    for(size_t i = 0; i < rasm->deferred_operands_size; ++i) {
+	deferred_of[rasm->deferred_operands[i].addr] = &rasm->deferred_operands[i];
+    }
 
-    if(fseek(file_fd, 0, SEEK_END) < 0) {
-	fprintf(stderr, "ERROR: Could Not read File %s\n", strerror(errno));
-	exit(1);
+    // * Names are written in the order they are referenced: imports first,
+    // * then the exported symbols
+    uint64_t names_size = 0;
+    uint64_t relocations_count = 0;
+    for(size_t i = 0; i < size; ++i) {
+	Inst_Operand_Kind kind = inst_operand_kind(rasm->program[i].inst_type);
+	if(kind == INST_OPERAND_NONE) {
+	    continue;
+	}
+
+	Deferred_Operand *deferred = deferred_of[i];
+	Binding *binding = deferred != NULL ? rasm_find_binding(rasm, deferred->name) : NULL;
+	if(deferred != NULL && binding == NULL) {
+	    relocations[relocations_count++] = (Rm_Object_Relocation) {
+		.addr = i,
+		.kind = RM_RELOC_SYMBOL,
+		.name_offset = names_size,
+		.name_size = deferred->name.count,
+	    };
+	    names_size += deferred->name.count;
+	} else if(kind == INST_OPERAND_LABEL || (binding != NULL && binding->kind == BINDING_LABEL)) {
+	    relocations[relocations_count++] = (Rm_Object_Relocation) {
+		.addr = i,
+		.kind = RM_RELOC_BASE,
+	    };
+	}
     }
 
-    long m = ftell(file_fd);
-    if(m < 0) {
-	fprintf(stderr, "ERROR: Could Not read File %s\n", strerror(errno));
-	exit(1);
+    for(size_t i = 0; i < rasm->globals_size; ++i) {
+	Binding *binding = rasm_find_binding(rasm, rasm->globals[i]);
+	if(binding == NULL) {
+	    fprintf(stderr, "ERROR: global `"SV_Fmt"` is never defined\n", SV_Arg(rasm->globals[i]));
+	    exit(1);
+	}
+	symbols[i] = (Rm_Object_Symbol) {
+	    .name_offset = names_size,
+	    .name_size = binding->name.count,
+	    .value = binding->value,
+	    .kind = binding->kind,
+	};
+	names_size += binding->name.count;
     }
 
-    // * Allocate buffer of m size
-    void *buffer = arena_alloc(rm, (size_t)m);
-    if(buffer == NULL) {
-	fprintf(stderr, "ERROR: Could Not allocate memory for the file %s\n", strerror(errno));
+    Rm_Object_Meta meta = {
+	.magic = RM_OBJECT_MAGIC,
+	.version = RM_OBJECT_VERSION,
+	.program_size = size,
+	.symbols_count = rasm->globals_size,
+	.relocations_count = relocations_count,
+	.names_size = names_size,
+    };
+
+    FILE *file_fd = rasm_open_file(filepath, "wb");
+    fwrite(&meta, sizeof(meta), 1, file_fd);
+    fwrite(rasm->program, sizeof(rasm->program[0]), size, file_fd);
+    fwrite(symbols, sizeof(symbols[0]), rasm->globals_size, file_fd);
+    fwrite(relocations, sizeof(relocations[0]), relocations_count, file_fd);
+    for(size_t i = 0; i < relocations_count; ++i) {
+	if(relocations[i].kind == RM_RELOC_SYMBOL) {
+	    String_View name = deferred_of[relocations[i].addr]->name;
+	    fwrite(name.data, 1, name.count, file_fd);
+	}
+    }
+    for(size_t i = 0; i < rasm->globals_size; ++i) {
+	fwrite(rasm->globals[i].data, 1, rasm->globals[i].count, file_fd);
+    }
+    if(ferror(file_fd)) {
+	fprintf(stderr, "ERROR: Could Not write to File %s\n", strerror(errno));
 	exit(1);
     }
+    fclose(file_fd);
+
+    free(deferred_of);
+    free(relocations);
+    free(symbols);
+}
 
-    // * Set file pos at the start of file
-    if(fseek(file_fd, 0, SEEK_SET) < 0) {
-	fprintf(stderr, "ERROR: Could Not read File %s\n", strerror(errno));
+// * Release the heap memory of a Rasm, the Rasm itself stays valid empty
+void rasm_free(Rasm *rasm) {
+    assert(rasm->stream == NULL);
+    free(rasm->program);
+    free(rasm->deferred_operands);
+    free(rasm->globals);
+    memset(rasm, 0, offsetof(Rasm, arena));
+    rasm->arena_size = 0;
+}
+
+// * Streaming mode: every RASM_STREAM_WINDOW translated instructions are
+// * written out raw, forward references get patched in the file at the end
+void rasm_begin_stream(Rasm *rasm, String_View filepath) {
+    assert(rasm->program_size == 0);
+    rasm->stream = rasm_open_file(filepath, "wb");
+    rasm->program_capacity = RASM_STREAM_WINDOW;
+    rasm->program = realloc(rasm->program, sizeof(rasm->program[0]) * rasm->program_capacity);
+    if(rasm->program == NULL) {
+	fprintf(stderr, "ERROR: could not allocate %zu instructions\n", rasm->program_capacity);
 	exit(1);
     }
+}
 
-    // Copy from 0 - m into buffer
-    size_t n = fread(buffer, 1, (size_t)m, file_fd);
-    if(ferror(file_fd)) {
-	fprintf(stderr, "ERROR: Could Not read File %s\n", strerror(errno));
+void rasm_end_stream(Rasm *rasm) {
+    rasm_flush_stream(rasm);
+
+    Rm_File_Meta meta = {
+	.magic = RM_FILE_MAGIC,
+	.version = RM_FILE_VERSION,
+	.encoding = RM_ENCODING_RAW,
+	.program_size = rasm->program_size
+    };
+    if(fseek(rasm->stream, 0, SEEK_SET) < 0
+       || fwrite(&meta, sizeof(meta), 1, rasm->stream) != 1
+       || fclose(rasm->stream) != 0) {
+	fprintf(stderr, "ERROR: Could Not write to File %s\n", strerror(errno));
 	exit(1);
     }
-    
-    fclose(file_fd);
-
-    return (String_View) { .count = n, .data = buffer }; 
+    rasm->stream = NULL;
 }
 
 #endif // RM_IMPLEMENTATION
@@ -0,0 +1,74 @@
+#define SV_IMPLEMENTATION
+#define RM_IMPLEMENTATION
+#define RM_LINK_IMPLEMENTATION
+
+#include <unistd.h>
+
+#include "./sv.h"
+#include "./rasm.h"
+#include "./rm_link.h"
+
+static const char* shift(int *argc, char ***argv) {
+    if(*argc <= 0) return NULL;
+    const char *arg = **argv;
+    *argv += 1;
+    *argc -= 1;
+    return arg;
+}
+
+static void usage(void) {
+    fprintf(stdout, "Usage: ./rlink [-j threads] [-r] -o [file.rm] [file.rmo]...\n");
+    fprintf(stdout, "    -o    the linked program, it starts at the first instruction of the first object\n");
+    fprintf(stdout, "    -r    write raw instructions that rme executes straight from the mapped file\n");
+}
+
+int main(int argc, char *argv[]) {
+    shift(&argc, &argv);
+
+    const char *output_file = NULL;
+    Rm_Encoding encoding = RM_ENCODING_COMPACT;
+    long threads_count = sysconf(_SC_NPROCESSORS_ONLN);
+    const char **inputs = malloc(sizeof(inputs[0]) * ((size_t)argc + 1));
+    size_t inputs_size = 0;
+    if(inputs == NULL) {
+	fprintf(stderr, "ERROR: could not allocate the arguments\n");
+	exit(1);
+    }
+
+    while(argc > 0) {
+	const char *arg = shift(&argc, &argv);
+	if(strcmp(arg, "-o") == 0) {
+	    output_file = shift(&argc, &argv);
+	}
+	else if(strcmp(arg, "-r") == 0) {
+	    encoding = RM_ENCODING_RAW;
+	}
+	else if(strcmp(arg, "-j") == 0) {
+	    const char *count = shift(&argc, &argv);
+	    threads_count = count ? atol(count) : 0;
+	    if(threads_count <= 0) {
+		fprintf(stderr, "ERROR: `-j` expects a positive number of threads\n");
+		usage();
+		exit(1);
+	    }
+	}
+	else {
+	    inputs[inputs_size++] = arg;
+	}
+    }
+
+    if(output_file == NULL || inputs_size == 0) {
+	fprintf(stderr, "ERROR: please provide an output file and at least one object\n");
+	usage();
+	exit(1);
+    }
+
+    Rm_Link link;
+    rm_link(&link, inputs, inputs_size, (size_t)threads_count);
+    rm_save_program_to_file(link.program, link.program_size, SV(output_file), encoding);
+    printf("Linked %zu objects, %"PRIu64" instructions\n", link.modules_size, link.program_size);
+
+    rm_link_free(&link);
+    free(inputs);
+    return 0;
+}
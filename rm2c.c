@@ -0,0 +1,245 @@
+#define SV_IMPLEMENTATION
+#define RM_IMPLEMENTATION
+
+#include "./sv.h"
+#include "./rasm.h"
+
+static const char* shift(int *argc, char ***argv) {
+    if(*argc <= 0) return NULL;
+    const char *arg = **argv;
+    *argv += 1;
+    *argc -= 1;
+    return arg;
+}
+
+static void usage(void) {
+    fprintf(stdout, "Usage: ./rm2c [file.rm] [file.c]\n");
+}
+
+static Rm_Program program = {0};
+
+// * Every error is reported the way rm_execute_program does it and then
+// * the stack is dumped, just like rme
+static void emit_fail(FILE *out, Err err) {
+    fprintf(out, "    { err = \"%s\"; goto done; }\n", err_as_cstr(err));
+}
+
+static void emit_require_stack(FILE *out, uint64_t n) {
+    fprintf(out, "    if(sp < %"PRIu64") ", n);
+    emit_fail(out, ERR_STACK_UNDERFLOW);
+}
+
+static void emit_require_free(FILE *out, uint64_t n) {
+    fprintf(out, "    if(sp > RM_STACK_CAPACITY - %"PRIu64") ", n);
+    emit_fail(out, ERR_STACK_OVERFLOW);
+}
+
+static void emit_goto(FILE *out, uint64_t target) {
+    if(target < program.insts_size) {
+	fprintf(out, "goto inst_%"PRIu64";\n", target);
+    } else {
+	fprintf(out, "goto inst_end;\n");
+    }
+}
+
+static void emit_binop(FILE *out, bool checked, const char *expr) {
+    if(checked) emit_require_stack(out, 2);
+    fprintf(out, "    stack[sp - 2] = %s;\n", expr);
+    fprintf(out, "    sp -= 1;\n");
+}
+
+static void emit_cmp_jmpif(FILE *out, bool checked, const char *op, uint64_t target) {
+    if(checked) emit_require_stack(out, 2);
+    fprintf(out, "    sp -= 2;\n");
+    fprintf(out, "    if(stack[sp] %s stack[sp + 1]) ", op);
+    emit_goto(out, target);
+}
+
+// * Translate a single instruction. Arithmetic goes through uint64_t so
+// * that wrap around stays defined behaviour in the generated code.
+static void emit_inst(FILE *out, Inst_Addr ip, bool checked) {
+    Inst inst = program.insts[ip];
+    uint64_t operand = inst.inst_operand.as_u64;
+
+    fprintf(out, "inst_%"PRIu64": RM_TICK();", ip);
+    fprintf(out, " // %s", inst_as_cstr(inst.inst_type));
+    if(inst_has_operand(inst.inst_type)) {
+	fprintf(out, " %"PRIu64"", operand);
+    }
+    fprintf(out, "\n");
+
+    switch(inst.inst_type) {
+    case INST_NOP:
+	break;
+
+    case INST_HALT:
+	fprintf(out, "    goto done;\n");
+	break;
+
+    case INST_PUSH:
+	if(checked) emit_require_free(out, 1);
+	fprintf(out, "    stack[sp++] = (int64_t)UINT64_C(%"PRIu64");\n", operand);
+	break;
+
+    case INST_DUP:
+	if(checked) {
+	    emit_require_free(out, 1);
+	    if(operand >= RM_STACK_CAPACITY) {
+		fprintf(out, "    ");
+		emit_fail(out, ERR_STACK_UNDERFLOW);
+		break;
+	    }
+	    emit_require_stack(out, operand + 1);
+	}
+	fprintf(out, "    stack[sp] = stack[sp - %"PRIu64"];\n", operand + 1);
+	fprintf(out, "    sp += 1;\n");
+	break;
+
+    case INST_JMP:
+	fprintf(out, "    ");
+	emit_goto(out, operand);
+	break;
+
+    case INST_JMPIF:
+	if(checked) emit_require_stack(out, 1);
+	fprintf(out, "    sp -= 1;\n");
+	fprintf(out, "    if(stack[sp]) ");
+	emit_goto(out, operand);
+	break;
+
+    case INST_PLUSI:
+	emit_binop(out, checked, "(int64_t)((uint64_t)stack[sp - 2] + (uint64_t)stack[sp - 1])");
+	break;
+
+    case INST_MINUSI:
+	emit_binop(out, checked, "(int64_t)((uint64_t)stack[sp - 2] - (uint64_t)stack[sp - 1])");
+	break;
+
+    case INST_MULI:
+	emit_binop(out, checked, "(int64_t)((uint64_t)stack[sp - 2] * (uint64_t)stack[sp - 1])");
+	break;
+
+    case INST_DIVI:	emit_binop(out, checked, "stack[sp - 2] / stack[sp - 1]");	break;
+    case INST_MODI:	emit_binop(out, checked, "stack[sp - 2] % stack[sp - 1]");	break;
+    case INST_GT:	emit_binop(out, checked, "stack[sp - 2] > stack[sp - 1]");	break;
+    case INST_GTE:	emit_binop(out, checked, "stack[sp - 2] >= stack[sp - 1]");	break;
+    case INST_LT:	emit_binop(out, checked, "stack[sp - 2] < stack[sp - 1]");	break;
+    case INST_LTE:	emit_binop(out, checked, "stack[sp - 2] <= stack[sp - 1]");	break;
+
+    case INST_PUSH_PLUSI:
+	if(checked) {
+	    emit_require_free(out, 1);
+	    emit_require_stack(out, 1);
+	}
+	fprintf(out, "    stack[sp - 1] = (int64_t)((uint64_t)stack[sp - 1] + UINT64_C(%"PRIu64"));\n",
+		operand);
+	break;
+
+    case INST_DUP_INC:
+	if(checked) {
+	    emit_require_free(out, 1);
+	    emit_require_stack(out, 1);
+	    emit_require_free(out, 2);
+	}
+	fprintf(out, "    stack[sp] = (int64_t)((uint64_t)stack[sp - 1] + UINT64_C(%"PRIu64"));\n",
+		operand);
+	fprintf(out, "    sp += 1;\n");
+	break;
+
+    case INST_GT_JMPIF:		emit_cmp_jmpif(out, checked, ">", operand);	break;
+    case INST_GTE_JMPIF:	emit_cmp_jmpif(out, checked, ">=", operand);	break;
+    case INST_LT_JMPIF:		emit_cmp_jmpif(out, checked, "<", operand);	break;
+    case INST_LTE_JMPIF:	emit_cmp_jmpif(out, checked, "<=", operand);	break;
+
+    default:
+	fprintf(out, "    ");
+	emit_fail(out, ERR_ILLEGAL_INST);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    shift(&argc, &argv);
+
+    const char *input_file = shift(&argc, &argv);
+    const char *output_file = shift(&argc, &argv);
+    if(input_file == NULL || output_file == NULL) {
+	fprintf(stderr, "ERROR: please provide a rasm bytecode file and an output file\n");
+	usage();
+	exit(1);
+    }
+
+    // Load the program
+    rm_load_program_from_file(&program, input_file);
+
+    FILE *out = fopen(output_file, "w");
+    if(out == NULL) {
+	fprintf(stderr, "ERROR: could not open file `%s`: %s\n", output_file, strerror(errno));
+	exit(1);
+    }
+
+    // * Verified programs can't underflow, and can't overflow when the
+    // * deepest stack the verifier found fits the fixed one, skip the checks
+    const bool checked = !(program.verified && program.verified_stack_need <= RM_STACK_CAPACITY);
+
+    fprintf(out, "// Generated by rm2c from %s\n", input_file);
+    fprintf(out, "#include <stdio.h>\n");
+    fprintf(out, "#include <stdint.h>\n");
+    fprintf(out, "#include <inttypes.h>\n");
+    fprintf(out, "\n");
+    fprintf(out, "#define RM_STACK_CAPACITY %d\n", RM_STACK_CAPACITY);
+    fprintf(out, "\n");
+    fprintf(out, "// Instruction limit, same meaning as `rme -limit`. Negative runs until halt.\n");
+    fprintf(out, "#ifndef RM_LIMIT\n");
+    fprintf(out, "#define RM_LIMIT -1\n");
+    fprintf(out, "#endif\n");
+    fprintf(out, "\n");
+    fprintf(out, "#if RM_LIMIT < 0\n");
+    fprintf(out, "#define RM_TICK()\n");
+    fprintf(out, "#else\n");
+    fprintf(out, "#define RM_TICK() do { if(limit == 0) goto done; limit -= 1; } while(0)\n");
+    fprintf(out, "#endif\n");
+    fprintf(out, "\n");
+    fprintf(out, "#ifdef __GNUC__\n");
+    fprintf(out, "#pragma GCC diagnostic ignored \"-Wunused-label\"\n");
+    fprintf(out, "#endif\n");
+    fprintf(out, "\n");
+    fprintf(out, "int main(void) {\n");
+    fprintf(out, "    int64_t stack[RM_STACK_CAPACITY];\n");
+    fprintf(out, "    uint64_t sp = 0;\n");
+    fprintf(out, "    const char *err = NULL;\n");
+    fprintf(out, "#if RM_LIMIT >= 0\n");
+    fprintf(out, "    long long limit = RM_LIMIT;\n");
+    fprintf(out, "#endif\n");
+    fprintf(out, "\n");
+
+    for(Inst_Addr ip = 0; ip < program.insts_size; ++ip) {
+	emit_inst(out, ip, checked);
+    }
+
+    // * Falling off the end or jumping outside of the program
+    fprintf(out, "inst_end: RM_TICK();\n");
+    fprintf(out, "    err = \"%s\";\n", err_as_cstr(ERR_ILLEGAL_INST));
+    fprintf(out, "\n");
+    fprintf(out, "done:\n");
+    fprintf(out, "    if(err != NULL) {\n");
+    fprintf(out, "        printf(\"ERROR: %%s\\n\", err);\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    printf(\"Stack:\\n\");\n");
+    fprintf(out, "    if(sp > 0) {\n");
+    fprintf(out, "        for(uint64_t i = 0; i < sp; ++i) {\n");
+    fprintf(out, "            printf(\"    %%\"PRIu64\"\\n\", (uint64_t)stack[i]);\n");
+    fprintf(out, "        }\n");
+    fprintf(out, "    } else {\n");
+    fprintf(out, "        printf(\"[empty]\\n\");\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    return 0;\n");
+    fprintf(out, "}\n");
+
+    if(ferror(out)) {
+	fprintf(stderr, "ERROR: could not write to file `%s`: %s\n", output_file, strerror(errno));
+	exit(1);
+    }
+    fclose(out);
+
+    return 0;
+}
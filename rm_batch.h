@@ -0,0 +1,176 @@
+#ifndef RM_BATCH_H_
+#define RM_BATCH_H_
+
+// * Runs many independent programs on a pool of threads. Needs rasm.h
+// * included first and linking with -pthread.
+
+#include <pthread.h>
+
+// * A single run inside of a batch. The program is shared between tasks,
+// * every task gets a fresh Rm.
+typedef struct {
+    const Rm_Program *program;
+    Rm_Engine engine;
+    int limit;
+    uint64_t stack_capacity;
+
+    // * Filled by rm_batch_run: the error the run stopped with and
+    // * everything rme prints for it
+    Err err;
+    char *output;
+    size_t output_size;
+} Rm_Batch_Task;
+
+void rm_batch_run(Rm_Batch_Task *tasks, size_t tasks_size, size_t threads_count);
+void rm_batch_free(Rm_Batch_Task *tasks, size_t tasks_size);
+
+#endif // RM_BATCH_H_
+
+#ifdef RM_BATCH_IMPLEMENTATION
+
+// * Task indices of a single worker. The owner pops from the bottom,
+// * idle workers steal from the top.
+typedef struct {
+    pthread_mutex_t lock;
+    size_t *items;
+    size_t top;
+    size_t bottom;
+} Rm_Batch_Deque;
+
+typedef struct {
+    Rm_Batch_Task *tasks;
+    Rm_Batch_Deque *deques;
+    size_t deques_size;
+} Rm_Batch;
+
+typedef struct {
+    Rm_Batch *batch;
+    size_t id;
+    Rm rm;
+} Rm_Batch_Worker;
+
+static bool rm_batch_pop(Rm_Batch_Deque *deque, size_t *index) {
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->bottom > deque->top) {
+	deque->bottom -= 1;
+	*index = deque->items[deque->bottom];
+	found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool rm_batch_steal(Rm_Batch_Deque *deque, size_t *index) {
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->bottom > deque->top) {
+	*index = deque->items[deque->top];
+	deque->top += 1;
+	found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static void rm_batch_run_task(Rm *rm, Rm_Batch_Task *task) {
+    FILE *out = open_memstream(&task->output, &task->output_size);
+    if(out == NULL) {
+	fprintf(stderr, "ERROR: could not allocate batch output: %s\n", strerror(errno));
+	exit(1);
+    }
+
+    if(rm->stack_capacity != task->stack_capacity) {
+	rm_alloc_stack(rm, task->stack_capacity);
+    }
+    rm_init(rm, task->program);
+    task->err = rm_execute_program_with(rm, task->engine, task->limit);
+    rm_dump_result(out, rm, task->err);
+    fclose(out);
+}
+
+static void *rm_batch_worker(void *arg) {
+    Rm_Batch_Worker *worker = arg;
+    Rm_Batch *batch = worker->batch;
+
+    for(;;) {
+	size_t index = 0;
+	bool found = rm_batch_pop(&batch->deques[worker->id], &index);
+
+	// * Tasks are never added once the batch started, so when every
+	// * other deque is empty too there is nothing left to do
+	for(size_t i = 1; !found && i < batch->deques_size; ++i) {
+	    found = rm_batch_steal(&batch->deques[(worker->id + i) % batch->deques_size], &index);
+	}
+	if(!found) break;
+
+	rm_batch_run_task(&worker->rm, &batch->tasks[index]);
+    }
+    return NULL;
+}
+
+// * Run every task, the calling thread works as one of the workers
+void rm_batch_run(Rm_Batch_Task *tasks, size_t tasks_size, size_t threads_count) {
+    if(tasks_size == 0) return;
+    if(threads_count == 0) threads_count = 1;
+    if(threads_count > tasks_size) threads_count = tasks_size;
+
+    size_t *items = malloc(sizeof(items[0]) * tasks_size);
+    Rm_Batch_Deque *deques = malloc(sizeof(deques[0]) * threads_count);
+    Rm_Batch_Worker *workers = calloc(threads_count, sizeof(workers[0]));
+    pthread_t *threads = malloc(sizeof(threads[0]) * threads_count);
+    if(items == NULL || deques == NULL || workers == NULL || threads == NULL) {
+	fprintf(stderr, "ERROR: could not allocate %zu batch workers\n", threads_count);
+	exit(1);
+    }
+
+    Rm_Batch batch = {
+	.tasks = tasks,
+	.deques = deques,
+	.deques_size = threads_count,
+    };
+
+    // * Every worker starts with a contiguous slice of the tasks
+    for(size_t i = 0; i < tasks_size; ++i) {
+	items[i] = i;
+    }
+    for(size_t i = 0; i < threads_count; ++i) {
+	pthread_mutex_init(&deques[i].lock, NULL);
+	deques[i].items = items;
+	deques[i].top = i * tasks_size / threads_count;
+	deques[i].bottom = (i + 1) * tasks_size / threads_count;
+	workers[i].batch = &batch;
+	workers[i].id = i;
+    }
+
+    for(size_t i = 1; i < threads_count; ++i) {
+	int err = pthread_create(&threads[i], NULL, rm_batch_worker, &workers[i]);
+	if(err != 0) {
+	    fprintf(stderr, "ERROR: could not start batch worker: %s\n", strerror(err));
+	    exit(1);
+	}
+    }
+    rm_batch_worker(&workers[0]);
+    for(size_t i = 1; i < threads_count; ++i) {
+	pthread_join(threads[i], NULL);
+    }
+
+    for(size_t i = 0; i < threads_count; ++i) {
+	pthread_mutex_destroy(&deques[i].lock);
+	rm_free_stack(&workers[i].rm);
+    }
+    free(threads);
+    free(workers);
+    free(deques);
+    free(items);
+}
+
+void rm_batch_free(Rm_Batch_Task *tasks, size_t tasks_size) {
+    for(size_t i = 0; i < tasks_size; ++i) {
+	free(tasks[i].output);
+	tasks[i].output = NULL;
+	tasks[i].output_size = 0;
+    }
+}
+
+#endif // RM_BATCH_IMPLEMENTATION
@@ -0,0 +1,425 @@
+#ifndef RM_CFG_H_
+#define RM_CFG_H_
+
+// * Control-flow graph of a program: basic blocks, their successors, what
+// * is reachable from the entry and the natural loops. rasm builds its
+// * block level optimizations on it, derasm prints it as Graphviz DOT.
+// * Needs rasm.h included first.
+
+#define RM_CFG_NONE SIZE_MAX
+
+// * Instructions [start, end). Successors are block indices, RM_CFG_NONE
+// * when there is none or execution would leave the program.
+typedef struct {
+    Inst_Addr start;
+    Inst_Addr end;
+    size_t jump;
+    size_t fallthrough;
+    bool reachable;
+    bool loop_header;
+    size_t loop_depth;
+} Rm_Block;
+
+typedef struct {
+    Rm_Block *blocks;
+    size_t blocks_size;
+
+    // * Block of every address, block_of[insts_size] is RM_CFG_NONE
+    size_t *block_of;
+    size_t loops_count;
+} Rm_Cfg;
+
+// * Block level rewrites done by rasm_optimize_cfg
+typedef enum {
+    CFG_OPT_THREADED_JUMP = 0,
+    CFG_OPT_UNREACHABLE_BLOCK,
+    CFG_OPT_FALLTHROUGH,
+    CFG_OPT_COUNT,
+} Cfg_Optimization;
+const char* cfg_optimization_as_cstr(Cfg_Optimization optimization);
+
+void rm_cfg_build(Rm_Cfg *cfg, const Inst *insts, uint64_t insts_size);
+void rm_cfg_free(Rm_Cfg *cfg);
+void rm_cfg_dump_dot(FILE *stream, const Rm_Cfg *cfg, const Inst *insts);
+void rasm_optimize_cfg(Rasm *rasm, size_t counts[CFG_OPT_COUNT]);
+
+#endif // RM_CFG_H_
+
+#ifdef RM_CFG_IMPLEMENTATION
+
+const char* cfg_optimization_as_cstr(Cfg_Optimization optimization) {
+    switch(optimization) {
+    case CFG_OPT_THREADED_JUMP:		return "jump to a jmp -> jump to its target";
+    case CFG_OPT_UNREACHABLE_BLOCK:	return "unreachable block";
+    case CFG_OPT_FALLTHROUGH:		return "jmp L -> block L moved after it";
+    case CFG_OPT_COUNT:
+    default:
+	return "Unknown optimization";
+    }
+}
+
+static void *rm_cfg_alloc(size_t count, size_t size) {
+    void *result = calloc(count + 1, size);
+    if(result == NULL) {
+	fprintf(stderr, "ERROR: could not allocate the control-flow graph\n");
+	exit(1);
+    }
+    return result;
+}
+
+// * Whether execution can continue with the instruction after `inst`
+static bool rm_cfg_falls_through(Inst inst) {
+    return inst.inst_type != INST_JMP && inst.inst_type != INST_HALT;
+}
+
+// * A reachable block nothing reachable falls into, the first of a chain
+// * that has to stay together when blocks get moved around
+static bool rm_cfg_chain_head(const Rm_Cfg *cfg, const Inst *insts, size_t block) {
+    return cfg->blocks[block].reachable
+	&& (block == 0
+	    || !cfg->blocks[block - 1].reachable
+	    || !rm_cfg_falls_through(insts[cfg->blocks[block].start - 1]));
+}
+
+// * Depth-first walk from the entry, marks what is reachable and the
+// * headers of loops. (from, to) of every back edge go into back_edges.
+static size_t rm_cfg_walk(Rm_Cfg *cfg, size_t (*back_edges)[2]) {
+    enum { UNVISITED = 0, ON_STACK, DONE };
+    uint8_t *state = rm_cfg_alloc(cfg->blocks_size, sizeof(state[0]));
+    size_t (*stack)[2] = rm_cfg_alloc(cfg->blocks_size, sizeof(stack[0]));
+    size_t stack_size = 0;
+    size_t back_edges_size = 0;
+
+    if(cfg->blocks_size > 0) {
+	state[0] = ON_STACK;
+	cfg->blocks[0].reachable = true;
+	stack[stack_size][0] = 0;
+	stack[stack_size][1] = 0;
+	stack_size += 1;
+    }
+    while(stack_size > 0) {
+	size_t block = stack[stack_size - 1][0];
+	size_t edge = stack[stack_size - 1][1]++;
+	if(edge >= 2) {
+	    state[block] = DONE;
+	    stack_size -= 1;
+	    continue;
+	}
+
+	size_t next = edge == 0 ? cfg->blocks[block].jump : cfg->blocks[block].fallthrough;
+	if(next == RM_CFG_NONE) {
+	    continue;
+	}
+	if(state[next] == ON_STACK) {
+	    cfg->blocks[next].loop_header = true;
+	    back_edges[back_edges_size][0] = block;
+	    back_edges[back_edges_size][1] = next;
+	    back_edges_size += 1;
+	} else if(state[next] == UNVISITED) {
+	    state[next] = ON_STACK;
+	    cfg->blocks[next].reachable = true;
+	    stack[stack_size][0] = next;
+	    stack[stack_size][1] = 0;
+	    stack_size += 1;
+	}
+    }
+
+    free(stack);
+    free(state);
+    return back_edges_size;
+}
+
+// * Every natural loop adds one to the depth of the blocks in its body.
+// * Back edges to the same header make up a single loop.
+static void rm_cfg_find_loops(Rm_Cfg *cfg, size_t (*back_edges)[2], size_t back_edges_size) {
+    const size_t n = cfg->blocks_size;
+
+    // * Predecessors of every block, preds[preds_start[b]..preds_start[b + 1]]
+    size_t *preds_start = rm_cfg_alloc(n + 1, sizeof(preds_start[0]));
+    for(size_t b = 0; b < n; ++b) {
+	if(cfg->blocks[b].jump != RM_CFG_NONE) preds_start[cfg->blocks[b].jump + 1] += 1;
+	if(cfg->blocks[b].fallthrough != RM_CFG_NONE) preds_start[cfg->blocks[b].fallthrough + 1] += 1;
+    }
+    for(size_t b = 0; b < n; ++b) {
+	preds_start[b + 1] += preds_start[b];
+    }
+    size_t *preds = rm_cfg_alloc(preds_start[n], sizeof(preds[0]));
+    size_t *fill = rm_cfg_alloc(n, sizeof(fill[0]));
+    for(size_t b = 0; b < n; ++b) {
+	if(cfg->blocks[b].jump != RM_CFG_NONE) {
+	    size_t to = cfg->blocks[b].jump;
+	    preds[preds_start[to] + fill[to]++] = b;
+	}
+	if(cfg->blocks[b].fallthrough != RM_CFG_NONE) {
+	    size_t to = cfg->blocks[b].fallthrough;
+	    preds[preds_start[to] + fill[to]++] = b;
+	}
+    }
+
+    // * Group the back edges by header
+    for(size_t i = 1; i < back_edges_size; ++i) {
+	size_t from = back_edges[i][0];
+	size_t to = back_edges[i][1];
+	size_t j = i;
+	while(j > 0 && back_edges[j - 1][1] > to) {
+	    back_edges[j][0] = back_edges[j - 1][0];
+	    back_edges[j][1] = back_edges[j - 1][1];
+	    j -= 1;
+	}
+	back_edges[j][0] = from;
+	back_edges[j][1] = to;
+    }
+
+    // * mark[b] == header + 1 once b is known to be in the loop of header
+    size_t *mark = rm_cfg_alloc(n, sizeof(mark[0]));
+    size_t *worklist = rm_cfg_alloc(n, sizeof(worklist[0]));
+    for(size_t i = 0; i < back_edges_size; ++i) {
+	const size_t header = back_edges[i][1];
+	if(i == 0 || back_edges[i - 1][1] != header) {
+	    cfg->loops_count += 1;
+	    mark[header] = header + 1;
+	    cfg->blocks[header].loop_depth += 1;
+	}
+
+	size_t worklist_size = 0;
+	if(mark[back_edges[i][0]] != header + 1) {
+	    mark[back_edges[i][0]] = header + 1;
+	    cfg->blocks[back_edges[i][0]].loop_depth += 1;
+	    worklist[worklist_size++] = back_edges[i][0];
+	}
+	while(worklist_size > 0) {
+	    size_t block = worklist[--worklist_size];
+	    for(size_t p = preds_start[block]; p < preds_start[block + 1]; ++p) {
+		size_t pred = preds[p];
+		if(cfg->blocks[pred].reachable && mark[pred] != header + 1) {
+		    mark[pred] = header + 1;
+		    cfg->blocks[pred].loop_depth += 1;
+		    worklist[worklist_size++] = pred;
+		}
+	    }
+	}
+    }
+
+    free(worklist);
+    free(mark);
+    free(fill);
+    free(preds);
+    free(preds_start);
+}
+
+void rm_cfg_build(Rm_Cfg *cfg, const Inst *insts, uint64_t insts_size) {
+    memset(cfg, 0, sizeof(*cfg));
+
+    // * A block starts at the entry, at every jump target and after every
+    // * jump or halt
+    bool *leader = rm_cfg_alloc(insts_size + 1, sizeof(leader[0]));
+    if(insts_size > 0) {
+	leader[0] = true;
+    }
+    for(uint64_t i = 0; i < insts_size; ++i) {
+	if(inst_operand_kind(insts[i].inst_type) == INST_OPERAND_LABEL) {
+	    if(insts[i].inst_operand.as_u64 < insts_size) {
+		leader[insts[i].inst_operand.as_u64] = true;
+	    }
+	    leader[i + 1] = true;
+	} else if(insts[i].inst_type == INST_HALT) {
+	    leader[i + 1] = true;
+	}
+    }
+
+    size_t blocks_size = 0;
+    for(uint64_t i = 0; i < insts_size; ++i) {
+	if(leader[i]) blocks_size += 1;
+    }
+    cfg->blocks = rm_cfg_alloc(blocks_size, sizeof(cfg->blocks[0]));
+    cfg->block_of = rm_cfg_alloc(insts_size + 1, sizeof(cfg->block_of[0]));
+    for(uint64_t i = 0; i < insts_size; ++i) {
+	if(leader[i]) {
+	    if(cfg->blocks_size > 0) {
+		cfg->blocks[cfg->blocks_size - 1].end = i;
+	    }
+	    cfg->blocks[cfg->blocks_size++].start = i;
+	}
+	cfg->block_of[i] = cfg->blocks_size - 1;
+    }
+    if(cfg->blocks_size > 0) {
+	cfg->blocks[cfg->blocks_size - 1].end = insts_size;
+    }
+    cfg->block_of[insts_size] = RM_CFG_NONE;
+    free(leader);
+
+    for(size_t b = 0; b < cfg->blocks_size; ++b) {
+	Rm_Block *block = &cfg->blocks[b];
+	const Inst last = insts[block->end - 1];
+	block->jump = RM_CFG_NONE;
+	block->fallthrough = RM_CFG_NONE;
+	if(inst_operand_kind(last.inst_type) == INST_OPERAND_LABEL && last.inst_operand.as_u64 < insts_size) {
+	    block->jump = cfg->block_of[last.inst_operand.as_u64];
+	}
+	if(rm_cfg_falls_through(last)) {
+	    block->fallthrough = cfg->block_of[block->end];
+	}
+    }
+
+    size_t (*back_edges)[2] = rm_cfg_alloc(cfg->blocks_size * 2, sizeof(back_edges[0]));
+    size_t back_edges_size = rm_cfg_walk(cfg, back_edges);
+    rm_cfg_find_loops(cfg, back_edges, back_edges_size);
+    free(back_edges);
+}
+
+void rm_cfg_free(Rm_Cfg *cfg) {
+    free(cfg->blocks);
+    free(cfg->block_of);
+    memset(cfg, 0, sizeof(*cfg));
+}
+
+// * Blocks are boxes with their disassembly, loop headers are bold with
+// * the loop depth, unreachable blocks are grey. Jumps are labeled with
+// * the instruction, fallthrough edges are dashed.
+void rm_cfg_dump_dot(FILE *stream, const Rm_Cfg *cfg, const Inst *insts) {
+    fprintf(stream, "digraph cfg {\n");
+    fprintf(stream, "    node [shape=box fontname=\"monospace\"];\n");
+    for(size_t b = 0; b < cfg->blocks_size; ++b) {
+	const Rm_Block *block = &cfg->blocks[b];
+	fprintf(stream, "    b%zu [label=\"", b);
+	if(block->loop_header) {
+	    fprintf(stream, "loop depth %zu\\l", block->loop_depth);
+	}
+	for(Inst_Addr i = block->start; i < block->end; ++i) {
+	    fprintf(stream, "%"PRIu64": %s", i, inst_as_cstr(insts[i].inst_type));
+	    if(inst_has_operand(insts[i].inst_type)) {
+		fprintf(stream, " %"PRIu64"", insts[i].inst_operand.as_u64);
+	    }
+	    fprintf(stream, "\\l");
+	}
+	fprintf(stream, "\"");
+	if(block->loop_header) {
+	    fprintf(stream, " style=bold");
+	}
+	if(!block->reachable) {
+	    fprintf(stream, " color=grey fontcolor=grey");
+	}
+	fprintf(stream, "];\n");
+    }
+    for(size_t b = 0; b < cfg->blocks_size; ++b) {
+	const Rm_Block *block = &cfg->blocks[b];
+	if(block->jump != RM_CFG_NONE) {
+	    fprintf(stream, "    b%zu -> b%zu [label=\"%s\"];\n",
+		    b, block->jump, inst_as_cstr(insts[block->end - 1].inst_type));
+	}
+	if(block->fallthrough != RM_CFG_NONE) {
+	    fprintf(stream, "    b%zu -> b%zu [style=dashed];\n", b, block->fallthrough);
+	}
+    }
+    fprintf(stream, "}\n");
+}
+
+// * Block level pass over a translated program:
+// *  - jumps to a jmp go straight to its final target,
+// *  - blocks that can't be reached from the entry are deleted,
+// *  - a block ending in `jmp L` is followed by the blocks starting at L
+// *    when nothing else falls into them, and the jmp goes away, so the
+// *    taken path of unconditional jumps runs in a straight line.
+// * Counts the rewrites per kind into `counts`.
+void rasm_optimize_cfg(Rasm *rasm, size_t counts[CFG_OPT_COUNT]) {
+    Inst *insts = rasm->program;
+    const uint64_t size = rasm->program_size;
+    memset(counts, 0, sizeof(counts[0]) * CFG_OPT_COUNT);
+
+    for(uint64_t i = 0; i < size; ++i) {
+	if(inst_operand_kind(insts[i].inst_type) != INST_OPERAND_LABEL) {
+	    continue;
+	}
+	// * A cycle of jmps is an infinite loop anyway, stop somewhere on it
+	Inst_Addr target = insts[i].inst_operand.as_u64;
+	for(uint64_t steps = 0; steps < size && target < size && insts[target].inst_type == INST_JMP; ++steps) {
+	    if(insts[target].inst_operand.as_u64 == target) break;
+	    target = insts[target].inst_operand.as_u64;
+	}
+	if(target != insts[i].inst_operand.as_u64) {
+	    insts[i].inst_operand.as_u64 = target;
+	    counts[CFG_OPT_THREADED_JUMP] += 1;
+	}
+    }
+
+    Rm_Cfg cfg;
+    rm_cfg_build(&cfg, insts, size);
+    for(size_t b = 0; b < cfg.blocks_size; ++b) {
+	if(!cfg.blocks[b].reachable) {
+	    counts[CFG_OPT_UNREACHABLE_BLOCK] += 1;
+	}
+    }
+
+    // * Chains of reachable blocks that fall into each other stay together,
+    // * they are laid out starting with the one of the entry. A program
+    // * that can run off its end keeps its order, or a moved block would
+    // * end up there.
+    bool move = cfg.blocks_size > 0;
+    for(size_t b = 0; b < cfg.blocks_size; ++b) {
+	if(cfg.blocks[b].reachable && cfg.blocks[b].fallthrough == RM_CFG_NONE
+	   && rm_cfg_falls_through(insts[cfg.blocks[b].end - 1])) {
+	    move = false;
+	}
+    }
+    bool *placed = rm_cfg_alloc(cfg.blocks_size, sizeof(placed[0]));
+    bool *keep = rm_cfg_alloc(size + 1, sizeof(keep[0]));
+    Inst_Addr *new_addr = rm_cfg_alloc(size + 1, sizeof(new_addr[0]));
+    Inst_Addr next = 0;
+    size_t chain = 0;
+    size_t search = 0;
+    while(chain < cfg.blocks_size) {
+	size_t block = chain;
+	for(;;) {
+	    placed[block] = true;
+	    for(Inst_Addr i = cfg.blocks[block].start; i < cfg.blocks[block].end; ++i) {
+		keep[i] = true;
+		new_addr[i] = next++;
+	    }
+	    const Inst last = insts[cfg.blocks[block].end - 1];
+	    if(!rm_cfg_falls_through(last) || cfg.blocks[block].fallthrough == RM_CFG_NONE) {
+		break;
+	    }
+	    block = cfg.blocks[block].fallthrough;
+	}
+
+	// * Continue with the target of the closing jmp if it starts a chain
+	const Rm_Block *tail = &cfg.blocks[block];
+	const Inst last = insts[tail->end - 1];
+	const size_t target = tail->jump;
+	if(move && last.inst_type == INST_JMP && target != RM_CFG_NONE && !placed[target]
+	   && rm_cfg_chain_head(&cfg, insts, target)) {
+	    keep[tail->end - 1] = false;
+	    next -= 1;
+	    new_addr[tail->end - 1] = next;
+	    counts[CFG_OPT_FALLTHROUGH] += 1;
+	    chain = target;
+	    continue;
+	}
+
+	// * Otherwise with the next chain in program order
+	while(search < cfg.blocks_size && (placed[search] || !rm_cfg_chain_head(&cfg, insts, search))) {
+	    search += 1;
+	}
+	chain = search;
+    }
+
+    // * Instructions of deleted blocks, and the end of the program, map to
+    // * the next instruction that survived in program order
+    Inst_Addr following = next;
+    new_addr[size] = next;
+    for(uint64_t i = size; i-- > 0;) {
+	if(keep[i]) {
+	    following = new_addr[i];
+	} else if(!cfg.blocks[cfg.block_of[i]].reachable) {
+	    new_addr[i] = following;
+	}
+    }
+
+    rasm_reorder_program(rasm, new_addr, keep, next);
+    free(new_addr);
+    free(keep);
+    free(placed);
+    rm_cfg_free(&cfg);
+}
+
+#endif // RM_CFG_IMPLEMENTATION
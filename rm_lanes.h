@@ -0,0 +1,500 @@
+#ifndef RM_LANES_H_
+#define RM_LANES_H_
+
+// * Lockstep interpreter running one program over many inputs. A single
+// * instruction stream drives RM_LANES runs at once, each with its own
+// * initial stack. Needs rasm.h included first.
+
+#ifndef RM_LANES
+#define RM_LANES 8
+#endif
+
+typedef struct {
+    // * Initial stack of the run, bottom first
+    const int64_t *values;
+    uint64_t values_size;
+
+    // * Filled by rm_lanes_run: the error the run stopped with and the
+    // * machine state, the same as after rm_execute_program
+    Err err;
+    uint64_t ip;
+    bool halt;
+    int64_t *stack;
+    uint64_t stack_size;
+} Rm_Lane_Run;
+
+void rm_lanes_run(const Rm_Program *program, Rm_Engine engine, int limit, uint64_t stack_capacity,
+		  Rm_Lane_Run *runs, size_t runs_size);
+void rm_lanes_dump_result(FILE *stream, const Rm_Lane_Run *run);
+void rm_lanes_free(Rm_Lane_Run *runs, size_t runs_size);
+
+#endif // RM_LANES_H_
+
+#ifdef RM_LANES_IMPLEMENTATION
+
+#if defined(__AVX2__)
+#include<immintrin.h>
+_Static_assert(RM_LANES % 4 == 0, "RM_LANES must be a multiple of 4 with AVX2");
+#endif
+_Static_assert(RM_LANES > 1 && RM_LANES <= 32, "RM_LANES must be between 2 and 32");
+
+// * One stack slot of every lane, the stack is stored structure of arrays
+typedef struct {
+    _Alignas(32) int64_t v[RM_LANES];
+} Rm_Lane_Row;
+
+typedef enum {
+    RM_LANE_ADD,
+    RM_LANE_SUB,
+    RM_LANE_MUL,
+    RM_LANE_GT,
+    RM_LANE_GTE,
+    RM_LANE_LT,
+    RM_LANE_LTE,
+} Rm_Lane_Op;
+
+// * Lanes at the same instruction with the same stack size, `lanes` has a
+// * bit for every one of them
+typedef struct {
+    uint64_t ip;
+    uint64_t depth;
+    uint32_t lanes;
+} Rm_Lanes_Context;
+
+typedef struct {
+    const Rm_Program *program;
+    Rm_Engine engine;
+    bool limited;
+    uint64_t capacity;
+    Rm_Lane_Row *stack;
+
+    Rm_Lane_Run *runs[RM_LANES];
+    // * Budget left of every lane
+    int64_t left[RM_LANES];
+
+    // * Contexts waiting for their turn, at most one per lane
+    Rm_Lanes_Context pending[RM_LANES];
+    size_t pending_size;
+
+    // * Runs the lanes that drop out of lockstep
+    Rm rm;
+} Rm_Lanes;
+
+// * -1 for every lane in `lanes`, 0 for the others
+static inline void rm_lane_mask(Rm_Lane_Row *mask, uint32_t lanes) {
+    for(unsigned l = 0; l < RM_LANES; ++l) {
+	mask->v[l] = (lanes >> l) & 1 ? -1 : 0;
+    }
+}
+
+// * Every operation below writes only the lanes of mask, the others
+// * belong to contexts that are waiting and keep their values
+
+// * dst = dst op src
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((always_inline))
+#endif
+static inline void rm_lane_op(Rm_Lane_Row *dst, const Rm_Lane_Row *src, const Rm_Lane_Row *mask, const Rm_Lane_Op op) {
+#if defined(__AVX2__)
+    if(op != RM_LANE_MUL) {
+	const __m256i one = _mm256_set1_epi64x(1);
+	for(unsigned i = 0; i < RM_LANES; i += 4) {
+	    __m256i a = _mm256_load_si256((const __m256i *)(dst->v + i));
+	    __m256i b = _mm256_load_si256((const __m256i *)(src->v + i));
+	    __m256i m = _mm256_load_si256((const __m256i *)(mask->v + i));
+	    __m256i r;
+	    switch(op) {
+	    case RM_LANE_ADD:	r = _mm256_add_epi64(a, b); break;
+	    case RM_LANE_SUB:	r = _mm256_sub_epi64(a, b); break;
+	    case RM_LANE_GT:	r = _mm256_and_si256(_mm256_cmpgt_epi64(a, b), one); break;
+	    case RM_LANE_GTE:	r = _mm256_andnot_si256(_mm256_cmpgt_epi64(b, a), one); break;
+	    case RM_LANE_LT:	r = _mm256_and_si256(_mm256_cmpgt_epi64(b, a), one); break;
+	    case RM_LANE_LTE:	r = _mm256_andnot_si256(_mm256_cmpgt_epi64(a, b), one); break;
+	    case RM_LANE_MUL:
+	    default:		r = a; break;
+	    }
+	    _mm256_store_si256((__m256i *)(dst->v + i), _mm256_blendv_epi8(a, r, m));
+	}
+	return;
+    }
+#endif
+    // * Wrapping arithmetic, the same as the scalar engines get
+    for(unsigned l = 0; l < RM_LANES; ++l) {
+	const int64_t a = dst->v[l];
+	const int64_t b = src->v[l];
+	int64_t r;
+	switch(op) {
+	case RM_LANE_ADD:	r = (int64_t)((uint64_t)a + (uint64_t)b); break;
+	case RM_LANE_SUB:	r = (int64_t)((uint64_t)a - (uint64_t)b); break;
+	case RM_LANE_MUL:	r = (int64_t)((uint64_t)a * (uint64_t)b); break;
+	case RM_LANE_GT:	r = a > b; break;
+	case RM_LANE_GTE:	r = a >= b; break;
+	case RM_LANE_LT:	r = a < b; break;
+	case RM_LANE_LTE:	r = a <= b; break;
+	default:		r = a; break;
+	}
+	dst->v[l] = (r & mask->v[l]) | (a & ~mask->v[l]);
+    }
+}
+
+// * dst = src + addend, covers push (src == NULL), dup, dup_inc and push_plusi
+static inline void rm_lane_set(Rm_Lane_Row *dst, const Rm_Lane_Row *src, int64_t addend, const Rm_Lane_Row *mask) {
+#if defined(__AVX2__)
+    const __m256i k = _mm256_set1_epi64x(addend);
+    for(unsigned i = 0; i < RM_LANES; i += 4) {
+	__m256i a = _mm256_load_si256((const __m256i *)(dst->v + i));
+	__m256i m = _mm256_load_si256((const __m256i *)(mask->v + i));
+	__m256i r = k;
+	if(src != NULL) {
+	    r = _mm256_add_epi64(_mm256_load_si256((const __m256i *)(src->v + i)), k);
+	}
+	_mm256_store_si256((__m256i *)(dst->v + i), _mm256_blendv_epi8(a, r, m));
+    }
+#else
+    for(unsigned l = 0; l < RM_LANES; ++l) {
+	const int64_t r = src != NULL ? (int64_t)((uint64_t)src->v[l] + (uint64_t)addend) : addend;
+	dst->v[l] = (r & mask->v[l]) | (dst->v[l] & ~mask->v[l]);
+    }
+#endif
+}
+
+// * Bit for every lane where `row` isn't zero
+static inline uint32_t rm_lane_nonzero(const Rm_Lane_Row *row) {
+    uint32_t bits = 0;
+#if defined(__AVX2__)
+    const __m256i zero = _mm256_setzero_si256();
+    for(unsigned i = 0; i < RM_LANES; i += 4) {
+	__m256i z = _mm256_cmpeq_epi64(_mm256_load_si256((const __m256i *)(row->v + i)), zero);
+	bits |= (uint32_t)(~_mm256_movemask_pd(_mm256_castsi256_pd(z)) & 0xF) << i;
+    }
+#else
+    for(unsigned l = 0; l < RM_LANES; ++l) {
+	bits |= (uint32_t)(row->v[l] != 0) << l;
+    }
+#endif
+    return bits;
+}
+
+// * Bit for every lane where `a op b` holds, op is one of the comparisons
+static inline uint32_t rm_lane_compare(const Rm_Lane_Row *a, const Rm_Lane_Row *b, const Rm_Lane_Op op) {
+    uint32_t bits = 0;
+#if defined(__AVX2__)
+    for(unsigned i = 0; i < RM_LANES; i += 4) {
+	__m256i x = _mm256_load_si256((const __m256i *)(a->v + i));
+	__m256i y = _mm256_load_si256((const __m256i *)(b->v + i));
+	// * Only greater than exists, the other three swap or negate it
+	__m256i gt = op == RM_LANE_GT || op == RM_LANE_LTE ? _mm256_cmpgt_epi64(x, y) : _mm256_cmpgt_epi64(y, x);
+	uint32_t set = (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(gt));
+	if(op == RM_LANE_GTE || op == RM_LANE_LTE) set = ~set & 0xF;
+	bits |= set << i;
+    }
+#else
+    for(unsigned l = 0; l < RM_LANES; ++l) {
+	bool cond = false;
+	switch(op) {
+	case RM_LANE_GT:	cond = a->v[l] > b->v[l]; break;
+	case RM_LANE_GTE:	cond = a->v[l] >= b->v[l]; break;
+	case RM_LANE_LT:	cond = a->v[l] < b->v[l]; break;
+	case RM_LANE_LTE:	cond = a->v[l] <= b->v[l]; break;
+	case RM_LANE_ADD:
+	case RM_LANE_SUB:
+	case RM_LANE_MUL:
+	default:		break;
+	}
+	bits |= (uint32_t)cond << l;
+    }
+#endif
+    return bits;
+}
+
+static void rm_lanes_finish(Rm_Lane_Run *run, const Rm *rm, Err err) {
+    run->err = err;
+    run->ip = rm->ip;
+    run->halt = rm->halt;
+    run->stack_size = rm->rm_stack_size;
+    run->stack = malloc(sizeof(run->stack[0]) * (rm->rm_stack_size > 0 ? rm->rm_stack_size : 1));
+    if(run->stack == NULL) {
+	fprintf(stderr, "ERROR: could not allocate the stack of a finished lane\n");
+	exit(1);
+    }
+    memcpy(run->stack, rm->stack, sizeof(run->stack[0]) * rm->rm_stack_size);
+}
+
+// * Copy the column of lane `l` into the scalar VM
+static void rm_lanes_take(Rm_Lanes *lanes, unsigned l, uint64_t ip, uint64_t depth) {
+    Rm *rm = &lanes->rm;
+    for(uint64_t i = 0; i < depth; ++i) {
+	rm->stack[i] = lanes->stack[i].v[l];
+    }
+    rm->rm_stack_size = depth;
+    rm->ip = ip;
+    rm->halt = false;
+    rm->program = lanes->program;
+}
+
+// * Finish the lanes of ctx one by one on the scalar engine. `refund` is
+// * the part of the current block that was charged but didn't run.
+static void rm_lanes_spill(Rm_Lanes *lanes, Rm_Lanes_Context ctx, int64_t refund) {
+    for(unsigned l = 0; l < RM_LANES; ++l) {
+	if(!((ctx.lanes >> l) & 1)) continue;
+	rm_lanes_take(lanes, l, ctx.ip, ctx.depth);
+	int limit = lanes->limited ? (int)(lanes->left[l] + refund) : -1;
+	Err err = rm_execute_program_with(&lanes->rm, lanes->engine, limit);
+	rm_lanes_finish(lanes->runs[l], &lanes->rm, err);
+    }
+}
+
+// * Lanes that reach the instruction of a waiting context with the same
+// * stack size join it
+static void rm_lanes_push(Rm_Lanes *lanes, Rm_Lanes_Context ctx) {
+    for(size_t i = 0; i < lanes->pending_size; ++i) {
+	Rm_Lanes_Context *other = &lanes->pending[i];
+	if(other->ip == ctx.ip && other->depth == ctx.depth) {
+	    other->lanes |= ctx.lanes;
+	    return;
+	}
+    }
+    assert(lanes->pending_size < RM_LANES);
+    lanes->pending[lanes->pending_size++] = ctx;
+}
+
+// * The context furthest behind goes first, so the lanes that branched
+// * ahead wait at the join point until the others catch up
+static bool rm_lanes_pop(Rm_Lanes *lanes, Rm_Lanes_Context *ctx) {
+    if(lanes->pending_size == 0) return false;
+    size_t min = 0;
+    for(size_t i = 1; i < lanes->pending_size; ++i) {
+	if(lanes->pending[i].ip < lanes->pending[min].ip) min = i;
+    }
+    *ctx = lanes->pending[min];
+    lanes->pending[min] = lanes->pending[--lanes->pending_size];
+    return true;
+}
+
+// * Run ctx in lockstep until it halts, leaves lockstep or jumps while
+// * other contexts are waiting. Anything one of its lanes can't do the
+// * same way as the others (an error, a division that would trap, a
+// * budget that ends inside of the next block) goes to the scalar engine
+// * with the state right before that instruction.
+static void rm_lanes_run_context(Rm_Lanes *lanes, Rm_Lanes_Context ctx) {
+    const Rm_Program *program = lanes->program;
+    const Inst *insts = program->insts;
+    const uint64_t insts_size = program->insts_size;
+    const uint64_t capacity = lanes->capacity;
+    Rm_Lane_Row *stack = lanes->stack;
+    uint64_t ip = ctx.ip;
+    uint64_t depth = ctx.depth;
+    uint64_t block_ip = ip;
+    int64_t block_cost = 0;
+    uint32_t taken = 0;
+    Inst inst;
+
+    Rm_Lane_Row mask;
+    rm_lane_mask(&mask, ctx.lanes);
+
+enter_block:
+    block_ip = ip;
+    block_cost = 0;
+    if(lanes->limited) {
+	const int64_t cost = (int64_t)program->block_cost[ip < insts_size ? ip : insts_size];
+	for(unsigned l = 0; l < RM_LANES; ++l) {
+	    if(((ctx.lanes >> l) & 1) && lanes->left[l] < cost) goto spill;
+	}
+	for(unsigned l = 0; l < RM_LANES; ++l) {
+	    if((ctx.lanes >> l) & 1) lanes->left[l] -= cost;
+	}
+	block_cost = cost;
+    }
+
+    for(;;) {
+	if(ip >= insts_size) goto spill;
+	inst = insts[ip];
+	switch(inst.inst_type) {
+	case INST_NOP:
+	    ip += 1;
+	    break;
+
+	case INST_HALT:
+	    for(unsigned l = 0; l < RM_LANES; ++l) {
+		if(!((ctx.lanes >> l) & 1)) continue;
+		rm_lanes_take(lanes, l, ip + 1, depth);
+		lanes->rm.halt = true;
+		rm_lanes_finish(lanes->runs[l], &lanes->rm, ERR_OK);
+	    }
+	    return;
+
+	case INST_PUSH:
+	    if(depth >= capacity) goto spill;
+	    rm_lane_set(&stack[depth], NULL, inst.inst_operand.as_i64, &mask);
+	    depth += 1;
+	    ip += 1;
+	    break;
+
+	case INST_DUP:
+	    if(depth >= capacity || inst.inst_operand.as_u64 >= depth) goto spill;
+	    rm_lane_set(&stack[depth], &stack[depth - 1 - inst.inst_operand.as_u64], 0, &mask);
+	    depth += 1;
+	    ip += 1;
+	    break;
+
+	case INST_JMP:
+	    ip = inst.inst_operand.as_u64;
+	    goto jump;
+
+	case INST_JMPIF:
+	    if(depth < 1) goto spill;
+	    depth -= 1;
+	    taken = rm_lane_nonzero(&stack[depth]) & ctx.lanes;
+	    goto branch;
+
+	case INST_PLUSI:	if(depth < 2) goto spill; rm_lane_op(&stack[depth - 2], &stack[depth - 1], &mask, RM_LANE_ADD); goto binop;
+	case INST_MINUSI:	if(depth < 2) goto spill; rm_lane_op(&stack[depth - 2], &stack[depth - 1], &mask, RM_LANE_SUB); goto binop;
+	case INST_MULI:		if(depth < 2) goto spill; rm_lane_op(&stack[depth - 2], &stack[depth - 1], &mask, RM_LANE_MUL); goto binop;
+	case INST_GT:		if(depth < 2) goto spill; rm_lane_op(&stack[depth - 2], &stack[depth - 1], &mask, RM_LANE_GT); goto binop;
+	case INST_GTE:		if(depth < 2) goto spill; rm_lane_op(&stack[depth - 2], &stack[depth - 1], &mask, RM_LANE_GTE); goto binop;
+	case INST_LT:		if(depth < 2) goto spill; rm_lane_op(&stack[depth - 2], &stack[depth - 1], &mask, RM_LANE_LT); goto binop;
+	case INST_LTE:		if(depth < 2) goto spill; rm_lane_op(&stack[depth - 2], &stack[depth - 1], &mask, RM_LANE_LTE); goto binop;
+	binop:
+	    depth -= 1;
+	    ip += 1;
+	    break;
+
+	// * No vector division, and lanes that would trap do it on the
+	// * scalar engine like they would without lanes
+	case INST_DIVI:
+	case INST_MODI:
+	    if(depth < 2) goto spill;
+	    for(unsigned l = 0; l < RM_LANES; ++l) {
+		const int64_t b = stack[depth - 1].v[l];
+		if(((ctx.lanes >> l) & 1) && (b == 0 || (b == -1 && stack[depth - 2].v[l] == INT64_MIN))) goto spill;
+	    }
+	    for(unsigned l = 0; l < RM_LANES; ++l) {
+		if(!((ctx.lanes >> l) & 1)) continue;
+		const int64_t a = stack[depth - 2].v[l];
+		const int64_t b = stack[depth - 1].v[l];
+		stack[depth - 2].v[l] = inst.inst_type == INST_DIVI ? a / b : a % b;
+	    }
+	    goto binop;
+
+	case INST_PUSH_PLUSI:
+	    if(depth >= capacity || depth < 1) goto spill;
+	    rm_lane_set(&stack[depth - 1], &stack[depth - 1], inst.inst_operand.as_i64, &mask);
+	    ip += 1;
+	    break;
+
+	case INST_DUP_INC:
+	    if(depth < 1 || depth + 1 >= capacity) goto spill;
+	    rm_lane_set(&stack[depth], &stack[depth - 1], inst.inst_operand.as_i64, &mask);
+	    depth += 1;
+	    ip += 1;
+	    break;
+
+	case INST_GT_JMPIF:	if(depth < 2) goto spill; taken = rm_lane_compare(&stack[depth - 2], &stack[depth - 1], RM_LANE_GT); goto cmp_branch;
+	case INST_GTE_JMPIF:	if(depth < 2) goto spill; taken = rm_lane_compare(&stack[depth - 2], &stack[depth - 1], RM_LANE_GTE); goto cmp_branch;
+	case INST_LT_JMPIF:	if(depth < 2) goto spill; taken = rm_lane_compare(&stack[depth - 2], &stack[depth - 1], RM_LANE_LT); goto cmp_branch;
+	case INST_LTE_JMPIF:	if(depth < 2) goto spill; taken = rm_lane_compare(&stack[depth - 2], &stack[depth - 1], RM_LANE_LTE); goto cmp_branch;
+	cmp_branch:
+	    taken &= ctx.lanes;
+	    depth -= 2;
+	    goto branch;
+
+	default:
+	    goto spill;
+	}
+    }
+
+branch:
+    if(taken == ctx.lanes) {
+	ip = inst.inst_operand.as_u64;
+    } else if(taken == 0) {
+	ip += 1;
+    } else {
+	// * Divergent lanes go on separately from both sides of the jump
+	rm_lanes_push(lanes, (Rm_Lanes_Context) { inst.inst_operand.as_u64, depth, taken });
+	rm_lanes_push(lanes, (Rm_Lanes_Context) { ip + 1, depth, ctx.lanes & ~taken });
+	return;
+    }
+
+jump:
+    if(lanes->pending_size > 0) {
+	rm_lanes_push(lanes, (Rm_Lanes_Context) { ip, depth, ctx.lanes });
+	return;
+    }
+    goto enter_block;
+
+spill:
+    ctx.ip = ip;
+    ctx.depth = depth;
+    rm_lanes_spill(lanes, ctx, block_cost - (int64_t)(ip - block_ip));
+}
+
+// * Runs are taken RM_LANES at a time. Lanes with the same initial stack
+// * size start in lockstep, a context down to a single lane runs on the
+// * scalar engine instead.
+void rm_lanes_run(const Rm_Program *program, Rm_Engine engine, int limit, uint64_t stack_capacity,
+		  Rm_Lane_Run *runs, size_t runs_size) {
+    Rm_Lanes *lanes = calloc(1, sizeof(*lanes));
+    if(lanes == NULL) {
+	fprintf(stderr, "ERROR: could not allocate the lanes\n");
+	exit(1);
+    }
+    lanes->program = program;
+    lanes->engine = engine;
+    lanes->limited = limit >= 0;
+    lanes->capacity = stack_capacity;
+    lanes->stack = aligned_alloc(_Alignof(Rm_Lane_Row), sizeof(lanes->stack[0]) * stack_capacity);
+    if(lanes->stack == NULL) {
+	fprintf(stderr, "ERROR: could not allocate a lane stack of %"PRIu64" values\n", stack_capacity);
+	exit(1);
+    }
+    rm_alloc_stack(&lanes->rm, stack_capacity);
+
+    for(size_t first = 0; first < runs_size; first += RM_LANES) {
+	const size_t count = runs_size - first < RM_LANES ? runs_size - first : RM_LANES;
+	for(unsigned l = 0; l < count; ++l) {
+	    Rm_Lane_Run *run = &runs[first + l];
+	    if(run->values_size > stack_capacity) {
+		fprintf(stderr, "ERROR: %"PRIu64" initial values don't fit on a stack of %"PRIu64"\n",
+			run->values_size, stack_capacity);
+		exit(1);
+	    }
+	    for(uint64_t i = 0; i < run->values_size; ++i) {
+		lanes->stack[i].v[l] = run->values[i];
+	    }
+	    lanes->runs[l] = run;
+	    lanes->left[l] = limit;
+	    rm_lanes_push(lanes, (Rm_Lanes_Context) { 0, run->values_size, (uint32_t)1 << l });
+	}
+
+	Rm_Lanes_Context ctx;
+	while(rm_lanes_pop(lanes, &ctx)) {
+	    if((ctx.lanes & (ctx.lanes - 1)) == 0) {
+		rm_lanes_spill(lanes, ctx, 0);
+	    } else {
+		rm_lanes_run_context(lanes, ctx);
+	    }
+	}
+    }
+
+    rm_free_stack(&lanes->rm);
+    free(lanes->stack);
+    free(lanes);
+}
+
+void rm_lanes_dump_result(FILE *stream, const Rm_Lane_Run *run) {
+    Rm rm = {
+	.stack = run->stack,
+	.rm_stack_size = run->stack_size,
+    };
+    rm_dump_result(stream, &rm, run->err);
+}
+
+void rm_lanes_free(Rm_Lane_Run *runs, size_t runs_size) {
+    for(size_t i = 0; i < runs_size; ++i) {
+	free(runs[i].stack);
+	runs[i].stack = NULL;
+	runs[i].stack_size = 0;
+    }
+}
+
+#endif // RM_LANES_IMPLEMENTATION
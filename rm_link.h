@@ -0,0 +1,273 @@
+#ifndef RM_LINK_H_
+#define RM_LINK_H_
+
+// * Separate compilation: assembling .rasm modules into relocatable objects
+// * and linking objects into a single program, both spread over a pool of
+// * threads. Needs rasm.h included first and linking with -pthread.
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef struct {
+    const char *filepath;
+    Rm_Object object;
+
+    // * Address of the object's first instruction in the linked program
+    Inst_Addr base;
+
+    // * First import of the object no other object exports, set while
+    // * relocating and reported once every module is done
+    String_View unresolved;
+} Rm_Link_Module;
+
+// * Entry of the global symbol table, a free slot has an empty name
+typedef struct {
+    String_View name;
+    Word value;
+    size_t module;
+} Rm_Link_Symbol;
+
+typedef struct {
+    Rm_Link_Module *modules;
+    size_t modules_size;
+
+    // * Open addressing hash table over the exported names, at most half full
+    Rm_Link_Symbol *symbols;
+    size_t symbols_capacity;
+
+    Inst *program;
+    uint64_t program_size;
+} Rm_Link;
+
+void rm_assemble_objects(const char **inputs, const char **outputs, size_t count, size_t threads_count);
+void rm_link(Rm_Link *link, const char **inputs, size_t count, size_t threads_count);
+void rm_link_free(Rm_Link *link);
+
+#endif // RM_LINK_H_
+
+#ifdef RM_LINK_IMPLEMENTATION
+
+typedef struct {
+    atomic_size_t next;
+    size_t count;
+    void (*job)(void *context, size_t index);
+    void *context;
+} Rm_Parallel;
+
+static void *rm_parallel_worker(void *arg) {
+    Rm_Parallel *parallel = arg;
+    for(;;) {
+	size_t index = atomic_fetch_add(&parallel->next, 1);
+	if(index >= parallel->count) {
+	    break;
+	}
+	parallel->job(parallel->context, index);
+    }
+    return NULL;
+}
+
+// * job(context, i) for every i < count. Jobs are handed out one at a time
+// * through a shared counter, so a few big modules don't leave the other
+// * threads idle. The calling thread works too.
+static void rm_parallel_for(size_t count, size_t threads_count,
+			    void (*job)(void *context, size_t index), void *context) {
+    Rm_Parallel parallel = {
+	.count = count,
+	.job = job,
+	.context = context,
+    };
+    atomic_init(&parallel.next, 0);
+
+    if(threads_count > count) threads_count = count;
+    if(threads_count == 0) threads_count = 1;
+    pthread_t *threads = malloc(sizeof(threads[0]) * threads_count);
+    if(threads == NULL) {
+	fprintf(stderr, "ERROR: could not allocate %zu threads\n", threads_count);
+	exit(1);
+    }
+
+    for(size_t i = 1; i < threads_count; ++i) {
+	int err = pthread_create(&threads[i], NULL, rm_parallel_worker, &parallel);
+	if(err != 0) {
+	    fprintf(stderr, "ERROR: could not start worker: %s\n", strerror(err));
+	    exit(1);
+	}
+    }
+    rm_parallel_worker(&parallel);
+    for(size_t i = 1; i < threads_count; ++i) {
+	pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+typedef struct {
+    const char **inputs;
+    const char **outputs;
+} Rm_Assemble_Jobs;
+
+static void rm_assemble_object(void *context, size_t index) {
+    Rm_Assemble_Jobs *jobs = context;
+
+    // * Every module gets its own assembler, Rasm is too big for the stack
+    Rasm *rasm = calloc(1, sizeof(*rasm));
+    if(rasm == NULL) {
+	fprintf(stderr, "ERROR: could not allocate the assembler for %s\n", jobs->inputs[index]);
+	exit(1);
+    }
+    rasm->relocatable = true;
+    rasm_translate_source(rasm, SV(jobs->inputs[index]));
+    rasm_save_object(rasm, SV(jobs->outputs[index]));
+    rasm_free(rasm);
+    free(rasm);
+}
+
+// * Assemble inputs[i] into the object outputs[i]
+void rm_assemble_objects(const char **inputs, const char **outputs, size_t count, size_t threads_count) {
+    inst_init_mnemonics();
+    Rm_Assemble_Jobs jobs = {
+	.inputs = inputs,
+	.outputs = outputs,
+    };
+    rm_parallel_for(count, threads_count, rm_assemble_object, &jobs);
+}
+
+static void rm_link_load_module(void *context, size_t index) {
+    Rm_Link *link = context;
+    rm_load_object(&link->modules[index].object, link->modules[index].filepath);
+}
+
+// * Slot holding `name` or the free slot where it belongs
+static Rm_Link_Symbol *rm_link_symbol_slot(const Rm_Link *link, String_View name) {
+    size_t i = (size_t)sv_hash(name) & (link->symbols_capacity - 1);
+    while(link->symbols[i].name.count > 0 && !sv_eq(link->symbols[i].name, name)) {
+	i = (i + 1) & (link->symbols_capacity - 1);
+    }
+    return &link->symbols[i];
+}
+
+// * Copy a module to its place in the program and apply its relocations.
+// * The symbol table is read-only by now, so modules don't share any state.
+static void rm_link_relocate_module(void *context, size_t index) {
+    Rm_Link *link = context;
+    Rm_Link_Module *module = &link->modules[index];
+    const Rm_Object *object = &module->object;
+
+    Inst *insts = link->program + module->base;
+    memcpy(insts, object->insts, sizeof(insts[0]) * object->insts_size);
+
+    for(uint64_t i = 0; i < object->relocations_count; ++i) {
+	const Rm_Object_Relocation *relocation = &object->relocations[i];
+	Word *operand = &insts[relocation->addr].inst_operand;
+	if(relocation->kind == RM_RELOC_BASE) {
+	    operand->as_u64 += module->base;
+	    continue;
+	}
+
+	String_View name = rm_object_name(object, relocation->name_offset, relocation->name_size);
+	const Rm_Link_Symbol *symbol = rm_link_symbol_slot(link, name);
+	if(symbol->name.count == 0) {
+	    if(module->unresolved.count == 0) {
+		module->unresolved = name;
+	    }
+	    continue;
+	}
+	*operand = symbol->value;
+    }
+}
+
+// * Link the objects in the given order, execution starts at the first
+// * instruction of the first one. Loading and relocating run on
+// * threads_count threads, the symbol table is built in between.
+void rm_link(Rm_Link *link, const char **inputs, size_t count, size_t threads_count) {
+    memset(link, 0, sizeof(*link));
+    link->modules_size = count;
+    link->modules = calloc(count + 1, sizeof(link->modules[0]));
+    if(link->modules == NULL) {
+	fprintf(stderr, "ERROR: could not allocate %zu modules\n", count);
+	exit(1);
+    }
+    for(size_t i = 0; i < count; ++i) {
+	link->modules[i].filepath = inputs[i];
+    }
+
+    rm_parallel_for(count, threads_count, rm_link_load_module, link);
+
+    uint64_t base = 0;
+    size_t symbols_count = 0;
+    for(size_t i = 0; i < count; ++i) {
+	const Rm_Object *object = &link->modules[i].object;
+	if(object->insts_size > UINT64_MAX / sizeof(Inst) - base) {
+	    fprintf(stderr, "ERROR: the linked program is too big\n");
+	    exit(1);
+	}
+	link->modules[i].base = base;
+	base += object->insts_size;
+	symbols_count += object->symbols_count;
+    }
+    link->program_size = base;
+
+    link->symbols_capacity = 16;
+    while(link->symbols_capacity < symbols_count * 2) {
+	link->symbols_capacity *= 2;
+    }
+    link->symbols = calloc(link->symbols_capacity, sizeof(link->symbols[0]));
+    if(link->symbols == NULL) {
+	fprintf(stderr, "ERROR: could not allocate %zu symbols\n", link->symbols_capacity);
+	exit(1);
+    }
+
+    for(size_t i = 0; i < count; ++i) {
+	const Rm_Link_Module *module = &link->modules[i];
+	for(uint64_t j = 0; j < module->object.symbols_count; ++j) {
+	    const Rm_Object_Symbol *exported = &module->object.symbols[j];
+	    String_View name = rm_object_name(&module->object, exported->name_offset, exported->name_size);
+	    Rm_Link_Symbol *symbol = rm_link_symbol_slot(link, name);
+	    if(symbol->name.count > 0) {
+		fprintf(stderr, "ERROR: symbol `"SV_Fmt"` is exported by both %s and %s\n",
+			SV_Arg(name), link->modules[symbol->module].filepath, module->filepath);
+		exit(1);
+	    }
+
+	    Word value = exported->value;
+	    if(exported->kind == BINDING_LABEL) {
+		value.as_u64 += module->base;
+	    }
+	    *symbol = (Rm_Link_Symbol) {
+		.name = name,
+		.value = value,
+		.module = i,
+	    };
+	}
+    }
+
+    link->program = malloc(sizeof(link->program[0]) * (link->program_size + 1));
+    if(link->program == NULL) {
+	fprintf(stderr, "ERROR: could not allocate %"PRIu64" instructions\n", link->program_size);
+	exit(1);
+    }
+    rm_parallel_for(count, threads_count, rm_link_relocate_module, link);
+
+    bool unresolved = false;
+    for(size_t i = 0; i < count; ++i) {
+	if(link->modules[i].unresolved.count > 0) {
+	    fprintf(stderr, "%s ERROR: unknown binding `"SV_Fmt"`\n",
+		    link->modules[i].filepath, SV_Arg(link->modules[i].unresolved));
+	    unresolved = true;
+	}
+    }
+    if(unresolved) {
+	exit(1);
+    }
+}
+
+void rm_link_free(Rm_Link *link) {
+    for(size_t i = 0; i < link->modules_size; ++i) {
+	rm_unload_object(&link->modules[i].object);
+    }
+    free(link->modules);
+    free(link->symbols);
+    free(link->program);
+    memset(link, 0, sizeof(*link));
+}
+
+#endif // RM_LINK_IMPLEMENTATION
@@ -0,0 +1,215 @@
+#ifndef RM_PROF_H_
+#define RM_PROF_H_
+
+// * Execution profiler behind `rme -prof`. Programs run through a loop of
+// * its own around rm_execute_inst, so the regular engines don't pay
+// * anything for it. Needs rasm.h included first.
+
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define RM_PROF_RDTSC
+#define RM_PROF_TICK_UNIT "cycles"
+#else
+#define RM_PROF_TICK_UNIT "ns"
+#endif
+
+// * One instruction out of every RM_PROF_SAMPLE_PERIOD gets timed
+#define RM_PROF_SAMPLE_PERIOD 64
+
+typedef struct {
+    uint64_t executed;
+    uint64_t elapsed_ns;
+
+    // * Per Inst_Type. Ticks are rdtsc cycles where available, nanoseconds
+    // * otherwise, summed over the sampled instructions only.
+    uint64_t inst_counts[INST_TYPES_COUNT];
+    uint64_t inst_samples[INST_TYPES_COUNT];
+    uint64_t inst_ticks[INST_TYPES_COUNT];
+
+    // * Per instruction address. `taken` only moves for conditional jumps,
+    // * the rest of their executions fell through.
+    uint64_t insts_size;
+    uint64_t *addr_counts;
+    uint64_t *taken;
+} Rm_Profile;
+
+void rm_profile_init(Rm_Profile *profile, const Rm_Program *program);
+void rm_profile_free(Rm_Profile *profile);
+Err rm_execute_program_profiled(Rm *rm, int limit, Rm_Profile *profile);
+void rm_profile_report(FILE *stream, const Rm_Profile *profile, const Rm_Program *program);
+void rm_profile_dump(FILE *stream, const Rm_Profile *profile, const Rm_Program *program);
+
+#endif // RM_PROF_H_
+
+#ifdef RM_PROF_IMPLEMENTATION
+
+static uint64_t rm_prof_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t rm_prof_ticks(void) {
+#ifdef RM_PROF_RDTSC
+    return (uint64_t)__rdtsc();
+#else
+    return rm_prof_now_ns();
+#endif
+}
+
+static bool rm_prof_is_branch(Inst_Type type) {
+    return inst_operand_kind(type) == INST_OPERAND_LABEL && type != INST_JMP;
+}
+
+void rm_profile_init(Rm_Profile *profile, const Rm_Program *program) {
+    memset(profile, 0, sizeof(*profile));
+    profile->insts_size = program->insts_size;
+    profile->addr_counts = calloc(program->insts_size + 1, sizeof(profile->addr_counts[0]));
+    profile->taken = calloc(program->insts_size + 1, sizeof(profile->taken[0]));
+    if(profile->addr_counts == NULL || profile->taken == NULL) {
+	fprintf(stderr, "ERROR: could not allocate the profile of %"PRIu64" instructions\n",
+		program->insts_size);
+	exit(1);
+    }
+}
+
+void rm_profile_free(Rm_Profile *profile) {
+    free(profile->addr_counts);
+    free(profile->taken);
+    memset(profile, 0, sizeof(*profile));
+}
+
+// * Same semantics as rm_execute_program on the checked switch engine.
+// * Counts are only taken for instructions that executed without an error.
+// * A conditional jump to the very next instruction counts as not taken.
+Err rm_execute_program_profiled(Rm *rm, int limit, Rm_Profile *profile) {
+    // * What reading the clock twice costs, taken off every sample
+    uint64_t overhead = UINT64_MAX;
+    for(int i = 0; i < 16; ++i) {
+	uint64_t start = rm_prof_ticks();
+	uint64_t ticks = rm_prof_ticks() - start;
+	if(ticks < overhead) overhead = ticks;
+    }
+
+    const uint64_t started_ns = rm_prof_now_ns();
+    uint64_t until_sample = 0;
+    Err err = ERR_OK;
+    while(limit != 0 && !rm->halt) {
+	const Inst_Addr addr = rm->ip;
+	const Inst_Type type = addr < rm->program->insts_size
+	    ? rm->program->insts[addr].inst_type
+	    : INST_NOP;
+
+	if(until_sample == 0) {
+	    uint64_t start = rm_prof_ticks();
+	    err = rm_execute_inst(rm);
+	    uint64_t ticks = rm_prof_ticks() - start;
+	    if(err != ERR_OK) break;
+	    profile->inst_samples[type] += 1;
+	    profile->inst_ticks[type] += ticks > overhead ? ticks - overhead : 0;
+	    until_sample = RM_PROF_SAMPLE_PERIOD;
+	} else {
+	    err = rm_execute_inst(rm);
+	    if(err != ERR_OK) break;
+	}
+	until_sample -= 1;
+
+	profile->executed += 1;
+	profile->inst_counts[type] += 1;
+	profile->addr_counts[addr] += 1;
+	if(rm_prof_is_branch(type) && rm->ip != addr + 1) {
+	    profile->taken[addr] += 1;
+	}
+
+	if(limit > 0) {
+	    --limit;
+	}
+    }
+    profile->elapsed_ns += rm_prof_now_ns() - started_ns;
+    return err;
+}
+
+// * Human readable report: opcodes by execution count, then the derasm
+// * listing with the count of every instruction next to it
+void rm_profile_report(FILE *stream, const Rm_Profile *profile, const Rm_Program *program) {
+    fprintf(stream, "Profile: %"PRIu64" instructions in %.3f ms\n",
+	    profile->executed, (double)profile->elapsed_ns / 1e6);
+
+    Inst_Type order[INST_TYPES_COUNT];
+    for(size_t i = 0; i < INST_TYPES_COUNT; ++i) {
+	order[i] = (Inst_Type)i;
+    }
+    for(size_t i = 1; i < INST_TYPES_COUNT; ++i) {
+	Inst_Type type = order[i];
+	size_t j = i;
+	while(j > 0 && profile->inst_counts[order[j - 1]] < profile->inst_counts[type]) {
+	    order[j] = order[j - 1];
+	    j -= 1;
+	}
+	order[j] = type;
+    }
+
+    fprintf(stream, "\n%-12s %14s %7s %14s\n", "opcode", "count", "%", RM_PROF_TICK_UNIT"/inst");
+    for(size_t i = 0; i < INST_TYPES_COUNT; ++i) {
+	Inst_Type type = order[i];
+	uint64_t count = profile->inst_counts[type];
+	if(count == 0) {
+	    break;
+	}
+	fprintf(stream, "%-12s %14"PRIu64" %6.2f%%", inst_as_cstr(type), count,
+		100.0 * (double)count / (double)profile->executed);
+	if(profile->inst_samples[type] > 0) {
+	    fprintf(stream, " %14.1f\n",
+		    (double)profile->inst_ticks[type] / (double)profile->inst_samples[type]);
+	} else {
+	    fprintf(stream, " %14s\n", "-");
+	}
+    }
+
+    fprintf(stream, "\n%14s %12s %12s  listing\n", "count", "taken", "not taken");
+    fprintf(stream, "%14s %12s %12s  main: \n", "", "", "");
+    for(uint64_t i = 0; i < program->insts_size; ++i) {
+	Inst inst = program->insts[i];
+	uint64_t count = profile->addr_counts[i];
+	fprintf(stream, "%14"PRIu64" ", count);
+	if(rm_prof_is_branch(inst.inst_type)) {
+	    fprintf(stream, "%12"PRIu64" %12"PRIu64"", profile->taken[i], count - profile->taken[i]);
+	} else {
+	    fprintf(stream, "%12s %12s", "", "");
+	}
+	fprintf(stream, "      %s", inst_as_cstr(inst.inst_type));
+	if(inst_has_operand(inst.inst_type)) {
+	    fprintf(stream, " %"PRIu64"", inst.inst_operand.as_u64);
+	}
+	fprintf(stream, "\n");
+    }
+}
+
+// * Machine readable CSV: a `total` row, an `opcode` row per Inst_Type and
+// * an `addr` row per instruction
+void rm_profile_dump(FILE *stream, const Rm_Profile *profile, const Rm_Program *program) {
+    fprintf(stream, "# total,executed,elapsed_ns,tick_unit,sample_period\n");
+    fprintf(stream, "total,%"PRIu64",%"PRIu64",%s,%d\n",
+	    profile->executed, profile->elapsed_ns, RM_PROF_TICK_UNIT, RM_PROF_SAMPLE_PERIOD);
+
+    fprintf(stream, "# opcode,mnemonic,count,samples,ticks\n");
+    for(size_t i = 0; i < INST_TYPES_COUNT; ++i) {
+	fprintf(stream, "opcode,%s,%"PRIu64",%"PRIu64",%"PRIu64"\n",
+		inst_as_cstr((Inst_Type)i), profile->inst_counts[i],
+		profile->inst_samples[i], profile->inst_ticks[i]);
+    }
+
+    fprintf(stream, "# addr,address,mnemonic,operand,count,taken,not_taken\n");
+    for(uint64_t i = 0; i < program->insts_size; ++i) {
+	Inst inst = program->insts[i];
+	uint64_t taken = profile->taken[i];
+	uint64_t not_taken = rm_prof_is_branch(inst.inst_type) ? profile->addr_counts[i] - taken : 0;
+	fprintf(stream, "addr,%"PRIu64",%s,%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64"\n",
+		i, inst_as_cstr(inst.inst_type), inst.inst_operand.as_u64,
+		profile->addr_counts[i], taken, not_taken);
+    }
+}
+
+#endif // RM_PROF_IMPLEMENTATION
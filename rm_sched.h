@@ -0,0 +1,216 @@
+#ifndef RM_SCHED_H_
+#define RM_SCHED_H_
+
+// * Cooperative scheduler running many programs as fibers inside of a
+// * single VM. Needs rasm.h included first and linking with -pthread.
+
+#include <pthread.h>
+
+// * A program running on a scheduler. The memory is owned by the caller
+// * and has to stay put until the fiber exits.
+typedef struct Rm_Fiber Rm_Fiber;
+struct Rm_Fiber {
+    const Rm_Program *program;
+    // * Instructions left to run, negative runs until halt
+    int limit;
+    void *data;
+
+    // * Machine state while the fiber is switched out. Only the live part
+    // * of the stack is kept, so a parked fiber costs a few words.
+    uint64_t ip;
+    bool halt;
+    int64_t *stack;
+    uint64_t stack_size;
+    uint64_t stack_capacity;
+
+    // * The error the fiber stopped with, set when it exits
+    Err err;
+    Rm_Fiber *next;
+};
+
+// * Called when a fiber halts, fails or runs out of its limit, with its
+// * state still loaded in rm. The fiber isn't touched by the scheduler
+// * after that.
+typedef void (*Rm_Fiber_Exit)(Rm_Fiber *fiber, const Rm *rm, void *context);
+
+typedef struct {
+    Rm_Engine engine;
+    // * Instructions a fiber runs before the next one gets its turn
+    int slice;
+    Rm_Fiber_Exit on_exit;
+    void *context;
+
+    // * Every fiber runs on this VM, the state of `loaded` is in it
+    Rm rm;
+    Rm_Fiber *loaded;
+
+    // * Run queue, fibers are popped from the head and go back to the tail
+    Rm_Fiber *head;
+    Rm_Fiber *tail;
+    size_t fibers_size;
+    uint64_t switches;
+} Rm_Sched;
+
+void rm_sched_init(Rm_Sched *sched, Rm_Engine engine, int slice, uint64_t stack_capacity);
+void rm_sched_spawn(Rm_Sched *sched, Rm_Fiber *fiber, const Rm_Program *program, int limit);
+void rm_sched_run(Rm_Sched *sched);
+void rm_sched_run_parallel(Rm_Sched *scheds, size_t scheds_size);
+void rm_sched_free(Rm_Sched *sched);
+
+#endif // RM_SCHED_H_
+
+#ifdef RM_SCHED_IMPLEMENTATION
+
+// * Every fiber gets a stack of `stack_capacity` values, they all share
+// * the one of sched->rm and only the live values are copied on a switch
+void rm_sched_init(Rm_Sched *sched, Rm_Engine engine, int slice, uint64_t stack_capacity) {
+    if(slice <= 0) {
+	fprintf(stderr, "ERROR: the time slice of a scheduler must be a positive number of instructions\n");
+	exit(1);
+    }
+    memset(sched, 0, sizeof(*sched));
+    sched->engine = engine;
+    sched->slice = slice;
+    rm_alloc_stack(&sched->rm, stack_capacity);
+}
+
+void rm_sched_spawn(Rm_Sched *sched, Rm_Fiber *fiber, const Rm_Program *program, int limit) {
+    void *data = fiber->data;
+    memset(fiber, 0, sizeof(*fiber));
+    fiber->program = program;
+    fiber->limit = limit < 0 ? -1 : limit;
+    fiber->data = data;
+
+    if(sched->tail != NULL) {
+	sched->tail->next = fiber;
+    } else {
+	sched->head = fiber;
+    }
+    sched->tail = fiber;
+    sched->fibers_size += 1;
+}
+
+static void rm_sched_save(Rm_Sched *sched, Rm_Fiber *fiber) {
+    const Rm *rm = &sched->rm;
+    if(rm->rm_stack_size > fiber->stack_capacity) {
+	uint64_t capacity = fiber->stack_capacity == 0 ? 8 : fiber->stack_capacity;
+	while(capacity < rm->rm_stack_size) capacity *= 2;
+	fiber->stack = realloc(fiber->stack, sizeof(fiber->stack[0]) * capacity);
+	if(fiber->stack == NULL) {
+	    fprintf(stderr, "ERROR: could not save a fiber stack of %"PRIu64" values\n", rm->rm_stack_size);
+	    exit(1);
+	}
+	fiber->stack_capacity = capacity;
+    }
+    memcpy(fiber->stack, rm->stack, sizeof(rm->stack[0]) * rm->rm_stack_size);
+    fiber->stack_size = rm->rm_stack_size;
+    fiber->ip = rm->ip;
+    fiber->halt = rm->halt;
+}
+
+static void rm_sched_restore(Rm_Sched *sched, const Rm_Fiber *fiber) {
+    Rm *rm = &sched->rm;
+    memcpy(rm->stack, fiber->stack, sizeof(rm->stack[0]) * fiber->stack_size);
+    rm->rm_stack_size = fiber->stack_size;
+    rm->ip = fiber->ip;
+    rm->halt = fiber->halt;
+    rm->program = fiber->program;
+}
+
+// * Round robin until every fiber exited. A fiber that goes back into
+// * an otherwise empty queue keeps running without a switch.
+void rm_sched_run(Rm_Sched *sched) {
+    while(sched->head != NULL) {
+	Rm_Fiber *fiber = sched->head;
+	sched->head = fiber->next;
+	if(sched->head == NULL) sched->tail = NULL;
+	fiber->next = NULL;
+
+	// * The state of the previous fiber stays in the VM until another
+	// * one needs it
+	if(sched->loaded != fiber) {
+	    if(sched->loaded != NULL) {
+		rm_sched_save(sched, sched->loaded);
+	    }
+	    rm_sched_restore(sched, fiber);
+	    sched->loaded = fiber;
+	    sched->switches += 1;
+	}
+
+	// * Out of budget the engines stop after exactly `slice` instructions
+	int slice = sched->slice;
+	if(fiber->limit >= 0 && fiber->limit < slice) {
+	    slice = fiber->limit;
+	}
+	Err err = rm_execute_program_with(&sched->rm, sched->engine, slice);
+	if(fiber->limit >= 0) {
+	    fiber->limit -= slice;
+	}
+
+	if(err != ERR_OK || sched->rm.halt || fiber->limit == 0) {
+	    fiber->err = err;
+	    free(fiber->stack);
+	    fiber->stack = NULL;
+	    fiber->stack_size = 0;
+	    fiber->stack_capacity = 0;
+	    sched->loaded = NULL;
+	    sched->fibers_size -= 1;
+	    if(sched->on_exit != NULL) {
+		sched->on_exit(fiber, &sched->rm, sched->context);
+	    }
+	    continue;
+	}
+
+	if(sched->tail != NULL) {
+	    sched->tail->next = fiber;
+	} else {
+	    sched->head = fiber;
+	}
+	sched->tail = fiber;
+    }
+}
+
+static void *rm_sched_thread(void *arg) {
+    rm_sched_run(arg);
+    return NULL;
+}
+
+// * One thread per scheduler, the calling thread runs the first one.
+// * Fibers never move between schedulers.
+void rm_sched_run_parallel(Rm_Sched *scheds, size_t scheds_size) {
+    if(scheds_size == 0) return;
+
+    pthread_t *threads = malloc(sizeof(threads[0]) * scheds_size);
+    if(threads == NULL) {
+	fprintf(stderr, "ERROR: could not allocate %zu scheduler threads\n", scheds_size);
+	exit(1);
+    }
+    for(size_t i = 1; i < scheds_size; ++i) {
+	int err = pthread_create(&threads[i], NULL, rm_sched_thread, &scheds[i]);
+	if(err != 0) {
+	    fprintf(stderr, "ERROR: could not start scheduler thread: %s\n", strerror(err));
+	    exit(1);
+	}
+    }
+    rm_sched_run(&scheds[0]);
+    for(size_t i = 1; i < scheds_size; ++i) {
+	pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+// * Fibers that are still queued are dropped without calling on_exit
+void rm_sched_free(Rm_Sched *sched) {
+    for(Rm_Fiber *fiber = sched->head; fiber != NULL; fiber = fiber->next) {
+	free(fiber->stack);
+	fiber->stack = NULL;
+	fiber->stack_capacity = 0;
+    }
+    rm_free_stack(&sched->rm);
+    sched->head = NULL;
+    sched->tail = NULL;
+    sched->loaded = NULL;
+    sched->fibers_size = 0;
+}
+
+#endif // RM_SCHED_IMPLEMENTATION
@@ -0,0 +1,223 @@
+#ifndef RM_TRACE_H_
+#define RM_TRACE_H_
+
+// * Execution trace behind `rme -trace`. Every executed instruction is
+// * recorded into a fixed-size ring buffer, the last ones are written to a
+// * binary file when the program halts, fails or gets a fatal signal, and
+// * rtrace decodes it. Needs rasm.h included first, POSIX only.
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define RM_TRACE_MAGIC 0x5452 // "RT" in little endian
+#define RM_TRACE_VERSION 1
+#define RM_TRACE_DEFAULT_CAPACITY (64 * 1024)
+// * Largest ring buffer, a power of two so rounding up can't go past it
+#define RM_TRACE_MAX_CAPACITY ((uint64_t)1 << 30)
+
+// * inst_type of a record whose ip was outside of the program
+#define RM_TRACE_OUT_OF_PROGRAM INST_TYPES_COUNT
+
+// * Machine state right before the instruction executed
+typedef struct {
+    uint64_t ip;
+    Word operand;
+    int64_t top;
+    uint32_t depth;
+    uint32_t inst_type;
+} Rm_Trace_Record;
+
+// * Header of a trace file, followed by records_count records oldest first
+typedef struct {
+    uint16_t magic;
+    uint16_t version;
+    uint32_t record_size;
+    uint64_t executed;
+    uint64_t records_count;
+    uint32_t err;
+    uint32_t signal;
+} Rm_Trace_Meta;
+
+typedef struct {
+    Rm_Trace_Record *records;
+    uint64_t capacity;
+    uint64_t executed;
+} Rm_Trace;
+
+void rm_trace_init(Rm_Trace *trace, uint64_t capacity);
+void rm_trace_free(Rm_Trace *trace);
+Err rm_execute_program_traced(Rm *rm, int limit, Rm_Trace *trace);
+bool rm_trace_write(int fd, const Rm_Trace *trace, Err err, int signum);
+void rm_trace_save(const Rm_Trace *trace, const char *filepath, Err err);
+void rm_trace_save_on_signal(const Rm_Trace *trace, const char *filepath);
+Rm_Trace_Record *rm_trace_load(Rm_Trace_Meta *meta, const char *filepath);
+
+#endif // RM_TRACE_H_
+
+#ifdef RM_TRACE_IMPLEMENTATION
+
+// * The capacity is rounded up to a power of two so the ring index is a mask
+void rm_trace_init(Rm_Trace *trace, uint64_t capacity) {
+    if(capacity == 0 || capacity > RM_TRACE_MAX_CAPACITY) {
+	fprintf(stderr, "ERROR: trace size must be between 1 and %"PRIu64" records\n", RM_TRACE_MAX_CAPACITY);
+	exit(1);
+    }
+    memset(trace, 0, sizeof(*trace));
+    trace->capacity = 1;
+    while(trace->capacity < capacity) {
+	trace->capacity *= 2;
+    }
+    trace->records = malloc(sizeof(trace->records[0]) * trace->capacity);
+    if(trace->records == NULL) {
+	fprintf(stderr, "ERROR: could not allocate a trace of %"PRIu64" records\n", trace->capacity);
+	exit(1);
+    }
+}
+
+void rm_trace_free(Rm_Trace *trace) {
+    free(trace->records);
+    memset(trace, 0, sizeof(*trace));
+}
+
+// * Same semantics as rm_execute_program on the checked switch engine.
+// * The instruction that failed is the last record of the trace.
+Err rm_execute_program_traced(Rm *rm, int limit, Rm_Trace *trace) {
+    const uint64_t mask = trace->capacity - 1;
+    const Rm_Program *program = rm->program;
+    while(limit != 0 && !rm->halt) {
+	Rm_Trace_Record *record = &trace->records[trace->executed & mask];
+	record->ip = rm->ip;
+	record->depth = (uint32_t)rm->rm_stack_size;
+	record->top = rm->rm_stack_size > 0 ? rm->stack[rm->rm_stack_size - 1] : 0;
+	if(rm->ip < program->insts_size) {
+	    record->inst_type = program->insts[rm->ip].inst_type;
+	    record->operand = program->insts[rm->ip].inst_operand;
+	} else {
+	    record->inst_type = RM_TRACE_OUT_OF_PROGRAM;
+	    record->operand.as_u64 = 0;
+	}
+	trace->executed += 1;
+
+	Err err = rm_execute_inst(rm);
+	if(err != ERR_OK) {
+	    return err;
+	}
+	if(limit > 0) {
+	    --limit;
+	}
+    }
+    return ERR_OK;
+}
+
+static bool rm_trace_write_all(int fd, const void *data, size_t size) {
+    const char *bytes = data;
+    while(size > 0) {
+	ssize_t n = write(fd, bytes, size);
+	if(n < 0) {
+	    if(errno == EINTR) continue;
+	    return false;
+	}
+	bytes += n;
+	size -= (size_t)n;
+    }
+    return true;
+}
+
+// * Only write(2) on memory that is already there, so it can run from a
+// * signal handler. A signal landing in the middle of a record leaves
+// * that one record half written.
+bool rm_trace_write(int fd, const Rm_Trace *trace, Err err, int signum) {
+    const uint64_t count = trace->executed < trace->capacity ? trace->executed : trace->capacity;
+    const uint64_t first = (trace->executed - count) & (trace->capacity - 1);
+    Rm_Trace_Meta meta = {
+	.magic = RM_TRACE_MAGIC,
+	.version = RM_TRACE_VERSION,
+	.record_size = sizeof(Rm_Trace_Record),
+	.executed = trace->executed,
+	.records_count = count,
+	.err = (uint32_t)err,
+	.signal = (uint32_t)signum,
+    };
+
+    // * The oldest records sit right after the newest one in the ring
+    const uint64_t tail = count < trace->capacity - first ? count : trace->capacity - first;
+    return rm_trace_write_all(fd, &meta, sizeof(meta))
+	&& rm_trace_write_all(fd, trace->records + first, sizeof(Rm_Trace_Record) * tail)
+	&& rm_trace_write_all(fd, trace->records, sizeof(Rm_Trace_Record) * (count - tail));
+}
+
+void rm_trace_save(const Rm_Trace *trace, const char *filepath, Err err) {
+    int fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0 || !rm_trace_write(fd, trace, err, 0)) {
+	fprintf(stderr, "ERROR: could not write trace `%s`: %s\n", filepath, strerror(errno));
+	exit(1);
+    }
+    close(fd);
+}
+
+static const Rm_Trace *rm_trace_signal_trace = NULL;
+static const char *rm_trace_signal_filepath = NULL;
+
+static void rm_trace_signal_handler(int signum) {
+    int fd = open(rm_trace_signal_filepath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd >= 0) {
+	rm_trace_write(fd, rm_trace_signal_trace, ERR_OK, signum);
+	close(fd);
+    }
+    _exit(128 + signum);
+}
+
+// * Flush the trace to filepath and exit when the process gets killed or
+// * crashes. Both pointers have to stay valid until the end of the run.
+void rm_trace_save_on_signal(const Rm_Trace *trace, const char *filepath) {
+    rm_trace_signal_trace = trace;
+    rm_trace_signal_filepath = filepath;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = rm_trace_signal_handler;
+    sigemptyset(&action.sa_mask);
+    const int signals[] = { SIGINT, SIGTERM, SIGHUP, SIGSEGV, SIGBUS, SIGFPE, SIGABRT };
+    for(size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); ++i) {
+	sigaction(signals[i], &action, NULL);
+    }
+}
+
+// * Records of a trace file, oldest first, in a buffer owned by the caller
+Rm_Trace_Record *rm_trace_load(Rm_Trace_Meta *meta, const char *filepath) {
+    Rm_File_View view = rm_open_file_view(filepath);
+    if(view.size < sizeof(*meta)) {
+	fprintf(stderr, "ERROR: could not read trace meta `%s`\n", filepath);
+	exit(1);
+    }
+    memcpy(meta, view.data, sizeof(*meta));
+    if(meta->magic != RM_TRACE_MAGIC) {
+	fprintf(stderr,
+		"ERROR: %s does not appear to be a valid trace file. "
+		"Unexpected magic %04X. Expected %04X\n",
+		filepath, meta->magic, RM_TRACE_MAGIC);
+	exit(1);
+    }
+    if(meta->version != RM_TRACE_VERSION || meta->record_size != sizeof(Rm_Trace_Record)) {
+	fprintf(stderr, "ERROR: %s: unsupported trace version %u with %u byte records\n",
+		filepath, meta->version, meta->record_size);
+	exit(1);
+    }
+    if(meta->records_count > (view.size - sizeof(*meta)) / sizeof(Rm_Trace_Record)) {
+	fprintf(stderr, "ERROR: %s: expected %"PRIu64" records, the file is truncated\n",
+		filepath, meta->records_count);
+	exit(1);
+    }
+
+    Rm_Trace_Record *records = malloc(sizeof(records[0]) * (meta->records_count + 1));
+    if(records == NULL) {
+	fprintf(stderr, "ERROR: could not allocate %"PRIu64" trace records\n", meta->records_count);
+	exit(1);
+    }
+    memcpy(records, view.data + sizeof(*meta), sizeof(records[0]) * meta->records_count);
+    rm_close_file_view(&view);
+    return records;
+}
+
+#endif // RM_TRACE_IMPLEMENTATION
@@ -1,8 +1,21 @@
 #define SV_IMPLEMENTATION
 #define RM_IMPLEMENTATION
+#define RM_BATCH_IMPLEMENTATION
+#define RM_SCHED_IMPLEMENTATION
+#define RM_LANES_IMPLEMENTATION
+#define RM_PROF_IMPLEMENTATION
+#define RM_TRACE_IMPLEMENTATION
+
+#include <limits.h>
+#include <unistd.h>
 
 #include "./sv.h"
 #include "./rasm.h"
+#include "./rm_batch.h"
+#include "./rm_sched.h"
+#include "./rm_lanes.h"
+#include "./rm_prof.h"
+#include "./rm_trace.h"
 
 static const char* shift(int *argc, char ***argv) {
     if(*argc < 0) return NULL;
@@ -13,26 +26,376 @@ static const char* shift(int *argc, char ***argv) {
 }
 
 static void usage(void) {
-    fprintf(stdout, "Usage: ./rme -i [file.rm]\n");
+    fprintf(stdout, "Usage: ./rme -i [file.rm] [-d] [-prof] [-trace file.rmt [-trace-size records]] [-lanes inputs] [-limit n] [-stack n] [-e switch|threaded|jit|tos] [-jit]\n");
+    fprintf(stdout, "       ./rme -batch [manifest] [-j threads] [-slice n] [-limit n] [-stack n] [-e switch|threaded|jit|tos] [-jit]\n");
+    fprintf(stdout, "    -limit    stop after n instructions, negative runs until halt (default)\n");
+    fprintf(stdout, "    -stack    size of the VM stack in values (default %d)\n", RM_STACK_CAPACITY);
+    fprintf(stdout, "    -batch    run every `file.rm [runs]` line of manifest, output in manifest order\n");
+    fprintf(stdout, "    -slice    with -batch, run every line as a fiber and switch to the next one every n instructions\n");
+    fprintf(stdout, "    -lanes    run the program once for every line of inputs, the line is its initial stack\n");
+    fprintf(stdout, "    -prof     count every opcode, address and branch, report them and dump file.rm.prof\n");
+    fprintf(stdout, "    -trace    record the last executed instructions, saved on halt, error or fatal signal, see rtrace\n");
+}
+
+// * Programs of a batch, every distinct file is loaded only once
+typedef struct {
+    char *path;
+    Rm_Program *program;
+} Batch_Program;
+
+static Batch_Program *batch_programs = NULL;
+static size_t batch_programs_size = 0;
+static size_t batch_programs_capacity = 0;
+
+static const Rm_Program *batch_load_program(const char *path, Rm_Engine *engine) {
+    for(size_t i = 0; i < batch_programs_size; ++i) {
+	if(strcmp(batch_programs[i].path, path) == 0) {
+	    return batch_programs[i].program;
+	}
+    }
+
+    if(batch_programs_size >= batch_programs_capacity) {
+	batch_programs_capacity = batch_programs_capacity == 0 ? 64 : batch_programs_capacity * 2;
+	batch_programs = realloc(batch_programs, sizeof(batch_programs[0]) * batch_programs_capacity);
+	assert(batch_programs != NULL);
+    }
+
+    Rm_Program *program = malloc(sizeof(*program));
+    assert(program != NULL);
+    memset(program, 0, sizeof(*program));
+    rm_load_program_from_file(program, path);
+    if(*engine == RM_ENGINE_JIT && !rm_prepare_jit(program)) {
+	fprintf(stderr, "WARNING: JIT is not available, falling back to the switch engine\n");
+	*engine = RM_ENGINE_SWITCH;
+    }
+
+    batch_programs[batch_programs_size].path = strdup(path);
+    batch_programs[batch_programs_size].program = program;
+    batch_programs_size += 1;
+    return program;
+}
+
+static void fiber_exit(Rm_Fiber *fiber, const Rm *rm, void *context) {
+    (void) context;
+    Rm_Batch_Task *task = fiber->data;
+    task->err = fiber->err;
+    FILE *out = open_memstream(&task->output, &task->output_size);
+    if(out == NULL) {
+	fprintf(stderr, "ERROR: could not allocate batch output: %s\n", strerror(errno));
+	exit(1);
+    }
+    rm_dump_result(out, rm, task->err);
+    fclose(out);
+}
+
+// * Every task becomes a fiber, dealt round robin to one scheduler per thread
+static void run_fibers(Rm_Batch_Task *tasks, size_t tasks_size, size_t threads_count, int slice) {
+    if(tasks_size == 0) return;
+    if(threads_count > tasks_size) threads_count = tasks_size;
+
+    Rm_Sched *scheds = malloc(sizeof(scheds[0]) * threads_count);
+    Rm_Fiber *fibers = calloc(tasks_size, sizeof(fibers[0]));
+    if(scheds == NULL || fibers == NULL) {
+	fprintf(stderr, "ERROR: could not allocate %zu fibers\n", tasks_size);
+	exit(1);
+    }
+    for(size_t i = 0; i < threads_count; ++i) {
+	rm_sched_init(&scheds[i], tasks[0].engine, slice, tasks[0].stack_capacity);
+	scheds[i].on_exit = fiber_exit;
+    }
+    for(size_t i = 0; i < tasks_size; ++i) {
+	fibers[i].data = &tasks[i];
+	rm_sched_spawn(&scheds[i % threads_count], &fibers[i], tasks[i].program, tasks[i].limit);
+    }
+
+    rm_sched_run_parallel(scheds, threads_count);
+
+    for(size_t i = 0; i < threads_count; ++i) {
+	rm_sched_free(&scheds[i]);
+    }
+    free(fibers);
+    free(scheds);
+}
+
+// * Every non empty line of the manifest is `file.rm [runs]`, `#` starts a comment
+static int run_batch(const char *manifest_file, Rm_Engine engine, int limit, uint64_t stack_capacity, size_t threads_count, int slice) {
+    FILE *f = fopen(manifest_file, "r");
+    if(f == NULL) {
+	fprintf(stderr, "ERROR: could not open file `%s`: %s\n", manifest_file, strerror(errno));
+	exit(1);
+    }
+
+    Rm_Batch_Task *tasks = NULL;
+    size_t tasks_size = 0;
+    size_t tasks_capacity = 0;
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    size_t line_number = 0;
+    while(getline(&line, &line_capacity, f) >= 0) {
+	line_number += 1;
+	String_View sv = SV(line);
+	sv = sv_trim(sv_chop_by_delim(&sv, '#'));
+	if(sv.count == 0) continue;
+
+	String_View path = sv_chop_by_delim(&sv, ' ');
+	String_View runs_sv = sv_trim(sv);
+
+	char path_cstr[FILENAME_MAX];
+	if(path.count >= sizeof(path_cstr)) {
+	    fprintf(stderr, "%s:%zu: ERROR: path is too long\n", manifest_file, line_number);
+	    exit(1);
+	}
+	memcpy(path_cstr, path.data, path.count);
+	path_cstr[path.count] = '\0';
+
+	size_t runs = 1;
+	if(runs_sv.count > 0) {
+	    char runs_cstr[32] = {0};
+	    char *end = NULL;
+	    memcpy(runs_cstr, runs_sv.data, runs_sv.count < sizeof(runs_cstr) - 1 ? runs_sv.count : sizeof(runs_cstr) - 1);
+	    runs = strtoul(runs_cstr, &end, 10);
+	    if(runs_sv.count >= sizeof(runs_cstr) || end == runs_cstr || *end != '\0') {
+		fprintf(stderr, "%s:%zu: ERROR: `"SV_Fmt"` is not a number of runs\n",
+			manifest_file, line_number, SV_Arg(runs_sv));
+		exit(1);
+	    }
+	}
+
+	const Rm_Program *program = batch_load_program(path_cstr, &engine);
+	for(size_t i = 0; i < runs; ++i) {
+	    if(tasks_size >= tasks_capacity) {
+		tasks_capacity = tasks_capacity == 0 ? 256 : tasks_capacity * 2;
+		tasks = realloc(tasks, sizeof(tasks[0]) * tasks_capacity);
+		assert(tasks != NULL);
+	    }
+	    tasks[tasks_size++] = (Rm_Batch_Task) {
+		.program = program,
+		.engine = engine,
+		.limit = limit,
+		.stack_capacity = stack_capacity,
+	    };
+	}
+    }
+    free(line);
+    fclose(f);
+
+    if(slice > 0) {
+	run_fibers(tasks, tasks_size, threads_count, slice);
+    } else {
+	rm_batch_run(tasks, tasks_size, threads_count);
+    }
+
+    // * Same output as running rme on every file one after another
+    for(size_t i = 0; i < tasks_size; ++i) {
+	fwrite(tasks[i].output, 1, tasks[i].output_size, stdout);
+    }
+
+    rm_batch_free(tasks, tasks_size);
+    free(tasks);
+    for(size_t i = 0; i < batch_programs_size; ++i) {
+	rm_unload_program(batch_programs[i].program);
+	free(batch_programs[i].program);
+	free(batch_programs[i].path);
+    }
+    free(batch_programs);
+    return 0;
 }
 
+// * Every non empty line of the inputs is the initial stack of one run,
+// * bottom first, `#` starts a comment
+static int run_lanes(const char *inputs_file, const Rm_Program *program, Rm_Engine engine, int limit, uint64_t stack_capacity) {
+    FILE *f = fopen(inputs_file, "r");
+    if(f == NULL) {
+	fprintf(stderr, "ERROR: could not open file `%s`: %s\n", inputs_file, strerror(errno));
+	exit(1);
+    }
+
+    // * Runs point into values only once everything is read, until then
+    // * firsts has the index of the first value of every run
+    int64_t *values = NULL;
+    size_t values_size = 0;
+    size_t values_capacity = 0;
+    Rm_Lane_Run *runs = NULL;
+    size_t runs_size = 0;
+    size_t runs_capacity = 0;
+    size_t *firsts = NULL;
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    size_t line_number = 0;
+    while(getline(&line, &line_capacity, f) >= 0) {
+	line_number += 1;
+	String_View sv = SV(line);
+	sv = sv_trim(sv_chop_by_delim(&sv, '#'));
+	if(sv.count == 0) continue;
+
+	if(runs_size >= runs_capacity) {
+	    runs_capacity = runs_capacity == 0 ? 256 : runs_capacity * 2;
+	    runs = realloc(runs, sizeof(runs[0]) * runs_capacity);
+	    firsts = realloc(firsts, sizeof(firsts[0]) * runs_capacity);
+	    assert(runs != NULL && firsts != NULL);
+	}
+	firsts[runs_size] = values_size;
+	Rm_Lane_Run *run = &runs[runs_size++];
+	memset(run, 0, sizeof(*run));
+
+	while(sv.count > 0) {
+	    String_View token = sv_chop_by_delim(&sv, ' ');
+	    sv = sv_trim(sv);
+	    token = sv_trim(token);
+	    uint64_t value = 0;
+	    if(sv_parse_int(token, &value) != SV_INT_OK) {
+		fprintf(stderr, "%s:%zu: ERROR: `"SV_Fmt"` is not a number\n",
+			inputs_file, line_number, SV_Arg(token));
+		exit(1);
+	    }
+	    if(values_size >= values_capacity) {
+		values_capacity = values_capacity == 0 ? 1024 : values_capacity * 2;
+		values = realloc(values, sizeof(values[0]) * values_capacity);
+		assert(values != NULL);
+	    }
+	    values[values_size++] = (int64_t)value;
+	    run->values_size += 1;
+	}
+	if(run->values_size > stack_capacity) {
+	    fprintf(stderr, "%s:%zu: ERROR: %"PRIu64" values don't fit on a stack of %"PRIu64"\n",
+		    inputs_file, line_number, run->values_size, stack_capacity);
+	    exit(1);
+	}
+    }
+    free(line);
+    fclose(f);
+
+    for(size_t i = 0; i < runs_size; ++i) {
+	runs[i].values = values + firsts[i];
+    }
+
+    rm_lanes_run(program, engine, limit, stack_capacity, runs, runs_size);
+
+    // * Same output as running the program on every line one after another
+    for(size_t i = 0; i < runs_size; ++i) {
+	rm_lanes_dump_result(stdout, &runs[i]);
+    }
+
+    rm_lanes_free(runs, runs_size);
+    free(firsts);
+    free(runs);
+    free(values);
+    return 0;
+}
+
+static Rm_Program program = {0};
 static Rm rm = {0};
+static Rm_Trace trace = {0};
 
 int main(int argc, char *argv[]) {
     shift(&argc, &argv);
 
     bool debug = false;
-    int limit = 69;
+    bool profile = false;
+    const char *trace_file = NULL;
+    uint64_t trace_size = RM_TRACE_DEFAULT_CAPACITY;
+    int limit = -1;
+    int slice = 0;
+    uint64_t stack_capacity = RM_STACK_CAPACITY;
+    Rm_Engine engine = RM_ENGINE_SWITCH;
     const char *input_file = NULL;
+    const char *manifest_file = NULL;
+    const char *lanes_file = NULL;
+    long threads_count = sysconf(_SC_NPROCESSORS_ONLN);
     
     while(argc > 0) {
 	const char *arg = shift(&argc, &argv);
 	if(strcmp(arg, "-i") == 0) {
 	    input_file = shift(&argc, &argv);
 	}
+	else if(strcmp(arg, "-batch") == 0) {
+	    manifest_file = shift(&argc, &argv);
+	}
+	else if(strcmp(arg, "-lanes") == 0) {
+	    lanes_file = shift(&argc, &argv);
+	}
+	else if(strcmp(arg, "-j") == 0) {
+	    const char *count = shift(&argc, &argv);
+	    threads_count = count ? atol(count) : 0;
+	    if(threads_count <= 0) {
+		fprintf(stderr, "ERROR: `-j` expects a positive number of threads\n");
+		usage();
+		exit(1);
+	    }
+	}
+	else if(strcmp(arg, "-limit") == 0) {
+	    const char *count = shift(&argc, &argv);
+	    char *end = NULL;
+	    long value = count ? strtol(count, &end, 10) : 0;
+	    if(count == NULL || end == count || *end != '\0' || value > INT_MAX) {
+		fprintf(stderr, "ERROR: `-limit` expects a number of instructions up to %d\n", INT_MAX);
+		usage();
+		exit(1);
+	    }
+	    limit = value < 0 ? -1 : (int)value;
+	}
+	else if(strcmp(arg, "-slice") == 0) {
+	    const char *count = shift(&argc, &argv);
+	    char *end = NULL;
+	    long value = count ? strtol(count, &end, 10) : 0;
+	    if(count == NULL || end == count || *end != '\0' || value <= 0 || value > INT_MAX) {
+		fprintf(stderr, "ERROR: `-slice` expects a positive number of instructions up to %d\n", INT_MAX);
+		usage();
+		exit(1);
+	    }
+	    slice = (int)value;
+	}
+	else if(strcmp(arg, "-stack") == 0) {
+	    const char *size = shift(&argc, &argv);
+	    char *end = NULL;
+	    stack_capacity = size && size[0] != '-' ? strtoull(size, &end, 10) : 0;
+	    if(end == size || (end != NULL && *end != '\0') || stack_capacity == 0 || stack_capacity > RM_STACK_MAX_CAPACITY) {
+		fprintf(stderr, "ERROR: `-stack` expects a number of values from 1 to %d\n", RM_STACK_MAX_CAPACITY);
+		usage();
+		exit(1);
+	    }
+	}
 	else if(strcmp(arg, "-d") == 0) {
 	    debug = true;
 	}
+	else if(strcmp(arg, "-trace") == 0) {
+	    trace_file = shift(&argc, &argv);
+	    if(trace_file == NULL) {
+		fprintf(stderr, "ERROR: `-trace` expects a file to write the trace to\n");
+		usage();
+		exit(1);
+	    }
+	}
+	else if(strcmp(arg, "-trace-size") == 0) {
+	    const char *size = shift(&argc, &argv);
+	    char *end = NULL;
+	    trace_size = size && size[0] != '-' ? strtoull(size, &end, 10) : 0;
+	    if(end == size || (end != NULL && *end != '\0') || trace_size == 0 || trace_size > RM_TRACE_MAX_CAPACITY) {
+		fprintf(stderr, "ERROR: `-trace-size` expects a number of records from 1 to %"PRIu64"\n", RM_TRACE_MAX_CAPACITY);
+		usage();
+		exit(1);
+	    }
+	}
+	else if(strcmp(arg, "-prof") == 0) {
+	    profile = true;
+	}
+	else if(strcmp(arg, "-jit") == 0) {
+	    engine = RM_ENGINE_JIT;
+	}
+	else if(strcmp(arg, "-e") == 0) {
+	    const char *name = shift(&argc, &argv);
+	    if(name == NULL || !engine_from_cstr(name, &engine)) {
+		fprintf(stderr, "ERROR: unknown engine `%s`\n", name ? name : "");
+		usage();
+		exit(1);
+	    }
+	}
+    }
+
+    if(manifest_file != NULL) {
+	return run_batch(manifest_file, engine, limit, stack_capacity, threads_count > 0 ? (size_t)threads_count : 1, slice);
     }
 
     if(input_file == NULL) {
@@ -41,15 +404,58 @@ int main(int argc, char *argv[]) {
 	exit(1);
     }
 
-    // Load the program into rm->program
-    rm_load_program_from_file(&rm, input_file);
+    // Load the program and point the VM at it
+    rm_load_program_from_file(&program, input_file);
+    if(engine == RM_ENGINE_JIT && !rm_prepare_jit(&program)) {
+	fprintf(stderr, "WARNING: JIT is not available, falling back to the switch engine\n");
+	engine = RM_ENGINE_SWITCH;
+    }
+    if(lanes_file != NULL) {
+	return run_lanes(lanes_file, &program, engine, limit, stack_capacity);
+    }
+    rm_alloc_stack(&rm, stack_capacity);
+    rm_init(&rm, &program);
         
-    if(!debug) {
+    if(trace_file != NULL) {
+	// * the trace has its own loop too, whatever the engine
+	rm_trace_init(&trace, trace_size);
+	rm_trace_save_on_signal(&trace, trace_file);
+	Err err = rm_execute_program_traced(&rm, limit, &trace);
+	rm_trace_save(&trace, trace_file, err);
+	rm_dump_result(stdout, &rm, err);
+	rm_trace_free(&trace);
+    }
+    else if(profile) {
+	// * the profiler brings its own loop, whatever the engine
+	Rm_Profile prof;
+	rm_profile_init(&prof, &program);
+	Err err = rm_execute_program_profiled(&rm, limit, &prof);
+	rm_dump_result(stdout, &rm, err);
+	rm_profile_report(stdout, &prof, &program);
+
+	size_t n = strlen(input_file);
+	char *dump_file = malloc(n + sizeof(".prof"));
+	assert(dump_file != NULL);
+	memcpy(dump_file, input_file, n);
+	memcpy(dump_file + n, ".prof", sizeof(".prof"));
+	FILE *f = fopen(dump_file, "w");
+	if(f == NULL) {
+	    fprintf(stderr, "ERROR: could not open file `%s`: %s\n", dump_file, strerror(errno));
+	    exit(1);
+	}
+	rm_profile_dump(f, &prof, &program);
+	fclose(f);
+	printf("Profile written to %s\n", dump_file);
+
+	free(dump_file);
+	rm_profile_free(&prof);
+    }
+    else if(!debug) {
 	// * execute the program
-	rm_execute_program(&rm, limit);
+	Err err = rm_execute_program_with(&rm, engine, limit);
 
-	// * dump the stack
-	rm_dump_stack(stdout, &rm);
+	// * dump the error and the stack
+	rm_dump_result(stdout, &rm, err);
     }
     else {
 	// rm_dump_stack(stdout, &rm);
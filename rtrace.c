@@ -0,0 +1,88 @@
+#define SV_IMPLEMENTATION
+#define RM_IMPLEMENTATION
+#define RM_TRACE_IMPLEMENTATION
+
+#include "./sv.h"
+#include "./rasm.h"
+#include "./rm_trace.h"
+
+static const char* shift(int *argc, char ***argv) {
+    if(*argc <= 0) return NULL;
+    const char *arg = **argv;
+    *argv += 1;
+    *argc -= 1;
+    return arg;
+}
+
+static void usage(void) {
+    fprintf(stdout, "Usage: ./rtrace [-n count] [file.rmt]\n");
+    fprintf(stdout, "    -n    only print the last count instructions\n");
+}
+
+int main(int argc, char *argv[]) {
+    shift(&argc, &argv);
+
+    const char *filepath = NULL;
+    uint64_t last = UINT64_MAX;
+    while(argc > 0) {
+	const char *arg = shift(&argc, &argv);
+	if(strcmp(arg, "-n") == 0) {
+	    const char *count = shift(&argc, &argv);
+	    if(count == NULL) {
+		fprintf(stderr, "ERROR: `-n` expects a number of instructions\n");
+		usage();
+		exit(1);
+	    }
+	    last = strtoull(count, NULL, 10);
+	}
+	else {
+	    filepath = arg;
+	}
+    }
+
+    if(filepath == NULL) {
+	fprintf(stderr, "ERROR: please provide a trace file\n");
+	usage();
+	exit(1);
+    }
+
+    Rm_Trace_Meta meta;
+    Rm_Trace_Record *records = rm_trace_load(&meta, filepath);
+
+    printf("Trace: %"PRIu64" instructions executed, the last %"PRIu64" recorded\n",
+	   meta.executed, meta.records_count);
+
+    // * Sequence number of the first record over the whole run
+    uint64_t first = last < meta.records_count ? meta.records_count - last : 0;
+    uint64_t seq = meta.executed - meta.records_count + first;
+    printf("%12s %10s  %-24s %6s  %s\n", "seq", "ip", "instruction", "depth", "top");
+    for(uint64_t i = first; i < meta.records_count; ++i, ++seq) {
+	const Rm_Trace_Record *record = &records[i];
+	char inst[64];
+	if(record->inst_type == RM_TRACE_OUT_OF_PROGRAM) {
+	    snprintf(inst, sizeof(inst), "<outside of the program>");
+	} else if(inst_has_operand((Inst_Type)record->inst_type)) {
+	    snprintf(inst, sizeof(inst), "%s %"PRIu64"",
+		     inst_as_cstr((Inst_Type)record->inst_type), record->operand.as_u64);
+	} else {
+	    snprintf(inst, sizeof(inst), "%s", inst_as_cstr((Inst_Type)record->inst_type));
+	}
+
+	printf("%12"PRIu64" %10"PRIu64"  %-24s %6"PRIu32"", seq, record->ip, inst, record->depth);
+	if(record->depth > 0) {
+	    printf("  %"PRId64"", record->top);
+	}
+	printf("\n");
+    }
+
+    if(meta.signal != 0) {
+	printf("Stopped by signal %"PRIu32" (%s)\n", meta.signal, strsignal((int)meta.signal));
+    } else if(meta.err != ERR_OK) {
+	printf("Failed with %s on the last instruction\n", err_as_cstr((Err)meta.err));
+    } else {
+	printf("Finished\n");
+    }
+
+    free(records);
+    return 0;
+}
@@ -4,6 +4,13 @@
 #include<string.h>
 #include<ctype.h>
 #include<stdbool.h>
+#include<stdint.h>
+
+#if defined(__AVX2__)
+#include<immintrin.h>
+#elif defined(__SSE2__)
+#include<emmintrin.h>
+#endif
 
 typedef struct {
     size_t count;
@@ -17,6 +24,46 @@ String_View sv_trim_left(String_View sv);
 String_View sv_trim_right(String_View sv);
 String_View sv_trim(String_View sv);
 bool sv_eq(String_View a, String_View b);
+uint64_t sv_hash(String_View sv);
+
+typedef enum {
+    SV_INT_OK = 0,
+    SV_INT_INVALID,
+    SV_INT_OVERFLOW,
+} Sv_Int_Status;
+
+Sv_Int_Status sv_parse_int(String_View sv, uint64_t *output);
+
+// * Lexer over a whole buffer of lines. The input is classified 64 bytes at a
+// * time (AVX2 or SSE2 when the compiler targets them, scalar otherwise) into
+// * newline, whitespace and comment bitmasks, and lines and tokens are handed
+// * out by scanning those masks instead of the bytes.
+#define SV_SCANNER_BLOCK 64
+
+typedef enum {
+    SV_CLASS_NEWLINE = 0,
+    SV_CLASS_SPACE,		// whitespace other than newline
+    SV_CLASS_STOP,		// newline or comment
+    SV_CLASS_COUNT,
+} Sv_Class;
+
+typedef struct {
+    String_View input;
+    char comment;
+
+    // * Masks of the block starting at `block`, bit i is input.data[block + i]
+    size_t block;
+    uint64_t masks[SV_CLASS_COUNT];
+
+    size_t cursor;		// next byte of the current line
+    size_t line_end;		// end of the current line, before any comment
+    size_t next_line;		// first byte after the current line
+} Sv_Scanner;
+
+void sv_scanner_init(Sv_Scanner *scanner, String_View input, char comment);
+bool sv_scanner_next_line(Sv_Scanner *scanner);
+String_View sv_scanner_token(Sv_Scanner *scanner);
+String_View sv_scanner_rest(Sv_Scanner *scanner);
 
 #endif // SV_H_
 
@@ -30,10 +77,8 @@ String_View SV(const char* str) {
 }
 
 String_View sv_chop_by_delim(String_View *sv, char delim) {
-    size_t i = 0;
-    while(i < sv->count && sv->data[i] != delim) {
-	i += 1;
-    }
+    const char *found = sv->count > 0 ? memchr(sv->data, delim, sv->count) : NULL;
+    size_t i = found != NULL ? (size_t)(found - sv->data) : sv->count;
 
     // printf("I: %d\n", i);
 
@@ -55,9 +100,14 @@ String_View sv_chop_by_delim(String_View *sv, char delim) {
     return res;
 }
 
+// * Same set as isspace in the C locale, without the locale lookup
+static bool sv_is_space(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
 String_View sv_trim_left(String_View sv) {
     size_t i = 0;
-    while(i < sv.count && isspace(sv.data[i])) {
+    while(i < sv.count && sv_is_space(sv.data[i])) {
 	i++;
     }
 
@@ -69,7 +119,7 @@ String_View sv_trim_left(String_View sv) {
 
 String_View sv_trim_right(String_View sv) {
     size_t i = 0;
-    while(i < sv.count && isspace(sv.data[sv.count - i - 1])) {
+    while(i < sv.count && sv_is_space(sv.data[sv.count - i - 1])) {
 	i++;
     }
 
@@ -86,5 +136,250 @@ bool sv_eq(String_View a, String_View b) {
     return (memcmp(a.data, b.data, a.count) == 0);
 }
 
+uint64_t sv_hash(String_View sv) {
+    // * FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for(size_t i = 0; i < sv.count; ++i) {
+	hash ^= (uint8_t)sv.data[i];
+	hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static int sv_digit_value(char c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'z') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'Z') return c - 'A' + 10;
+    return -1;
+}
+
+// * 'c' or one of the escapes '\n' '\t' '\r' '\0' '\\' '\''
+static Sv_Int_Status sv_parse_char(String_View sv, uint64_t *output) {
+    if(sv.count == 3 && sv.data[1] != '\\' && sv.data[2] == '\'') {
+	*output = (uint64_t)(unsigned char)sv.data[1];
+	return SV_INT_OK;
+    }
+    if(sv.count == 4 && sv.data[1] == '\\' && sv.data[3] == '\'') {
+	switch(sv.data[2]) {
+	case 'n':  *output = '\n'; return SV_INT_OK;
+	case 't':  *output = '\t'; return SV_INT_OK;
+	case 'r':  *output = '\r'; return SV_INT_OK;
+	case '0':  *output = '\0'; return SV_INT_OK;
+	case '\\': *output = '\\'; return SV_INT_OK;
+	case '\'': *output = '\''; return SV_INT_OK;
+	default: break;
+	}
+    }
+    return SV_INT_INVALID;
+}
+
+// * Parse the whole of sv as an integer literal without copying it: decimal,
+// * 0x hex, 0b binary or a char literal, optionally preceded by '-'. Negative
+// * values are stored two's complement. Positive values may use all 64 bits,
+// * negative ones have to fit in int64_t.
+Sv_Int_Status sv_parse_int(String_View sv, uint64_t *output) {
+    bool negative = false;
+    if(sv.count > 0 && sv.data[0] == '-') {
+	negative = true;
+	sv.data += 1;
+	sv.count -= 1;
+    }
+    if(sv.count == 0) {
+	return SV_INT_INVALID;
+    }
+
+    uint64_t result = 0;
+    if(sv.data[0] == '\'') {
+	Sv_Int_Status status = sv_parse_char(sv, &result);
+	if(status != SV_INT_OK) return status;
+    } else {
+	unsigned base = 10;
+	if(sv.count > 2 && sv.data[0] == '0' && (sv.data[1] == 'x' || sv.data[1] == 'X')) {
+	    base = 16;
+	} else if(sv.count > 2 && sv.data[0] == '0' && (sv.data[1] == 'b' || sv.data[1] == 'B')) {
+	    base = 2;
+	}
+	if(base != 10) {
+	    sv.data += 2;
+	    sv.count -= 2;
+	}
+
+	bool overflow = false;
+	for(size_t i = 0; i < sv.count; ++i) {
+	    int digit = sv_digit_value(sv.data[i]);
+	    if(digit < 0 || (unsigned)digit >= base) {
+		return SV_INT_INVALID;
+	    }
+	    // * Keep scanning after an overflow, `123abc` is still not a number
+	    if(result > (UINT64_MAX - (uint64_t)digit) / base) {
+		overflow = true;
+	    }
+	    result = result * base + (uint64_t)digit;
+	}
+	if(overflow) return SV_INT_OVERFLOW;
+    }
+
+    if(negative) {
+	if(result > (uint64_t)INT64_MAX + 1) return SV_INT_OVERFLOW;
+	result = (uint64_t)0 - result;
+    }
+
+    *output = result;
+    return SV_INT_OK;
+}
+
+static unsigned sv_ctz64(uint64_t x) {
+#if defined(__GNUC__)
+    return (unsigned)__builtin_ctzll(x);
+#else
+    unsigned n = 0;
+    while((x & 1) == 0) {
+	x >>= 1;
+	n += 1;
+    }
+    return n;
+#endif
+}
+
+// * Classify exactly SV_SCANNER_BLOCK bytes
+static void sv_classify_block(Sv_Scanner *scanner, const char *data) {
+    uint64_t newline = 0;
+    uint64_t space = 0;
+    uint64_t comment = 0;
+
+#if defined(__AVX2__)
+    const __m256i newline_byte = _mm256_set1_epi8('\n');
+    const __m256i space_byte = _mm256_set1_epi8(' ');
+    const __m256i comment_byte = _mm256_set1_epi8(scanner->comment);
+    const __m256i below_ctrl = _mm256_set1_epi8('\t' - 1);
+    const __m256i above_ctrl = _mm256_set1_epi8('\r' + 1);
+    for(unsigned i = 0; i < SV_SCANNER_BLOCK; i += 32) {
+	__m256i c = _mm256_loadu_si256((const __m256i *)(data + i));
+	__m256i nl = _mm256_cmpeq_epi8(c, newline_byte);
+	__m256i ctrl = _mm256_and_si256(_mm256_cmpgt_epi8(c, below_ctrl),
+					_mm256_cmpgt_epi8(above_ctrl, c));
+	__m256i sp = _mm256_or_si256(_mm256_cmpeq_epi8(c, space_byte),
+				     _mm256_andnot_si256(nl, ctrl));
+	__m256i cm = _mm256_cmpeq_epi8(c, comment_byte);
+	newline |= (uint64_t)(uint32_t)_mm256_movemask_epi8(nl) << i;
+	space |= (uint64_t)(uint32_t)_mm256_movemask_epi8(sp) << i;
+	comment |= (uint64_t)(uint32_t)_mm256_movemask_epi8(cm) << i;
+    }
+#elif defined(__SSE2__)
+    const __m128i newline_byte = _mm_set1_epi8('\n');
+    const __m128i space_byte = _mm_set1_epi8(' ');
+    const __m128i comment_byte = _mm_set1_epi8(scanner->comment);
+    const __m128i below_ctrl = _mm_set1_epi8('\t' - 1);
+    const __m128i above_ctrl = _mm_set1_epi8('\r' + 1);
+    for(unsigned i = 0; i < SV_SCANNER_BLOCK; i += 16) {
+	__m128i c = _mm_loadu_si128((const __m128i *)(data + i));
+	__m128i nl = _mm_cmpeq_epi8(c, newline_byte);
+	__m128i ctrl = _mm_and_si128(_mm_cmpgt_epi8(c, below_ctrl),
+				     _mm_cmplt_epi8(c, above_ctrl));
+	__m128i sp = _mm_or_si128(_mm_cmpeq_epi8(c, space_byte),
+				  _mm_andnot_si128(nl, ctrl));
+	__m128i cm = _mm_cmpeq_epi8(c, comment_byte);
+	newline |= (uint64_t)(uint32_t)_mm_movemask_epi8(nl) << i;
+	space |= (uint64_t)(uint32_t)_mm_movemask_epi8(sp) << i;
+	comment |= (uint64_t)(uint32_t)_mm_movemask_epi8(cm) << i;
+    }
+#else
+    for(unsigned i = 0; i < SV_SCANNER_BLOCK; ++i) {
+	uint64_t bit = (uint64_t)1 << i;
+	if(data[i] == '\n') newline |= bit;
+	else if(sv_is_space(data[i])) space |= bit;
+	if(data[i] == scanner->comment) comment |= bit;
+    }
+#endif
+
+    scanner->masks[SV_CLASS_NEWLINE] = newline;
+    scanner->masks[SV_CLASS_SPACE] = space;
+    scanner->masks[SV_CLASS_STOP] = newline | comment;
+}
+
+static void sv_scanner_load(Sv_Scanner *scanner, size_t block) {
+    size_t count = scanner->input.count - block;
+    if(count >= SV_SCANNER_BLOCK) {
+	sv_classify_block(scanner, scanner->input.data + block);
+    } else {
+	// * Tail of the input, zero bytes belong to no class
+	char tail[SV_SCANNER_BLOCK] = {0};
+	memcpy(tail, scanner->input.data + block, count);
+	sv_classify_block(scanner, tail);
+    }
+    scanner->block = block;
+}
+
+// * First position in [from, end) that is (present) or is not (!present) in
+// * the class, end if there is none
+static inline size_t sv_scanner_find(Sv_Scanner *scanner, size_t from, size_t end,
+				     Sv_Class kind, bool present) {
+    while(from < end) {
+	size_t block = from - from % SV_SCANNER_BLOCK;
+	if(block != scanner->block) {
+	    sv_scanner_load(scanner, block);
+	}
+	uint64_t mask = scanner->masks[kind];
+	if(!present) mask = ~mask;
+	mask &= ~(uint64_t)0 << (from - block);
+	if(mask != 0) {
+	    size_t found = block + sv_ctz64(mask);
+	    return found < end ? found : end;
+	}
+	from = block + SV_SCANNER_BLOCK;
+    }
+    return end;
+}
+
+void sv_scanner_init(Sv_Scanner *scanner, String_View input, char comment) {
+    memset(scanner, 0, sizeof(*scanner));
+    scanner->input = input;
+    scanner->comment = comment;
+    scanner->block = SIZE_MAX;
+}
+
+// * Move to the next line, false once the input is exhausted. A last line
+// * without a trailing newline still counts.
+bool sv_scanner_next_line(Sv_Scanner *scanner) {
+    const size_t count = scanner->input.count;
+    if(scanner->next_line >= count) {
+	return false;
+    }
+
+    size_t start = scanner->next_line;
+    size_t stop = sv_scanner_find(scanner, start, count, SV_CLASS_STOP, true);
+    size_t newline = stop;
+    if(stop < count && scanner->input.data[stop] != '\n') {
+	newline = sv_scanner_find(scanner, stop, count, SV_CLASS_NEWLINE, true);
+    }
+
+    scanner->cursor = start;
+    scanner->line_end = stop;
+    scanner->next_line = newline < count ? newline + 1 : count;
+    return true;
+}
+
+// * Next whitespace separated token of the current line, empty at its end
+String_View sv_scanner_token(Sv_Scanner *scanner) {
+    size_t start = sv_scanner_find(scanner, scanner->cursor, scanner->line_end, SV_CLASS_SPACE, false);
+    size_t end = sv_scanner_find(scanner, start, scanner->line_end, SV_CLASS_SPACE, true);
+    scanner->cursor = end;
+    return (String_View) {
+	.count = end - start,
+	.data = scanner->input.data + start,
+    };
+}
+
+// * Everything left on the current line with the whitespace around it trimmed
+String_View sv_scanner_rest(Sv_Scanner *scanner) {
+    size_t start = sv_scanner_find(scanner, scanner->cursor, scanner->line_end, SV_CLASS_SPACE, false);
+    String_View rest = {
+	.count = scanner->line_end - start,
+	.data = scanner->input.data + start,
+    };
+    scanner->cursor = scanner->line_end;
+    return sv_trim_right(rest);
+}
+
 
 #endif // SV_IMPLEMENTATION